@@ -50,6 +50,65 @@
 
 #define LAMEOS_SECTOR_SIZE 512
 
+// Drives and partitions the kernel keeps track of
+#define LAMEOS_MAX_DISKS 16
+
+// Most sectors moved per DRQ block with READ MULTIPLE
+#define LAMEOS_ATA_MAX_MULTIPLE 16
+
+// Most sectors in a chain of merged disk requests
+#define LAMEOS_DISK_QUEUE_MAX_MERGE_SECTORS 256
+
+// Most sectors one disk request may carry, the AHCI count field and the ATA
+// and virtio segment tables all take this many (4 MB)
+#define LAMEOS_DISK_MAX_TRANSFER_SECTORS 8192
+
+// Dispatches that may go ahead of a queued request before it is served
+// regardless of the elevator order
+#define LAMEOS_DISK_QUEUE_MAX_PASSES 8
+
+// Entries in each IDE channel's DMA PRD table. A merged chain of single
+// sector buffers needs one per sector.
+#define LAMEOS_ATA_MAX_PRDS 256
+
+// PRDT entries in each AHCI command table
+#define LAMEOS_AHCI_MAX_PRDS 256
+
+// Memory budget of the disk sector cache (1 MB)
+#define LAMEOS_DISK_CACHE_SIZE_BYTES (1024 * 1024)
+
+#define LAMEOS_DISK_CACHE_HASH_BUCKETS 1024
+
+// Dirty sectors the cache holds before it writes them all back
+#define LAMEOS_DISK_CACHE_MAX_DIRTY 512
+
+// TSC cycles a sector may stay dirty, about a second on a 2-4 GHz CPU
+#define LAMEOS_DISK_CACHE_WRITEBACK_CYCLES 0x100000000ULL
+
+// Set to 1 to copy the boot drive into memory at boot and run from the copy,
+// it then becomes disk 0 and the drive is moved to the end of the table
+#define LAMEOS_INITRD 0
+
+// Largest boot drive that is copied into memory (32 MB), a bigger one is
+// used in place
+#define LAMEOS_INITRD_MAX_SECTORS 65536
+
+// Sectors a disk stream reads at once when streaming sequentially
+#define LAMEOS_DISK_STREAM_WINDOW_SECTORS 16
+
+// Smallest and largest window a file being read sequentially is read ahead
+// by, the window doubles from one to the other while reads stay sequential
+#define LAMEOS_READAHEAD_MIN_SECTORS 8
+#define LAMEOS_READAHEAD_MAX_SECTORS 256
+
+// Path components each FAT16 filesystem keeps resolved
+#define LAMEOS_FAT16_DENTRY_CACHE_ENTRIES 256
+#define LAMEOS_FAT16_DENTRY_HASH_BUCKETS 64
+
+// Chunks of its FAT each FAT32 filesystem keeps in memory before clean ones
+// are dropped to make room, at 64 sectors a chunk
+#define LAMEOS_FAT32_RESIDENT_FAT_CHUNKS 16
+
 #define LAMEOS_MAX_FILESYSTEMS 12
 
 #define LAMEOS_MAX_FILE_DESCRIPTORS 512
@@ -0,0 +1,753 @@
+#include "ahci.h"
+#include "config.h"
+#include "disk.h"
+#include "memory/heap/kheap.h"
+#include "memory/memory.h"
+#include "pci/pci.h"
+#include "status.h"
+#include "string/string.h"
+
+/*
+ * AHCI SATA driver.
+ *
+ * Each port has a command list of up to 32 slots, every slot with its own
+ * command table holding the command FIS and a PRDT that scatters the
+ * transfer over the buffers of a merged request chain. Drives that support
+ * NCQ get READ/WRITE FPDMA QUEUED with a tag per slot, so as many commands
+ * as the drive and HBA allow are in flight at once and the drive orders
+ * them itself. Without NCQ one DMA command runs at a time.
+ *
+ * Completion is polled from the port's command issue and SActive registers,
+ * port interrupts are left disabled.
+ */
+
+// IDENTIFY DEVICE words
+#define AHCI_IDENTIFY_LBA_SECTORS 60
+#define AHCI_IDENTIFY_QUEUE_DEPTH 75
+#define AHCI_IDENTIFY_SATA_CAPABILITIES 76
+#define AHCI_IDENTIFY_COMMAND_SET_2 83
+#define AHCI_IDENTIFY_LBA48_SECTORS 100
+
+#define AHCI_SATA_CAPABILITY_NCQ 0x0100
+#define AHCI_COMMAND_SET_LBA48 0x0400
+#define AHCI_COMMAND_SET_FLUSH_CACHE 0x1000
+
+#define AHCI_PROG_IF_AHCI 0x01
+
+// Task file status bits mirrored in the port's TFD register
+#define AHCI_TFD_ERR 0x01
+#define AHCI_TFD_DRQ 0x08
+#define AHCI_TFD_BSY 0x80
+
+// A PRD moves at most 4 MB
+#define AHCI_PRD_MAX_BYTES 0x400000
+
+// Drives without LBA48 address 2^28 sectors, at most 256 per command
+#define AHCI_LBA28_TOTAL_SECTORS 0x10000000
+#define AHCI_LBA28_MAX_SECTORS 256
+
+#define AHCI_COMMAND_TABLE_SIZE                                               \
+  (sizeof (struct ahci_command_table)                                         \
+   + (LAMEOS_AHCI_MAX_PRDS * sizeof (struct ahci_prd)))
+
+static volatile struct ahci_hba *ahci_hba = 0;
+static struct ahci_port ahci_ports[AHCI_MAX_PORTS];
+static int ahci_total_ports = 0;
+
+static void
+ahci_port_stop (volatile struct ahci_port_registers *registers)
+{
+  registers->cmd &= ~AHCI_PORT_CMD_ST;
+  while (registers->cmd & AHCI_PORT_CMD_CR)
+    {
+    }
+
+  registers->cmd &= ~AHCI_PORT_CMD_FRE;
+  while (registers->cmd & AHCI_PORT_CMD_FR)
+    {
+    }
+}
+
+static void
+ahci_port_start (volatile struct ahci_port_registers *registers)
+{
+  while (registers->cmd & AHCI_PORT_CMD_CR)
+    {
+    }
+
+  registers->cmd |= AHCI_PORT_CMD_FRE;
+  registers->cmd |= AHCI_PORT_CMD_ST;
+}
+
+/**
+ * @brief Gives the port its command list, received FIS area and a command
+ * table per slot. The heap returns 4 KB aligned blocks, more than the 1 KB,
+ * 256 byte and 128 byte alignment the HBA needs.
+ */
+static int
+ahci_port_setup (struct ahci_port *port)
+{
+  volatile struct ahci_port_registers *registers = port->registers;
+  ahci_port_stop (registers);
+
+  port->command_list
+      = kzalloc (AHCI_MAX_SLOTS * sizeof (struct ahci_command_header));
+  port->received_fis = kzalloc (256);
+  if (!port->command_list || !port->received_fis)
+    {
+      return -ENOMEM;
+    }
+
+  for (int i = 0; i < AHCI_MAX_SLOTS; i++)
+    {
+      port->tables[i] = kzalloc (AHCI_COMMAND_TABLE_SIZE);
+      if (!port->tables[i])
+        {
+          return -ENOMEM;
+        }
+
+      port->command_list[i].ctba = (uint32_t)port->tables[i];
+      port->command_list[i].ctbau = 0;
+    }
+
+  registers->clb = (uint32_t)port->command_list;
+  registers->clbu = 0;
+  registers->fb = (uint32_t)port->received_fis;
+  registers->fbu = 0;
+
+  // Error and interrupt status bits are cleared by writing 1 to them
+  registers->serr = 0xFFFFFFFF;
+  registers->is = 0xFFFFFFFF;
+  registers->ie = 0;
+
+  ahci_port_start (registers);
+  return LAMEOS_OK;
+}
+
+/**
+ * @brief Stops a port that didn't come up and frees what ahci_port_setup
+ * gave it, so the slot can be probed again for the next port.
+ */
+static void
+ahci_port_release (struct ahci_port *port)
+{
+  volatile struct ahci_port_registers *registers = port->registers;
+  ahci_port_stop (registers);
+  registers->clb = 0;
+  registers->fb = 0;
+
+  for (int i = 0; i < AHCI_MAX_SLOTS; i++)
+    {
+      if (port->tables[i])
+        {
+          kfree (port->tables[i]);
+        }
+    }
+
+  if (port->command_list)
+    {
+      kfree (port->command_list);
+    }
+  if (port->received_fis)
+    {
+      kfree (port->received_fis);
+    }
+
+  memset (port, 0, sizeof (struct ahci_port));
+}
+
+/**
+ * @brief Fills a slot's command FIS. Without LBA48 the command is a 28-bit
+ * one, and LBA bits 24-27 go in the device register.
+ */
+static void
+ahci_build_fis (struct ahci_port *port, int slot, unsigned char command,
+                uint32_t lba, uint16_t count, uint16_t features)
+{
+  struct ahci_fis_reg_h2d *fis
+      = (struct ahci_fis_reg_h2d *)port->tables[slot]->cfis;
+  memset (fis, 0, sizeof (struct ahci_fis_reg_h2d));
+  fis->type = AHCI_FIS_TYPE_REG_H2D;
+  fis->flags = AHCI_FIS_COMMAND;
+  fis->command = command;
+  fis->device = AHCI_FIS_DEVICE_LBA;
+  fis->lba0 = lba & 0xFF;
+  fis->lba1 = (lba >> 8) & 0xFF;
+  fis->lba2 = (lba >> 16) & 0xFF;
+  if (port->features & AHCI_FEATURE_LBA48)
+    {
+      fis->lba3 = (lba >> 24) & 0xFF;
+    }
+  else
+    {
+      fis->device |= (lba >> 24) & 0x0F;
+    }
+  fis->count_low = count & 0xFF;
+  fis->count_high = count >> 8;
+  fis->feature_low = features & 0xFF;
+  fis->feature_high = features >> 8;
+}
+
+static int
+ahci_prd_add (struct ahci_command_table *table, int *total_prds, void *buf,
+              uint32_t bytes)
+{
+  uint32_t address = (uint32_t)buf;
+  if (address & 0x01)
+    {
+      return -EINVARG;
+    }
+
+  while (bytes > 0)
+    {
+      if (*total_prds >= LAMEOS_AHCI_MAX_PRDS)
+        {
+          return -EINVARG;
+        }
+
+      uint32_t chunk = bytes > AHCI_PRD_MAX_BYTES ? AHCI_PRD_MAX_BYTES : bytes;
+      struct ahci_prd *prd = &table->prdt[*total_prds];
+      prd->dba = address;
+      prd->dbau = 0;
+      prd->reserved = 0;
+      prd->flags = (chunk - 1) & AHCI_PRD_BYTES_MASK;
+
+      address += chunk;
+      bytes -= chunk;
+      (*total_prds)++;
+    }
+
+  return LAMEOS_OK;
+}
+
+/**
+ * @brief Describes total sectors of a request chain's buffers, from sector
+ * first on, in a slot's PRDT.
+ * @return int The PRDs used, or -EINVARG if the buffers don't fit.
+ */
+static int
+ahci_prepare (struct ahci_port *port, int slot, struct disk_request *request,
+              int first, int total)
+{
+  struct ahci_command_table *table = port->tables[slot];
+  int total_prds = 0;
+  int sector = first;
+  int end = first + total;
+  while (sector < end)
+    {
+      int contiguous = 0;
+      void *buf = disk_request_chain_ptr (request, sector, &contiguous);
+      int sectors = contiguous > end - sector ? end - sector : contiguous;
+      int res = ahci_prd_add (table, &total_prds, buf,
+                              sectors * LAMEOS_SECTOR_SIZE);
+      if (res < 0)
+        {
+          return res;
+        }
+
+      sector += sectors;
+    }
+
+  return total_prds;
+}
+
+static void
+ahci_issue_slot (struct ahci_port *port, int slot, int prds, int write,
+                 int queued)
+{
+  struct ahci_command_header *header = &port->command_list[slot];
+  header->flags = (sizeof (struct ahci_fis_reg_h2d) / sizeof (uint32_t))
+                  | AHCI_HEADER_CLEAR_BUSY;
+  if (write)
+    {
+      header->flags |= AHCI_HEADER_WRITE;
+    }
+  header->prdtl = prds;
+  header->prdbc = 0;
+
+  port->issued |= 1 << slot;
+
+  // A queued command is marked outstanding in SActive before it's issued
+  if (queued)
+    {
+      port->registers->sact = 1 << slot;
+    }
+  port->registers->ci = 1 << slot;
+}
+
+/**
+ * @brief Runs one command on slot 0 and polls until it completes. Only used
+ * while setting a port up, before its queue is in use.
+ */
+static int
+ahci_port_exec (struct ahci_port *port, unsigned char command, void *buf,
+                uint32_t bytes)
+{
+  volatile struct ahci_port_registers *registers = port->registers;
+  while (registers->tfd & (AHCI_TFD_BSY | AHCI_TFD_DRQ))
+    {
+    }
+
+  int prds = 0;
+  if (buf && ahci_prd_add (port->tables[0], &prds, buf, bytes) < 0)
+    {
+      return -EINVARG;
+    }
+
+  ahci_build_fis (port, 0, command, 0, 0, 0);
+  ahci_issue_slot (port, 0, prds, 0, 0);
+  port->issued = 0;
+
+  while (registers->ci & 0x01)
+    {
+      if (registers->is & AHCI_PORT_IS_ERRORS)
+        {
+          return -EIO;
+        }
+    }
+
+  if (registers->is & AHCI_PORT_IS_ERRORS || registers->tfd & AHCI_TFD_ERR)
+    {
+      return -EIO;
+    }
+
+  return LAMEOS_OK;
+}
+
+static void
+ahci_decode_identify (struct ahci_port *port, uint32_t hba_cap)
+{
+  uint16_t *identify = port->identify;
+  port->features = 0;
+  port->total_sectors = identify[AHCI_IDENTIFY_LBA_SECTORS]
+                        | (identify[AHCI_IDENTIFY_LBA_SECTORS + 1] << 16);
+  if (identify[AHCI_IDENTIFY_COMMAND_SET_2] & AHCI_COMMAND_SET_LBA48)
+    {
+      port->features |= AHCI_FEATURE_LBA48;
+
+      // Sectors past 32 bits aren't addressable by struct disk
+      uint32_t high = identify[AHCI_IDENTIFY_LBA48_SECTORS + 2]
+                      | (identify[AHCI_IDENTIFY_LBA48_SECTORS + 3] << 16);
+      port->total_sectors
+          = high ? 0xFFFFFFFF
+                 : (identify[AHCI_IDENTIFY_LBA48_SECTORS]
+                    | (identify[AHCI_IDENTIFY_LBA48_SECTORS + 1] << 16));
+    }
+
+  if (identify[AHCI_IDENTIFY_COMMAND_SET_2] & AHCI_COMMAND_SET_FLUSH_CACHE)
+    {
+      port->features |= AHCI_FEATURE_FLUSH_CACHE;
+    }
+
+  // FPDMA QUEUED commands are 48-bit ones
+  port->depth = 1;
+  if ((port->features & AHCI_FEATURE_LBA48) && (hba_cap & AHCI_CAP_SNCQ)
+      && (identify[AHCI_IDENTIFY_SATA_CAPABILITIES]
+          & AHCI_SATA_CAPABILITY_NCQ))
+    {
+      int slots = ((hba_cap >> AHCI_CAP_NCS_SHIFT) & AHCI_CAP_NCS_MASK) + 1;
+      int depth = (identify[AHCI_IDENTIFY_QUEUE_DEPTH] & 0x1F) + 1;
+      port->features |= AHCI_FEATURE_NCQ;
+      port->depth = depth < slots ? depth : slots;
+    }
+}
+
+static int
+ahci_port_probe (struct ahci_port *port)
+{
+  volatile struct ahci_port_registers *registers = port->registers;
+  uint32_t ssts = registers->ssts;
+  if ((ssts & 0x0F) != AHCI_SSTS_DET_PRESENT
+      || ((ssts >> 8) & 0x0F) != AHCI_SSTS_IPM_ACTIVE)
+    {
+      return -EIO;
+    }
+
+  if (registers->sig != AHCI_SIG_ATA)
+    {
+      return -EIO;
+    }
+
+  int res = ahci_port_setup (port);
+  if (res < 0)
+    {
+      goto out;
+    }
+
+  disk_queue_init (&port->queue);
+  res = ahci_port_exec (port, AHCI_COMMAND_IDENTIFY, port->identify,
+                        sizeof (port->identify));
+  if (res < 0)
+    {
+      goto out;
+    }
+
+  ahci_decode_identify (port, ahci_hba->cap);
+  port->present = 1;
+
+out:
+  if (res < 0)
+    {
+      ahci_port_release (port);
+    }
+  return res;
+}
+
+static int ahci_disk_submit (struct disk *disk, struct disk_request *request);
+static void ahci_disk_wait (struct disk *disk, struct disk_request *request);
+static void ahci_disk_plug (struct disk *disk);
+static void ahci_disk_unplug (struct disk *disk);
+static void ahci_disk_queue_stats (struct disk *disk,
+                                   struct disk_queue_stats *stats);
+
+struct disk_driver ahci_driver = { .submit = ahci_disk_submit,
+                                   .wait = ahci_disk_wait,
+                                   .plug = ahci_disk_plug,
+                                   .unplug = ahci_disk_unplug,
+                                   .queue_stats = ahci_disk_queue_stats };
+
+/**
+ * @brief Finds the AHCI controller, switches it to AHCI mode and sets up
+ * every port with a SATA drive on it.
+ * @return struct disk_driver* The driver, or 0 if there is no controller.
+ */
+struct disk_driver *
+ahci_init ()
+{
+  strcpy (ahci_driver.name, "AHCI");
+  memset (ahci_ports, 0, sizeof (ahci_ports));
+  ahci_total_ports = 0;
+
+  struct pci_device controller;
+  if (pci_find_class (PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_SATA, 0,
+                      &controller)
+          != LAMEOS_OK
+      || controller.prog_if != AHCI_PROG_IF_AHCI)
+    {
+      return 0;
+    }
+
+  // The kernel maps the whole 4 GB identity, so the ABAR is addressable
+  ahci_hba = (struct ahci_hba *)pci_bar_mem_base (&controller, AHCI_ABAR);
+  if (!ahci_hba)
+    {
+      return 0;
+    }
+
+  pci_enable_bus_master (&controller);
+  ahci_hba->ghc |= AHCI_GHC_AE;
+
+  uint32_t implemented = ahci_hba->pi;
+  for (int i = 0; i < AHCI_MAX_PORTS; i++)
+    {
+      if (!(implemented & (1 << i)))
+        {
+          continue;
+        }
+
+      struct ahci_port *port = &ahci_ports[ahci_total_ports];
+      port->registers = &ahci_hba->ports[i];
+      port->index = i;
+      if (ahci_port_probe (port) == LAMEOS_OK)
+        {
+          ahci_total_ports++;
+        }
+    }
+
+  return &ahci_driver;
+}
+
+/**
+ * @brief The index'th port that has a drive, 0 if there are fewer.
+ */
+struct ahci_port *
+ahci_get_port (int index)
+{
+  if (index < 0 || index >= ahci_total_ports)
+    {
+      return 0;
+    }
+
+  return &ahci_ports[index];
+}
+
+static int
+ahci_free_slot (struct ahci_port *port)
+{
+  for (int i = 0; i < port->depth; i++)
+    {
+      if (!(port->issued & (1 << i)))
+        {
+          return i;
+        }
+    }
+
+  return -1;
+}
+
+/**
+ * @brief Sends a request chain on a free slot. A drive without LBA48 takes
+ * the chain in commands of at most 256 sectors, request->completed counts
+ * the sectors already moved and this sends the next command.
+ * @return int LAMEOS_OK, or a negative status if it couldn't be sent.
+ */
+static int
+ahci_issue (struct ahci_port *port, int slot, struct disk_request *request)
+{
+  int lba48 = port->features & AHCI_FEATURE_LBA48;
+  if (request->type == DISK_REQUEST_FLUSH)
+    {
+      ahci_build_fis (port, slot,
+                      lba48 ? AHCI_COMMAND_FLUSH_CACHE_EXT
+                            : AHCI_COMMAND_FLUSH_CACHE,
+                      0, 0, 0);
+      ahci_issue_slot (port, slot, 0, 0, 0);
+      return LAMEOS_OK;
+    }
+
+  int total = disk_request_chain_total (request);
+  if (total > 0xFFFF
+      || (!lba48
+          && (request->lba >= AHCI_LBA28_TOTAL_SECTORS
+              || (uint32_t)total > AHCI_LBA28_TOTAL_SECTORS - request->lba)))
+    {
+      return -EINVARG;
+    }
+
+  int first = request->completed;
+  int count = total - first;
+  if (!lba48 && count > AHCI_LBA28_MAX_SECTORS)
+    {
+      count = AHCI_LBA28_MAX_SECTORS;
+    }
+
+  int prds = ahci_prepare (port, slot, request, first, count);
+  if (prds < 0)
+    {
+      return prds;
+    }
+
+  port->command_sectors = count;
+  int write = request->type == DISK_REQUEST_WRITE;
+  if (port->features & AHCI_FEATURE_NCQ)
+    {
+      // FPDMA QUEUED takes the sector count in features, the tag in count
+      ahci_build_fis (port, slot,
+                      write ? AHCI_COMMAND_WRITE_FPDMA_QUEUED
+                            : AHCI_COMMAND_READ_FPDMA_QUEUED,
+                      request->lba, slot << 3, total);
+      ahci_issue_slot (port, slot, prds, write, 1);
+      return LAMEOS_OK;
+    }
+
+  unsigned char command;
+  if (lba48)
+    {
+      command = write ? AHCI_COMMAND_WRITE_DMA_EXT : AHCI_COMMAND_READ_DMA_EXT;
+    }
+  else
+    {
+      command = write ? AHCI_COMMAND_WRITE_DMA : AHCI_COMMAND_READ_DMA;
+    }
+
+  // A 28-bit count of 0 means 256 sectors
+  ahci_build_fis (port, slot, command, request->lba + first,
+                  lba48 ? count : count & 0xFF, 0);
+  ahci_issue_slot (port, slot, prds, write, 0);
+  return LAMEOS_OK;
+}
+
+/**
+ * @brief Issues queued requests until the port's slots are full. A command
+ * that can't be queued (a flush, or anything without NCQ) waits for the
+ * port to drain and then runs alone.
+ */
+static void
+ahci_port_dispatch (struct ahci_port *port)
+{
+  while (!port->exclusive)
+    {
+      struct disk_request *request = port->pending;
+      port->pending = 0;
+      if (!request)
+        {
+          request = disk_queue_next (&port->queue);
+        }
+
+      if (!request)
+        {
+          return;
+        }
+
+      int exclusive = !(port->features & AHCI_FEATURE_NCQ)
+                      || request->type == DISK_REQUEST_FLUSH;
+      int slot = ahci_free_slot (port);
+      if ((exclusive && port->issued) || slot < 0)
+        {
+          port->pending = request;
+          return;
+        }
+
+      int res = ahci_issue (port, slot, request);
+      if (res < 0)
+        {
+          disk_request_chain_finish (request, res);
+          continue;
+        }
+
+      port->slots[slot] = request;
+      port->exclusive = exclusive;
+    }
+}
+
+/**
+ * @brief Fails everything in flight after the port stopped on an error and
+ * restarts it.
+ */
+static void
+ahci_port_recover (struct ahci_port *port)
+{
+  volatile struct ahci_port_registers *registers = port->registers;
+  ahci_port_stop (registers);
+  registers->serr = 0xFFFFFFFF;
+  registers->is = 0xFFFFFFFF;
+
+  uint32_t issued = port->issued;
+  port->issued = 0;
+  port->exclusive = 0;
+  for (int i = 0; i < AHCI_MAX_SLOTS; i++)
+    {
+      if (issued & (1 << i))
+        {
+          struct disk_request *request = port->slots[i];
+          port->slots[i] = 0;
+          disk_request_chain_finish (request, -EIO);
+        }
+    }
+
+  ahci_port_start (registers);
+}
+
+/**
+ * @brief Completes the commands the drive has finished and refills the
+ * slots. A queued command is done once its SActive bit clears, any other
+ * once its command issue bit does.
+ */
+static void
+ahci_port_service (struct ahci_port *port)
+{
+  volatile struct ahci_port_registers *registers = port->registers;
+  if (registers->is & AHCI_PORT_IS_ERRORS)
+    {
+      ahci_port_recover (port);
+      ahci_port_dispatch (port);
+      return;
+    }
+
+  uint32_t finished = port->issued & ~(registers->sact | registers->ci);
+  registers->is = registers->is;
+  if (!finished)
+    {
+      return;
+    }
+
+  for (int i = 0; i < AHCI_MAX_SLOTS; i++)
+    {
+      if (!(finished & (1 << i)))
+        {
+          continue;
+        }
+
+      struct disk_request *request = port->slots[i];
+      port->issued &= ~(1 << i);
+
+      // A chain sent in several commands continues on the same slot
+      if (!(port->features & AHCI_FEATURE_NCQ)
+          && request->type != DISK_REQUEST_FLUSH)
+        {
+          request->completed += port->command_sectors;
+          if (request->completed < disk_request_chain_total (request))
+            {
+              int res = ahci_issue (port, i, request);
+              if (res == LAMEOS_OK)
+                {
+                  continue;
+                }
+
+              port->slots[i] = 0;
+              port->exclusive = 0;
+              disk_request_chain_finish (request, res);
+              continue;
+            }
+        }
+
+      port->slots[i] = 0;
+      port->exclusive = 0;
+      disk_request_chain_finish (request, LAMEOS_OK);
+    }
+
+  ahci_port_dispatch (port);
+}
+
+static int
+ahci_disk_submit (struct disk *disk, struct disk_request *request)
+{
+  struct ahci_port *port = disk->driver_private;
+  request->completed = 0;
+  request->done = 0;
+  request->status = 0;
+
+  if (request->type == DISK_REQUEST_FLUSH
+      && !(port->features & AHCI_FEATURE_FLUSH_CACHE))
+    {
+      disk_request_complete (request, LAMEOS_OK);
+      return LAMEOS_OK;
+    }
+
+  disk_queue_add (&port->queue, request);
+  ahci_port_dispatch (port);
+  return LAMEOS_OK;
+}
+
+/**
+ * @brief Polls until a request is done. Every port is serviced meanwhile, so
+ * requests submitted to other drives keep moving.
+ */
+static void
+ahci_disk_wait (struct disk *disk, struct disk_request *request)
+{
+  while (!request->done)
+    {
+      for (int i = 0; i < ahci_total_ports; i++)
+        {
+          if (ahci_ports[i].issued)
+            {
+              ahci_port_service (&ahci_ports[i]);
+            }
+        }
+    }
+}
+
+static void
+ahci_disk_plug (struct disk *disk)
+{
+  struct ahci_port *port = disk->driver_private;
+  disk_queue_plug (&port->queue);
+}
+
+static void
+ahci_disk_unplug (struct disk *disk)
+{
+  struct ahci_port *port = disk->driver_private;
+  if (disk_queue_unplug (&port->queue))
+    {
+      ahci_port_dispatch (port);
+    }
+}
+
+static void
+ahci_disk_queue_stats (struct disk *disk, struct disk_queue_stats *stats)
+{
+  struct ahci_port *port = disk->driver_private;
+  *stats = port->queue.stats;
+}
@@ -0,0 +1,212 @@
+#ifndef AHCI_H
+#define AHCI_H
+
+#include "queue.h"
+#include <stdint.h>
+
+// The ABAR, the HBA's registers, is in BAR5
+#define AHCI_ABAR 5
+
+#define AHCI_MAX_PORTS 32
+#define AHCI_MAX_SLOTS 32
+
+// Generic host control bits
+#define AHCI_CAP_NCS_SHIFT 8
+#define AHCI_CAP_NCS_MASK 0x1F
+#define AHCI_CAP_SSS 0x08000000
+#define AHCI_CAP_SNCQ 0x40000000
+#define AHCI_GHC_AE 0x80000000
+
+// Port command and status bits
+#define AHCI_PORT_CMD_ST 0x00000001
+#define AHCI_PORT_CMD_SUD 0x00000002
+#define AHCI_PORT_CMD_FRE 0x00000010
+#define AHCI_PORT_CMD_FR 0x00004000
+#define AHCI_PORT_CMD_CR 0x00008000
+
+// Port interrupt status bits that mean the port stopped on an error
+#define AHCI_PORT_IS_TFES 0x40000000
+#define AHCI_PORT_IS_HBFS 0x20000000
+#define AHCI_PORT_IS_HBDS 0x10000000
+#define AHCI_PORT_IS_IFS 0x08000000
+#define AHCI_PORT_IS_ERRORS                                                   \
+  (AHCI_PORT_IS_TFES | AHCI_PORT_IS_HBFS | AHCI_PORT_IS_HBDS                  \
+   | AHCI_PORT_IS_IFS)
+
+// Device detection and interface power management in the port's SSTS
+#define AHCI_SSTS_DET_PRESENT 0x3
+#define AHCI_SSTS_IPM_ACTIVE 0x1
+
+// Signature of a port with a plain SATA drive behind it
+#define AHCI_SIG_ATA 0x00000101
+
+#define AHCI_FIS_TYPE_REG_H2D 0x27
+// Set in a host to device register FIS that carries a command
+#define AHCI_FIS_COMMAND 0x80
+#define AHCI_FIS_DEVICE_LBA 0x40
+
+#define AHCI_COMMAND_READ_DMA 0xC8
+#define AHCI_COMMAND_WRITE_DMA 0xCA
+#define AHCI_COMMAND_FLUSH_CACHE 0xE7
+#define AHCI_COMMAND_READ_DMA_EXT 0x25
+#define AHCI_COMMAND_WRITE_DMA_EXT 0x35
+#define AHCI_COMMAND_READ_FPDMA_QUEUED 0x60
+#define AHCI_COMMAND_WRITE_FPDMA_QUEUED 0x61
+#define AHCI_COMMAND_IDENTIFY 0xEC
+#define AHCI_COMMAND_FLUSH_CACHE_EXT 0xEA
+
+// Command header flags, the FIS length in dwords is in the low bits
+#define AHCI_HEADER_WRITE 0x0040
+#define AHCI_HEADER_CLEAR_BUSY 0x0400
+
+// Byte count field of a PRD, and the bit asking for an interrupt once the
+// region is done
+#define AHCI_PRD_BYTES_MASK 0x003FFFFF
+#define AHCI_PRD_INTERRUPT 0x80000000
+
+// Feature bits decoded from the IDENTIFY DEVICE data
+#define AHCI_FEATURE_LBA48 0b00000001
+#define AHCI_FEATURE_NCQ 0b00000010
+#define AHCI_FEATURE_FLUSH_CACHE 0b00000100
+
+#define AHCI_IDENTIFY_WORDS 256
+
+struct disk_request;
+struct disk_driver;
+
+struct ahci_port_registers
+{
+  uint32_t clb;
+  uint32_t clbu;
+  uint32_t fb;
+  uint32_t fbu;
+  uint32_t is;
+  uint32_t ie;
+  uint32_t cmd;
+  uint32_t reserved0;
+  uint32_t tfd;
+  uint32_t sig;
+  uint32_t ssts;
+  uint32_t sctl;
+  uint32_t serr;
+  uint32_t sact;
+  uint32_t ci;
+  uint32_t sntf;
+  uint32_t fbs;
+  uint32_t reserved1[11];
+  uint32_t vendor[4];
+} __attribute__ ((packed));
+
+// The HBA's memory mapped registers, found through the ABAR
+struct ahci_hba
+{
+  uint32_t cap;
+  uint32_t ghc;
+  uint32_t is;
+  uint32_t pi;
+  uint32_t vs;
+  uint32_t ccc_ctl;
+  uint32_t ccc_ports;
+  uint32_t em_loc;
+  uint32_t em_ctl;
+  uint32_t cap2;
+  uint32_t bohc;
+  uint8_t reserved[0xA0 - 0x2C];
+  uint8_t vendor[0x100 - 0xA0];
+  struct ahci_port_registers ports[AHCI_MAX_PORTS];
+} __attribute__ ((packed));
+
+// One slot of a port's command list
+struct ahci_command_header
+{
+  uint16_t flags;
+  // Entries in the command table's PRDT
+  uint16_t prdtl;
+  // Bytes transferred, written by the HBA
+  uint32_t prdbc;
+  uint32_t ctba;
+  uint32_t ctbau;
+  uint32_t reserved[4];
+} __attribute__ ((packed));
+
+struct ahci_fis_reg_h2d
+{
+  uint8_t type;
+  uint8_t flags;
+  uint8_t command;
+  uint8_t feature_low;
+  uint8_t lba0;
+  uint8_t lba1;
+  uint8_t lba2;
+  uint8_t device;
+  uint8_t lba3;
+  uint8_t lba4;
+  uint8_t lba5;
+  uint8_t feature_high;
+  uint8_t count_low;
+  uint8_t count_high;
+  uint8_t icc;
+  uint8_t control;
+  uint8_t reserved[4];
+} __attribute__ ((packed));
+
+struct ahci_prd
+{
+  uint32_t dba;
+  uint32_t dbau;
+  uint32_t reserved;
+  // Byte count minus one, must be even
+  uint32_t flags;
+} __attribute__ ((packed));
+
+// The command FIS and scatter-gather list of one command slot
+struct ahci_command_table
+{
+  uint8_t cfis[64];
+  uint8_t acmd[16];
+  uint8_t reserved[48];
+  struct ahci_prd prdt[];
+} __attribute__ ((packed));
+
+struct ahci_port
+{
+  volatile struct ahci_port_registers *registers;
+  int index;
+
+  // Set once IDENTIFY DEVICE found a SATA drive on the port
+  int present;
+
+  // Bitmask of AHCI_FEATURE_*
+  uint32_t features;
+  uint32_t total_sectors;
+
+  // Commands that may be in flight at once, 1 without NCQ
+  int depth;
+
+  struct ahci_command_header *command_list;
+  void *received_fis;
+  struct ahci_command_table *tables[AHCI_MAX_SLOTS];
+
+  // The request chain each slot carries, and a bit per slot in use
+  struct disk_request *slots[AHCI_MAX_SLOTS];
+  uint32_t issued;
+
+  // Sectors the command in flight moves, a 28-bit drive may take several
+  // commands per request chain
+  int command_sectors;
+
+  // Set while a command that can't be queued with others is in flight
+  int exclusive;
+
+  // A request taken off the queue that waits for the port to drain
+  struct disk_request *pending;
+
+  struct disk_queue queue;
+
+  uint16_t identify[AHCI_IDENTIFY_WORDS];
+};
+
+struct disk_driver *ahci_init ();
+struct ahci_port *ahci_get_port (int index);
+
+#endif
@@ -0,0 +1,888 @@
+#include "ata.h"
+#include "config.h"
+#include "disk.h"
+#include "idt/idt.h"
+#include "io/io.h"
+#include "memory/heap/kheap.h"
+#include "memory/memory.h"
+#include "pci/pci.h"
+#include "status.h"
+#include "string/string.h"
+
+#define ATA_WORDS_PER_SECTOR (LAMEOS_SECTOR_SIZE / 2)
+
+// IDENTIFY DEVICE words
+#define ATA_IDENTIFY_MAX_MULTIPLE 47
+#define ATA_IDENTIFY_CAPABILITIES 49
+#define ATA_IDENTIFY_LBA_SECTORS 60
+#define ATA_IDENTIFY_COMMAND_SET_2 83
+#define ATA_IDENTIFY_LBA48_SECTORS 100
+
+#define ATA_CAPABILITY_DMA 0x0100
+#define ATA_CAPABILITY_LBA 0x0200
+#define ATA_COMMAND_SET_LBA48 0x0400
+#define ATA_COMMAND_SET_FLUSH_CACHE 0x1000
+
+// The bus master IDE ports are in BAR4, the secondary channel's 8 bytes in
+#define ATA_BM_BAR 4
+
+// Most sectors in one command, a count of 0 stands for these
+#define ATA_MAX_SECTORS_LBA28 256
+#define ATA_MAX_SECTORS_LBA48 65536
+#define ATA_BM_CHANNEL_PORTS 8
+
+// Programming interface bit of an IDE controller that can bus master
+#define ATA_PROG_IF_BUS_MASTER 0x80
+
+static struct ata_channel ata_channels[ATA_TOTAL_CHANNELS];
+
+static unsigned char
+ata_status (struct ata_device *device)
+{
+  return insb (device->io_base + ATA_REG_STATUS);
+}
+
+/**
+ * @brief Gives the drive its 400ns to settle after a command or transfer.
+ * Reading the alternate status register doesn't acknowledge anything, four
+ * reads take long enough for the status register to become valid.
+ */
+static void
+ata_delay (struct ata_device *device)
+{
+  for (int i = 0; i < 4; i++)
+    {
+      insb (device->ctrl_base);
+    }
+}
+
+static unsigned char
+ata_wait_not_busy (struct ata_device *device)
+{
+  unsigned char status = ata_status (device);
+  while (status & ATA_STATUS_BSY)
+    {
+      status = ata_status (device);
+    }
+
+  return status;
+}
+
+/**
+ * @brief Waits for the drive to be ready to transfer a block of data.
+ * @return int LAMEOS_OK if data is ready, -EIO on a drive error.
+ */
+static int
+ata_wait_drq (struct ata_device *device)
+{
+  ata_delay (device);
+  unsigned char status = ata_wait_not_busy (device);
+  if (status & (ATA_STATUS_ERR | ATA_STATUS_DF))
+    {
+      return -EIO;
+    }
+
+  if (!(status & ATA_STATUS_DRQ))
+    {
+      return -EIO;
+    }
+
+  return LAMEOS_OK;
+}
+
+static void
+ata_select (struct ata_device *device, uint32_t lba)
+{
+  outb (device->io_base + ATA_REG_DRIVE,
+        0xE0 | (device->slave << 4) | ((lba >> 24) & 0x0F));
+  ata_delay (device);
+}
+
+static void
+ata_command (struct ata_device *device, uint32_t lba, int total,
+             unsigned char command)
+{
+  ata_select (device, lba);
+  outb (device->io_base + ATA_REG_SECTOR_COUNT, (unsigned char)total);
+  outb (device->io_base + ATA_REG_LBA_LOW, (unsigned char)(lba & 0xff));
+  outb (device->io_base + ATA_REG_LBA_MID, (unsigned char)(lba >> 8));
+  outb (device->io_base + ATA_REG_LBA_HIGH, (unsigned char)(lba >> 16));
+  outb (device->io_base + ATA_REG_COMMAND, command);
+}
+
+/**
+ * @brief Issues a 48-bit LBA command. Each register is a two byte FIFO, the
+ * high order bytes are written first.
+ */
+static void
+ata_command_ext (struct ata_device *device, uint32_t lba, int total,
+                 unsigned char command)
+{
+  uint16_t io_base = device->io_base;
+  outb (io_base + ATA_REG_DRIVE, 0x40 | (device->slave << 4));
+  ata_delay (device);
+
+  // LBA bits 32-47 are always 0, struct disk addresses 32 bits
+  outb (io_base + ATA_REG_SECTOR_COUNT, (unsigned char)(total >> 8));
+  outb (io_base + ATA_REG_LBA_LOW, (unsigned char)(lba >> 24));
+  outb (io_base + ATA_REG_LBA_MID, 0);
+  outb (io_base + ATA_REG_LBA_HIGH, 0);
+  outb (io_base + ATA_REG_SECTOR_COUNT, (unsigned char)total);
+  outb (io_base + ATA_REG_LBA_LOW, (unsigned char)(lba & 0xff));
+  outb (io_base + ATA_REG_LBA_MID, (unsigned char)(lba >> 8));
+  outb (io_base + ATA_REG_LBA_HIGH, (unsigned char)(lba >> 16));
+  outb (io_base + ATA_REG_COMMAND, command);
+}
+
+static int
+ata_lba48 (struct ata_device *device)
+{
+  return device->features & ATA_FEATURE_LBA48;
+}
+
+/**
+ * @brief Issues a transfer command, in its LBA48 form if the drive has it.
+ * @param total Sectors to move, at most ata_max_sectors.
+ */
+static void
+ata_command_rw (struct ata_device *device, uint32_t lba, int total,
+                unsigned char command)
+{
+  // A sector count of 0 means the maximum
+  if (ata_lba48 (device))
+    {
+      ata_command_ext (device, lba, total == ATA_MAX_SECTORS_LBA48 ? 0 : total,
+                       command);
+      return;
+    }
+
+  ata_command (device, lba, total == ATA_MAX_SECTORS_LBA28 ? 0 : total,
+               command);
+}
+
+static int
+ata_max_sectors (struct ata_device *device)
+{
+  return ata_lba48 (device) ? ATA_MAX_SECTORS_LBA48 : ATA_MAX_SECTORS_LBA28;
+}
+
+static void
+ata_decode_identify (struct ata_device *device)
+{
+  uint16_t *identify = device->identify;
+  device->features = 0;
+  if (identify[ATA_IDENTIFY_CAPABILITIES] & ATA_CAPABILITY_LBA)
+    {
+      device->features |= ATA_FEATURE_LBA;
+    }
+
+  if (identify[ATA_IDENTIFY_CAPABILITIES] & ATA_CAPABILITY_DMA)
+    {
+      device->features |= ATA_FEATURE_DMA;
+    }
+
+  if (identify[ATA_IDENTIFY_COMMAND_SET_2] & ATA_COMMAND_SET_LBA48)
+    {
+      device->features |= ATA_FEATURE_LBA48;
+    }
+
+  if (identify[ATA_IDENTIFY_COMMAND_SET_2] & ATA_COMMAND_SET_FLUSH_CACHE)
+    {
+      device->features |= ATA_FEATURE_FLUSH_CACHE;
+    }
+
+  device->total_sectors = identify[ATA_IDENTIFY_LBA_SECTORS]
+                          | (identify[ATA_IDENTIFY_LBA_SECTORS + 1] << 16);
+  if (device->features & ATA_FEATURE_LBA48)
+    {
+      uint32_t high = identify[ATA_IDENTIFY_LBA48_SECTORS + 2]
+                      | (identify[ATA_IDENTIFY_LBA48_SECTORS + 3] << 16);
+      device->total_sectors
+          = high ? 0xFFFFFFFF
+                 : (identify[ATA_IDENTIFY_LBA48_SECTORS]
+                    | (identify[ATA_IDENTIFY_LBA48_SECTORS + 1] << 16));
+    }
+  device->max_multiple = identify[ATA_IDENTIFY_MAX_MULTIPLE] & 0xFF;
+}
+
+/**
+ * @brief Puts the drive in block mode so READ MULTIPLE moves several sectors
+ * per DRQ handshake. Falls back to single sector transfers if the drive
+ * doesn't support it.
+ */
+static void
+ata_set_multiple_mode (struct ata_device *device)
+{
+  int multiple = device->max_multiple;
+  if (multiple > LAMEOS_ATA_MAX_MULTIPLE)
+    {
+      multiple = LAMEOS_ATA_MAX_MULTIPLE;
+    }
+
+  device->multiple = 0;
+  if (multiple <= 1)
+    {
+      return;
+    }
+
+  ata_command (device, 0, multiple, ATA_COMMAND_SET_MULTIPLE_MODE);
+  ata_delay (device);
+  unsigned char status = ata_wait_not_busy (device);
+  if (status & (ATA_STATUS_ERR | ATA_STATUS_DF))
+    {
+      return;
+    }
+
+  device->multiple = multiple;
+}
+
+/**
+ * @brief Finds the PCI IDE controller and sets the channels up for bus
+ * master DMA. Channels are left on PIO if there's no controller that can.
+ */
+static void
+ata_dma_init ()
+{
+  struct pci_device controller;
+  if (pci_find_class (PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_IDE, 0,
+                      &controller)
+      != LAMEOS_OK)
+    {
+      return;
+    }
+
+  if (!(controller.prog_if & ATA_PROG_IF_BUS_MASTER))
+    {
+      return;
+    }
+
+  uint32_t bm_base = pci_bar_io_base (&controller, ATA_BM_BAR);
+  if (!bm_base)
+    {
+      return;
+    }
+
+  pci_enable_bus_master (&controller);
+  for (int i = 0; i < ATA_TOTAL_CHANNELS; i++)
+    {
+      struct ata_channel *channel = &ata_channels[i];
+
+      // Heap blocks are 4 KB aligned, so the table can't cross 64 KB
+      channel->prdt = kzalloc (LAMEOS_ATA_MAX_PRDS * sizeof (struct ata_prd));
+      if (!channel->prdt)
+        {
+          continue;
+        }
+
+      channel->bm_base = bm_base + (i * ATA_BM_CHANNEL_PORTS);
+    }
+}
+
+static void ata_primary_interrupt ();
+static void ata_secondary_interrupt ();
+static int ata_disk_submit (struct disk *disk, struct disk_request *request);
+static void ata_disk_wait (struct disk *disk, struct disk_request *request);
+static void ata_disk_plug (struct disk *disk);
+static void ata_disk_unplug (struct disk *disk);
+static void ata_disk_queue_stats (struct disk *disk,
+                                  struct disk_queue_stats *stats);
+
+struct disk_driver ata_driver = { .submit = ata_disk_submit,
+                                  .wait = ata_disk_wait,
+                                  .plug = ata_disk_plug,
+                                  .unplug = ata_disk_unplug,
+                                  .queue_stats = ata_disk_queue_stats };
+
+struct disk_driver *
+ata_init ()
+{
+  strcpy (ata_driver.name, "ATA");
+  memset (ata_channels, 0, sizeof (ata_channels));
+  for (int i = 0; i < ATA_TOTAL_CHANNELS; i++)
+    {
+      disk_queue_init (&ata_channels[i].queue);
+    }
+
+  ata_channels[ATA_PRIMARY_CHANNEL].io_base = ATA_PRIMARY_IO_BASE;
+  ata_channels[ATA_PRIMARY_CHANNEL].ctrl_base = ATA_PRIMARY_CTRL_BASE;
+  ata_channels[ATA_SECONDARY_CHANNEL].io_base = ATA_SECONDARY_IO_BASE;
+  ata_channels[ATA_SECONDARY_CHANNEL].ctrl_base = ATA_SECONDARY_CTRL_BASE;
+  idt_register_irq_handler (ATA_PRIMARY_IRQ, ata_primary_interrupt);
+  idt_register_irq_handler (ATA_SECONDARY_IRQ, ata_secondary_interrupt);
+  ata_dma_init ();
+  return &ata_driver;
+}
+
+/**
+ * @brief Probes a drive with IDENTIFY DEVICE and configures block mode.
+ * @param device The device to fill in.
+ * @param channel The channel the drive is on, e.g. ATA_PRIMARY_CHANNEL.
+ * @param slave 0 for the master drive, 1 for the slave.
+ * @return int LAMEOS_OK if an ATA drive answered, -EIO otherwise.
+ */
+int
+ata_identify (struct ata_device *device, ATA_CHANNEL channel, int slave)
+{
+  int res = 0;
+  memset (device, 0, sizeof (struct ata_device));
+  device->channel = &ata_channels[channel];
+  device->io_base = device->channel->io_base;
+  device->ctrl_base = device->channel->ctrl_base;
+  device->slave = slave;
+  uint16_t io_base = device->io_base;
+
+  ata_command (device, 0, 0, ATA_COMMAND_IDENTIFY);
+
+  // A floating bus reads 0xFF, no drive at all reads 0x00
+  unsigned char status = ata_status (device);
+  if (status == 0x00 || status == 0xFF)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  ata_wait_not_busy (device);
+
+  // ATAPI and SATA devices put a signature here and abort IDENTIFY DEVICE
+  if (insb (io_base + ATA_REG_LBA_MID) || insb (io_base + ATA_REG_LBA_HIGH))
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  res = ata_wait_drq (device);
+  if (res < 0)
+    {
+      goto out;
+    }
+
+  insw_rep (io_base + ATA_REG_DATA, device->identify, ATA_IDENTIFY_WORDS);
+  ata_decode_identify (device);
+  ata_set_multiple_mode (device);
+  device->present = 1;
+
+out:
+  return res;
+}
+
+static void ata_channel_start (struct ata_channel *channel);
+
+static void
+ata_request_finish (struct ata_channel *channel, int status)
+{
+  struct disk_request *request = channel->active;
+  channel->active = 0;
+  channel->command_remaining = 0;
+  disk_request_chain_finish (request, status);
+
+  ata_channel_start (channel);
+}
+
+/**
+ * @brief Describes the buffers of a command in the channel's PRD table.
+ * The kernel is identity mapped, so a buffer's address is its physical
+ * address. Each buffer of a merged chain gets its own regions, split wherever
+ * they cross a 64 KB boundary.
+ * @param request The active request chain.
+ * @param sector The first sector of the command, from the start of the chain.
+ * @param total Sectors in the command.
+ * @return int LAMEOS_OK, -ENOMEM if the PRD table is too small for that
+ * many sectors, or -EINVARG if the buffers can't be used for DMA.
+ */
+static int
+ata_dma_prepare (struct ata_channel *channel, struct disk_request *request,
+                 int sector, int total)
+{
+  int total_prds = 0;
+  while (total > 0)
+    {
+      int contiguous = 0;
+      void *buf = disk_request_chain_ptr (request, sector, &contiguous);
+      int sectors = contiguous > total ? total : contiguous;
+      uint32_t address = (uint32_t)buf;
+      uint32_t bytes = sectors * LAMEOS_SECTOR_SIZE;
+
+      // The controller transfers words
+      if (address & 0x01)
+        {
+          return -EINVARG;
+        }
+
+      while (bytes > 0)
+        {
+          if (total_prds >= LAMEOS_ATA_MAX_PRDS)
+            {
+              return -ENOMEM;
+            }
+
+          uint32_t chunk = 0x10000 - (address & 0xFFFF);
+          if (chunk > bytes)
+            {
+              chunk = bytes;
+            }
+
+          struct ata_prd *prd = &channel->prdt[total_prds];
+          prd->address = address;
+          prd->bytes = chunk & 0xFFFF;
+          prd->flags = 0;
+
+          address += chunk;
+          bytes -= chunk;
+          total_prds++;
+        }
+
+      sector += sectors;
+      total -= sectors;
+    }
+
+  channel->prdt[total_prds - 1].flags = ATA_PRD_END;
+  return LAMEOS_OK;
+}
+
+static int
+ata_dma_usable (struct ata_channel *channel, struct ata_device *device)
+{
+  return channel->bm_base && (device->features & ATA_FEATURE_DMA);
+}
+
+/**
+ * @brief Issues a READ DMA or WRITE DMA, the controller raises one interrupt
+ * when the whole command has been transferred.
+ */
+static void
+ata_channel_issue_dma (struct ata_channel *channel, struct ata_device *device,
+                       struct disk_request *request, uint32_t lba, int total)
+{
+  uint16_t bm_base = channel->bm_base;
+  int lba48 = ata_lba48 (device);
+  unsigned char direction = 0;
+  unsigned char command
+      = lba48 ? ATA_COMMAND_WRITE_DMA_EXT : ATA_COMMAND_WRITE_DMA;
+  if (request->type == DISK_REQUEST_READ)
+    {
+      direction = ATA_BM_COMMAND_READ;
+      command = lba48 ? ATA_COMMAND_READ_DMA_EXT : ATA_COMMAND_READ_DMA;
+    }
+
+  outb (bm_base + ATA_BM_COMMAND, 0);
+  outdw (bm_base + ATA_BM_PRDT, (uint32_t)channel->prdt);
+
+  // Status error and interrupt bits are cleared by writing 1 to them
+  outb (bm_base + ATA_BM_STATUS,
+        ATA_BM_STATUS_ERROR | ATA_BM_STATUS_INTERRUPT);
+  outb (bm_base + ATA_BM_COMMAND, direction);
+
+  ata_command_rw (device, lba, total, command);
+  outb (bm_base + ATA_BM_COMMAND, direction | ATA_BM_COMMAND_START);
+}
+
+/**
+ * @brief Moves the next DRQ block of the active PIO command between the
+ * drive and the request buffers, one `rep insw` or `rep outsw` per buffer
+ * the block spans.
+ */
+static void
+ata_pio_transfer (struct ata_channel *channel, struct ata_device *device,
+                  struct disk_request *request)
+{
+  int block = device->multiple ? device->multiple : 1;
+  int sectors = channel->command_remaining > block ? block
+                                                   : channel->command_remaining;
+
+  channel->command_remaining -= sectors;
+  while (sectors > 0)
+    {
+      int contiguous = 0;
+      void *ptr
+          = disk_request_chain_ptr (request, request->completed, &contiguous);
+      int total = contiguous > sectors ? sectors : contiguous;
+      if (request->type == DISK_REQUEST_WRITE)
+        {
+          outsw_rep (device->io_base + ATA_REG_DATA, ptr,
+                     total * ATA_WORDS_PER_SECTOR);
+        }
+      else
+        {
+          insw_rep (device->io_base + ATA_REG_DATA, ptr,
+                    total * ATA_WORDS_PER_SECTOR);
+        }
+      request->completed += total;
+      sectors -= total;
+    }
+  ata_delay (device);
+}
+
+/**
+ * @brief Picks the PIO command for the active request, block mode and LBA48
+ * forms when the drive has them.
+ */
+static unsigned char
+ata_pio_command (struct ata_device *device, struct disk_request *request)
+{
+  int lba48 = ata_lba48 (device);
+  if (request->type == DISK_REQUEST_WRITE)
+    {
+      if (device->multiple)
+        {
+          return lba48 ? ATA_COMMAND_WRITE_MULTIPLE_EXT
+                       : ATA_COMMAND_WRITE_MULTIPLE;
+        }
+      return lba48 ? ATA_COMMAND_WRITE_SECTORS_EXT : ATA_COMMAND_WRITE_SECTORS;
+    }
+
+  if (device->multiple)
+    {
+      return lba48 ? ATA_COMMAND_READ_MULTIPLE_EXT : ATA_COMMAND_READ_MULTIPLE;
+    }
+  return lba48 ? ATA_COMMAND_READ_SECTORS_EXT : ATA_COMMAND_READ_SECTORS;
+}
+
+/**
+ * @brief Issues the next command of the active request, at most 256 sectors
+ * or with LBA48 65536. DMA is used when the controller and drive support it,
+ * a command too scattered for the PRD table is cut down until it fits.
+ * Otherwise with block mode on, each DRQ handshake moves `multiple` sectors.
+ * A PIO write doesn't interrupt before its first block, the drive only asks
+ * for it with DRQ, so that block is sent straight away. Every interrupt after
+ * that acknowledges a block.
+ */
+static void
+ata_channel_issue (struct ata_channel *channel)
+{
+  struct disk_request *request = channel->active;
+  struct ata_device *device = request->disk->driver_private;
+  channel->command_dma = 0;
+  if (request->type == DISK_REQUEST_FLUSH)
+    {
+      channel->command_remaining = 0;
+      if (ata_lba48 (device))
+        {
+          ata_command_ext (device, 0, 0, ATA_COMMAND_FLUSH_CACHE_EXT);
+        }
+      else
+        {
+          ata_command (device, 0, 0, ATA_COMMAND_FLUSH_CACHE);
+        }
+      ata_delay (device);
+      return;
+    }
+
+  int total = disk_request_chain_total (request) - request->completed;
+  if (total > ata_max_sectors (device))
+    {
+      total = ata_max_sectors (device);
+    }
+
+  if (ata_dma_usable (channel, device))
+    {
+      int res = ata_dma_prepare (channel, request, request->completed, total);
+      while (res == -ENOMEM && total > 1)
+        {
+          total /= 2;
+          res = ata_dma_prepare (channel, request, request->completed, total);
+        }
+
+      if (res == LAMEOS_OK)
+        {
+          channel->command_remaining = total;
+          channel->command_dma = 1;
+          ata_channel_issue_dma (channel, device, request,
+                                 request->lba + request->completed, total);
+          return;
+        }
+    }
+
+  channel->command_remaining = total;
+  ata_command_rw (device, request->lba + request->completed, total,
+                  ata_pio_command (device, request));
+  if (request->type != DISK_REQUEST_WRITE)
+    {
+      ata_delay (device);
+      return;
+    }
+
+  if (ata_wait_drq (device) < 0)
+    {
+      ata_request_finish (channel, -EIO);
+      return;
+    }
+
+  ata_pio_transfer (channel, device, request);
+}
+
+/**
+ * @brief Starts the next request the scheduler picks if the channel is idle.
+ */
+static void
+ata_channel_start (struct ata_channel *channel)
+{
+  if (channel->active)
+    {
+      return;
+    }
+
+  channel->active = disk_queue_next (&channel->queue);
+  if (!channel->active)
+    {
+      return;
+    }
+
+  ata_channel_issue (channel);
+}
+
+/**
+ * @brief Moves on to the next command of the active request once the current
+ * one has been transferred, or finishes the request.
+ */
+static void
+ata_channel_command_done (struct ata_channel *channel)
+{
+  struct disk_request *request = channel->active;
+  if (request->completed < disk_request_chain_total (request))
+    {
+      ata_channel_issue (channel);
+      return;
+    }
+
+  ata_request_finish (channel, LAMEOS_OK);
+}
+
+static void
+ata_channel_service_dma (struct ata_channel *channel)
+{
+  struct disk_request *request = channel->active;
+  uint16_t bm_base = channel->bm_base;
+  unsigned char bm_status = insb (bm_base + ATA_BM_STATUS);
+  if (!(bm_status & (ATA_BM_STATUS_INTERRUPT | ATA_BM_STATUS_ERROR)))
+    {
+      return;
+    }
+
+  outb (bm_base + ATA_BM_COMMAND, 0);
+  unsigned char status = ata_status (request->disk->driver_private);
+  outb (bm_base + ATA_BM_STATUS,
+        ATA_BM_STATUS_ERROR | ATA_BM_STATUS_INTERRUPT);
+
+  if ((bm_status & ATA_BM_STATUS_ERROR)
+      || (status & (ATA_STATUS_ERR | ATA_STATUS_DF)))
+    {
+      ata_request_finish (channel, -EIO);
+      return;
+    }
+
+  request->completed += channel->command_remaining;
+  channel->command_remaining = 0;
+  ata_channel_command_done (channel);
+}
+
+/**
+ * @brief Moves the data the drive has ready for the active request.
+ * Runs from the IRQ handler, or polled while interrupts are off. Reading the
+ * status register acknowledges the drive's interrupt.
+ */
+static void
+ata_channel_service (struct ata_channel *channel)
+{
+  struct disk_request *request = channel->active;
+  if (!request)
+    {
+      // Spurious, read status so the drive drops the interrupt
+      insb (channel->io_base + ATA_REG_STATUS);
+      return;
+    }
+
+  if (channel->command_dma)
+    {
+      ata_channel_service_dma (channel);
+      return;
+    }
+
+  struct ata_device *device = request->disk->driver_private;
+  unsigned char status = ata_status (device);
+  if (status & ATA_STATUS_BSY)
+    {
+      return;
+    }
+
+  if (status & (ATA_STATUS_ERR | ATA_STATUS_DF))
+    {
+      ata_request_finish (channel, -EIO);
+      return;
+    }
+
+  if (request->type == DISK_REQUEST_FLUSH)
+    {
+      ata_request_finish (channel, LAMEOS_OK);
+      return;
+    }
+
+  // Once the last block of a write is out, the interrupt with neither BSY
+  // nor DRQ set means the drive has taken the whole command
+  if (request->type == DISK_REQUEST_WRITE && channel->command_remaining == 0)
+    {
+      ata_channel_command_done (channel);
+      return;
+    }
+
+  if (!(status & ATA_STATUS_DRQ))
+    {
+      return;
+    }
+
+  ata_pio_transfer (channel, device, request);
+  if (request->type == DISK_REQUEST_WRITE || channel->command_remaining > 0)
+    {
+      return;
+    }
+
+  ata_channel_command_done (channel);
+}
+
+/**
+ * @brief Queues a request with the channel's scheduler, starting it if the
+ * channel is idle. Completion is signalled through request->done.
+ */
+int
+ata_submit (struct ata_device *device, struct disk_request *request)
+{
+  struct ata_channel *channel = device->channel;
+  request->completed = 0;
+  request->done = 0;
+  request->status = 0;
+
+  // Without a volatile write cache there is nothing to flush
+  if (request->type == DISK_REQUEST_FLUSH
+      && !(device->features & ATA_FEATURE_FLUSH_CACHE))
+    {
+      disk_request_complete (request, LAMEOS_OK);
+      return LAMEOS_OK;
+    }
+
+  int interrupts_enabled = are_interrupts_enabled ();
+  disable_interrupts ();
+  disk_queue_add (&channel->queue, request);
+  ata_channel_start (channel);
+  if (interrupts_enabled)
+    {
+      enable_interrupts ();
+    }
+
+  return LAMEOS_OK;
+}
+
+/**
+ * @brief Waits for a submitted request to complete.
+ * With interrupts on the CPU halts until the IRQ handler finishes the
+ * request, a blocking task would sleep here instead. With interrupts off
+ * (during boot and inside system calls) the channels are polled, all of
+ * them, so requests submitted to the other channel keep moving meanwhile.
+ */
+void
+ata_wait (struct ata_device *device, struct disk_request *request)
+{
+  if (!are_interrupts_enabled ())
+    {
+      while (!request->done)
+        {
+          for (int i = 0; i < ATA_TOTAL_CHANNELS; i++)
+            {
+              if (ata_channels[i].active)
+                {
+                  ata_channel_service (&ata_channels[i]);
+                }
+            }
+        }
+      return;
+    }
+
+  disable_interrupts ();
+  while (!request->done)
+    {
+      wait_for_interrupt ();
+      disable_interrupts ();
+    }
+  enable_interrupts ();
+}
+
+/**
+ * @brief Holds back dispatching on the device's channel, so the requests
+ * submitted until ata_unplug merge before any of them is sent. Don't wait on
+ * a request while its channel is plugged.
+ */
+void
+ata_plug (struct ata_device *device)
+{
+  int interrupts_enabled = are_interrupts_enabled ();
+  disable_interrupts ();
+  disk_queue_plug (&device->channel->queue);
+  if (interrupts_enabled)
+    {
+      enable_interrupts ();
+    }
+}
+
+void
+ata_unplug (struct ata_device *device)
+{
+  struct ata_channel *channel = device->channel;
+  int interrupts_enabled = are_interrupts_enabled ();
+  disable_interrupts ();
+  if (disk_queue_unplug (&channel->queue))
+    {
+      ata_channel_start (channel);
+    }
+
+  if (interrupts_enabled)
+    {
+      enable_interrupts ();
+    }
+}
+
+static void
+ata_primary_interrupt ()
+{
+  ata_channel_service (&ata_channels[ATA_PRIMARY_CHANNEL]);
+}
+
+static void
+ata_secondary_interrupt ()
+{
+  ata_channel_service (&ata_channels[ATA_SECONDARY_CHANNEL]);
+}
+
+void
+ata_get_queue_stats (struct ata_device *device,
+                     struct disk_queue_stats *stats)
+{
+  *stats = device->channel->queue.stats;
+}
+
+static int
+ata_disk_submit (struct disk *disk, struct disk_request *request)
+{
+  return ata_submit (disk->driver_private, request);
+}
+
+static void
+ata_disk_wait (struct disk *disk, struct disk_request *request)
+{
+  ata_wait (disk->driver_private, request);
+}
+
+static void
+ata_disk_plug (struct disk *disk)
+{
+  ata_plug (disk->driver_private);
+}
+
+static void
+ata_disk_unplug (struct disk *disk)
+{
+  ata_unplug (disk->driver_private);
+}
+
+static void
+ata_disk_queue_stats (struct disk *disk, struct disk_queue_stats *stats)
+{
+  ata_get_queue_stats (disk->driver_private, stats);
+}
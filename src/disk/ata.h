@@ -0,0 +1,159 @@
+#ifndef ATA_H
+#define ATA_H
+
+#include "queue.h"
+#include <stdint.h>
+
+// Primary ATA channel
+#define ATA_PRIMARY_IO_BASE 0x1F0
+#define ATA_PRIMARY_CTRL_BASE 0x3F6
+#define ATA_PRIMARY_IRQ 14
+
+// Secondary ATA channel
+#define ATA_SECONDARY_IO_BASE 0x170
+#define ATA_SECONDARY_CTRL_BASE 0x376
+#define ATA_SECONDARY_IRQ 15
+
+typedef unsigned int ATA_CHANNEL;
+enum
+{
+  ATA_PRIMARY_CHANNEL,
+  ATA_SECONDARY_CHANNEL,
+  ATA_TOTAL_CHANNELS
+};
+
+// Register offsets from the channel I/O base
+#define ATA_REG_DATA 0x00
+#define ATA_REG_ERROR 0x01
+#define ATA_REG_FEATURES 0x01
+#define ATA_REG_SECTOR_COUNT 0x02
+#define ATA_REG_LBA_LOW 0x03
+#define ATA_REG_LBA_MID 0x04
+#define ATA_REG_LBA_HIGH 0x05
+#define ATA_REG_DRIVE 0x06
+#define ATA_REG_STATUS 0x07
+#define ATA_REG_COMMAND 0x07
+
+#define ATA_COMMAND_READ_SECTORS 0x20
+#define ATA_COMMAND_READ_SECTORS_EXT 0x24
+#define ATA_COMMAND_READ_DMA_EXT 0x25
+#define ATA_COMMAND_READ_MULTIPLE_EXT 0x29
+#define ATA_COMMAND_WRITE_SECTORS 0x30
+#define ATA_COMMAND_WRITE_SECTORS_EXT 0x34
+#define ATA_COMMAND_WRITE_DMA_EXT 0x35
+#define ATA_COMMAND_WRITE_MULTIPLE_EXT 0x39
+#define ATA_COMMAND_READ_MULTIPLE 0xC4
+#define ATA_COMMAND_WRITE_MULTIPLE 0xC5
+#define ATA_COMMAND_SET_MULTIPLE_MODE 0xC6
+#define ATA_COMMAND_READ_DMA 0xC8
+#define ATA_COMMAND_WRITE_DMA 0xCA
+#define ATA_COMMAND_FLUSH_CACHE 0xE7
+#define ATA_COMMAND_FLUSH_CACHE_EXT 0xEA
+#define ATA_COMMAND_IDENTIFY 0xEC
+
+// ATA status register bits
+#define ATA_STATUS_ERR 0x01
+#define ATA_STATUS_DRQ 0x08
+#define ATA_STATUS_DF 0x20
+#define ATA_STATUS_BSY 0x80
+
+// Bus master IDE register offsets from the channel's bus master base
+#define ATA_BM_COMMAND 0x00
+#define ATA_BM_STATUS 0x02
+#define ATA_BM_PRDT 0x04
+
+#define ATA_BM_COMMAND_START 0x01
+// Direction bit, set when the device writes to memory (a disk read)
+#define ATA_BM_COMMAND_READ 0x08
+
+#define ATA_BM_STATUS_ACTIVE 0x01
+#define ATA_BM_STATUS_ERROR 0x02
+#define ATA_BM_STATUS_INTERRUPT 0x04
+
+// Marks the last entry of a PRD table
+#define ATA_PRD_END 0x8000
+
+// Feature bits decoded from the IDENTIFY DEVICE data
+#define ATA_FEATURE_LBA 0b00000001
+#define ATA_FEATURE_DMA 0b00000010
+#define ATA_FEATURE_LBA48 0b00000100
+#define ATA_FEATURE_FLUSH_CACHE 0b00001000
+
+#define ATA_IDENTIFY_WORDS 256
+
+struct disk_request;
+struct disk_driver;
+
+// Physical region descriptor, one contiguous piece of a DMA transfer. A
+// region can't cross a 64 KB boundary, a byte count of 0 means 64 KB.
+struct ata_prd
+{
+  uint32_t address;
+  uint16_t bytes;
+  uint16_t flags;
+} __attribute__ ((packed));
+
+// An IDE channel runs one command at a time for the two drives on it
+struct ata_channel
+{
+  uint16_t io_base;
+  uint16_t ctrl_base;
+
+  // Bus master IDE ports, 0 if the controller can't DMA
+  uint16_t bm_base;
+
+  // The PRD table of the channel's DMA transfers
+  struct ata_prd *prdt;
+
+  // Requests waiting for the channel
+  struct disk_queue queue;
+
+  // The request being transferred and the sectors left in its command
+  struct disk_request *active;
+  int command_remaining;
+
+  // Set while the active command is a DMA transfer
+  int command_dma;
+};
+
+struct ata_device
+{
+  struct ata_channel *channel;
+
+  // Channel I/O ports
+  uint16_t io_base;
+  uint16_t ctrl_base;
+
+  // 0 for the master drive, 1 for the slave
+  int slave;
+
+  // Set once IDENTIFY DEVICE found an ATA drive here
+  int present;
+
+  // Bitmask of ATA_FEATURE_*
+  uint32_t features;
+
+  // Addressable sectors, with 48-bit LBA if the drive supports it. Capped
+  // at what a 32-bit LBA reaches.
+  uint32_t total_sectors;
+
+  // The largest sectors per DRQ block the drive supports for READ MULTIPLE
+  // and WRITE MULTIPLE
+  uint16_t max_multiple;
+
+  // Sectors per DRQ block set with SET MULTIPLE MODE, 0 if not in use
+  uint16_t multiple;
+
+  uint16_t identify[ATA_IDENTIFY_WORDS];
+};
+
+struct disk_driver *ata_init ();
+int ata_identify (struct ata_device *device, ATA_CHANNEL channel, int slave);
+int ata_submit (struct ata_device *device, struct disk_request *request);
+void ata_wait (struct ata_device *device, struct disk_request *request);
+void ata_plug (struct ata_device *device);
+void ata_unplug (struct ata_device *device);
+void ata_get_queue_stats (struct ata_device *device,
+                          struct disk_queue_stats *stats);
+
+#endif
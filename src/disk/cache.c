@@ -0,0 +1,580 @@
+#include "cache.h"
+#include "config.h"
+#include "disk.h"
+#include "io/io.h"
+#include "memory/heap/kheap.h"
+#include "memory/memory.h"
+#include "status.h"
+
+/*
+ * Sector cache keyed by (disk, LBA).
+ *
+ * Replacement is a segmented LRU. A sector read for the first time goes on
+ * the probation list, it's only promoted to the protected list when it is
+ * hit again. A large sequential read therefore only cycles the probation
+ * list and can't flush the FAT, directory and boot sectors that are hit over
+ * and over. The protected list is capped, when it overflows its least
+ * recently used sector is demoted back to the head of probation.
+ *
+ * Writes are write-back. A written sector is only marked dirty, dirty
+ * sectors are written back together, sorted by LBA so the scheduler merges
+ * neighbours into a few large commands. That happens on an explicit sync,
+ * once too many sectors are dirty or the oldest has been dirty too long,
+ * and before a dirty sector is evicted.
+ */
+
+#define DISK_CACHE_TOTAL_SECTORS                                              \
+  (LAMEOS_DISK_CACHE_SIZE_BYTES / LAMEOS_SECTOR_SIZE)
+#define DISK_CACHE_MAX_PROTECTED (DISK_CACHE_TOTAL_SECTORS * 3 / 4)
+
+// Dirty sectors written back per batch of a flush
+#define DISK_CACHE_FLUSH_BATCH 64
+
+typedef unsigned int DISK_CACHE_LIST;
+enum
+{
+  DISK_CACHE_LIST_FREE,
+  DISK_CACHE_LIST_PROBATION,
+  DISK_CACHE_LIST_PROTECTED,
+  DISK_CACHE_TOTAL_LISTS
+};
+
+struct disk_cache_entry
+{
+  struct disk *disk;
+  uint32_t lba;
+  DISK_CACHE_LIST list;
+  char *data;
+
+  // Set while the data is newer than the disk
+  int dirty;
+
+  // Next entry in the same hash bucket
+  struct disk_cache_entry *hash_next;
+
+  // Neighbours on the list the entry is on, head is most recently used
+  struct disk_cache_entry *prev;
+  struct disk_cache_entry *next;
+};
+
+struct disk_cache_list
+{
+  struct disk_cache_entry *head;
+  struct disk_cache_entry *tail;
+  uint32_t count;
+};
+
+struct disk_cache
+{
+  struct disk_cache_entry *entries;
+  char *data;
+  struct disk_cache_entry *buckets[LAMEOS_DISK_CACHE_HASH_BUCKETS];
+  struct disk_cache_list lists[DISK_CACHE_TOTAL_LISTS];
+  struct disk_cache_stats stats;
+
+  // TSC when the oldest sector still dirty was written
+  unsigned long long dirty_since;
+};
+
+static struct disk_cache disk_cache;
+
+static uint32_t
+disk_cache_hash (struct disk *disk, uint32_t lba)
+{
+  return ((lba * 0x9E3779B1) ^ (uint32_t)disk->id)
+         % LAMEOS_DISK_CACHE_HASH_BUCKETS;
+}
+
+static void
+disk_cache_list_remove (struct disk_cache_entry *entry)
+{
+  struct disk_cache_list *list = &disk_cache.lists[entry->list];
+  if (entry->prev)
+    {
+      entry->prev->next = entry->next;
+    }
+  else
+    {
+      list->head = entry->next;
+    }
+
+  if (entry->next)
+    {
+      entry->next->prev = entry->prev;
+    }
+  else
+    {
+      list->tail = entry->prev;
+    }
+
+  entry->prev = 0;
+  entry->next = 0;
+  list->count--;
+}
+
+static void
+disk_cache_list_push (struct disk_cache_entry *entry, DISK_CACHE_LIST type)
+{
+  struct disk_cache_list *list = &disk_cache.lists[type];
+  entry->list = type;
+  entry->prev = 0;
+  entry->next = list->head;
+  if (list->head)
+    {
+      list->head->prev = entry;
+    }
+  else
+    {
+      list->tail = entry;
+    }
+
+  list->head = entry;
+  list->count++;
+}
+
+static void
+disk_cache_hash_remove (struct disk_cache_entry *entry)
+{
+  struct disk_cache_entry **link
+      = &disk_cache.buckets[disk_cache_hash (entry->disk, entry->lba)];
+  while (*link)
+    {
+      if (*link == entry)
+        {
+          *link = entry->hash_next;
+          break;
+        }
+      link = &(*link)->hash_next;
+    }
+
+  entry->hash_next = 0;
+}
+
+static struct disk_cache_entry *
+disk_cache_find (struct disk *disk, uint32_t lba)
+{
+  struct disk_cache_entry *entry
+      = disk_cache.buckets[disk_cache_hash (disk, lba)];
+  while (entry)
+    {
+      if (entry->disk == disk && entry->lba == lba)
+        {
+          return entry;
+        }
+      entry = entry->hash_next;
+    }
+
+  return 0;
+}
+
+/**
+ * @brief Moves a sector that was hit to the head of the protected list.
+ */
+static void
+disk_cache_touch (struct disk_cache_entry *entry)
+{
+  disk_cache_list_remove (entry);
+  disk_cache_list_push (entry, DISK_CACHE_LIST_PROTECTED);
+
+  struct disk_cache_list *protected
+      = &disk_cache.lists[DISK_CACHE_LIST_PROTECTED];
+  if (protected->count > DISK_CACHE_MAX_PROTECTED)
+    {
+      struct disk_cache_entry *demoted = protected->tail;
+      disk_cache_list_remove (demoted);
+      disk_cache_list_push (demoted, DISK_CACHE_LIST_PROBATION);
+    }
+}
+
+static struct disk_cache_entry *
+disk_cache_find_clean (struct disk_cache_list *list)
+{
+  for (struct disk_cache_entry *entry = list->tail; entry; entry = entry->prev)
+    {
+      if (!entry->dirty)
+        {
+          return entry;
+        }
+    }
+
+  return 0;
+}
+
+static int disk_cache_flush_disk (struct disk *disk);
+
+/**
+ * @brief Takes an entry to hold a new sector, evicting the least recently
+ * used one if none is free. A dirty victim makes its disk write back first.
+ * @return struct disk_cache_entry* The entry, or 0 if every candidate is
+ * dirty and the write back failed.
+ */
+static struct disk_cache_entry *
+disk_cache_get_free_entry ()
+{
+  struct disk_cache_list *free = &disk_cache.lists[DISK_CACHE_LIST_FREE];
+  struct disk_cache_entry *entry = free->head;
+  if (entry)
+    {
+      disk_cache_list_remove (entry);
+      return entry;
+    }
+
+  entry = disk_cache.lists[DISK_CACHE_LIST_PROBATION].tail;
+  if (!entry)
+    {
+      entry = disk_cache.lists[DISK_CACHE_LIST_PROTECTED].tail;
+    }
+
+  if (entry->dirty && disk_cache_flush_disk (entry->disk) < 0)
+    {
+      entry = disk_cache_find_clean (
+          &disk_cache.lists[DISK_CACHE_LIST_PROBATION]);
+      if (!entry)
+        {
+          entry = disk_cache_find_clean (
+              &disk_cache.lists[DISK_CACHE_LIST_PROTECTED]);
+        }
+
+      if (!entry)
+        {
+          return 0;
+        }
+    }
+
+  disk_cache_list_remove (entry);
+  disk_cache_hash_remove (entry);
+  disk_cache.stats.evictions++;
+  return entry;
+}
+
+int
+disk_cache_init ()
+{
+  int res = 0;
+  memset (&disk_cache, 0, sizeof (disk_cache));
+  disk_cache.entries = kzalloc (DISK_CACHE_TOTAL_SECTORS
+                                * sizeof (struct disk_cache_entry));
+  disk_cache.data = kzalloc (LAMEOS_DISK_CACHE_SIZE_BYTES);
+  if (!disk_cache.entries || !disk_cache.data)
+    {
+      res = -ENOMEM;
+      goto out;
+    }
+
+  for (int i = 0; i < DISK_CACHE_TOTAL_SECTORS; i++)
+    {
+      struct disk_cache_entry *entry = &disk_cache.entries[i];
+      entry->data = disk_cache.data + (i * LAMEOS_SECTOR_SIZE);
+      disk_cache_list_push (entry, DISK_CACHE_LIST_FREE);
+    }
+
+out:
+  return res;
+}
+
+/**
+ * @brief Copies a cached sector into out.
+ * @return int 1 on a hit, 0 on a miss.
+ */
+int
+disk_cache_read (struct disk *disk, uint32_t lba, void *out)
+{
+  if (!disk_cache.entries)
+    {
+      return 0;
+    }
+
+  struct disk_cache_entry *entry = disk_cache_find (disk, lba);
+  if (!entry)
+    {
+      return 0;
+    }
+
+  memcpy (out, entry->data, LAMEOS_SECTOR_SIZE);
+  disk_cache_touch (entry);
+  disk_cache.stats.hits++;
+  return 1;
+}
+
+int
+disk_cache_contains (struct disk *disk, uint32_t lba)
+{
+  if (!disk_cache.entries)
+    {
+      return 0;
+    }
+
+  return disk_cache_find (disk, lba) != 0;
+}
+
+/**
+ * @brief Copies a sector out only if it's dirty, without counting a hit or
+ * moving it in the LRU.
+ * @return int 1 if the sector was dirty and copied, 0 otherwise.
+ */
+int
+disk_cache_read_dirty (struct disk *disk, uint32_t lba, void *out)
+{
+  if (!disk_cache.entries || disk_cache.stats.dirty == 0)
+    {
+      return 0;
+    }
+
+  struct disk_cache_entry *entry = disk_cache_find (disk, lba);
+  if (!entry || !entry->dirty)
+    {
+      return 0;
+    }
+
+  if (out)
+    {
+      memcpy (out, entry->data, LAMEOS_SECTOR_SIZE);
+    }
+  return 1;
+}
+
+static struct disk_cache_entry *
+disk_cache_new_entry (struct disk *disk, uint32_t lba)
+{
+  struct disk_cache_entry *entry = disk_cache_get_free_entry ();
+  if (!entry)
+    {
+      return 0;
+    }
+
+  entry->disk = disk;
+  entry->lba = lba;
+  entry->dirty = 0;
+
+  uint32_t bucket = disk_cache_hash (disk, lba);
+  entry->hash_next = disk_cache.buckets[bucket];
+  disk_cache.buckets[bucket] = entry;
+  disk_cache_list_push (entry, DISK_CACHE_LIST_PROBATION);
+  return entry;
+}
+
+void
+disk_cache_insert (struct disk *disk, uint32_t lba, const void *data)
+{
+  if (!disk_cache.entries)
+    {
+      return;
+    }
+
+  struct disk_cache_entry *entry = disk_cache_find (disk, lba);
+  if (entry)
+    {
+      // A dirty sector is newer than anything read from the device
+      if (!entry->dirty)
+        {
+          memcpy (entry->data, (void *)data, LAMEOS_SECTOR_SIZE);
+        }
+      return;
+    }
+
+  // The sector had to come from the device
+  disk_cache.stats.misses++;
+  entry = disk_cache_new_entry (disk, lba);
+  if (!entry)
+    {
+      return;
+    }
+
+  memcpy (entry->data, (void *)data, LAMEOS_SECTOR_SIZE);
+}
+
+/**
+ * @brief Writes a sector into the cache and marks it dirty, it reaches the
+ * disk on the next write back.
+ * @return int 1 if the sector is cached, 0 if there's no cache and the
+ * caller has to write it through, or a negative status from a write back.
+ */
+int
+disk_cache_write (struct disk *disk, uint32_t lba, const void *data)
+{
+  if (!disk_cache.entries)
+    {
+      return 0;
+    }
+
+  struct disk_cache_entry *entry = disk_cache_find (disk, lba);
+  if (entry)
+    {
+      disk_cache_touch (entry);
+    }
+  else
+    {
+      entry = disk_cache_new_entry (disk, lba);
+      if (!entry)
+        {
+          return -EIO;
+        }
+    }
+
+  memcpy (entry->data, (void *)data, LAMEOS_SECTOR_SIZE);
+  if (!entry->dirty)
+    {
+      if (disk_cache.stats.dirty == 0)
+        {
+          disk_cache.dirty_since = read_tsc ();
+        }
+
+      entry->dirty = 1;
+      disk_cache.stats.dirty++;
+    }
+
+  if (disk_cache.stats.dirty >= LAMEOS_DISK_CACHE_MAX_DIRTY)
+    {
+      int res = disk_cache_flush (0);
+      if (res < 0)
+        {
+          return res;
+        }
+    }
+
+  return 1;
+}
+
+/**
+ * @brief Writes back every dirty sector of a disk, in batches of up to
+ * DISK_CACHE_FLUSH_BATCH sectors. Each batch is the lowest dirty LBAs not
+ * yet written, submitted sorted with the queue plugged, so adjacent sectors
+ * merge into one command. It needs no memory, so it's safe while evicting.
+ */
+static int
+disk_cache_flush_disk (struct disk *disk)
+{
+  static struct disk_cache_entry *dirty[DISK_CACHE_FLUSH_BATCH];
+  static struct disk_request requests[DISK_CACHE_FLUSH_BATCH];
+  static int submitted[DISK_CACHE_FLUSH_BATCH];
+  int res = 0;
+  uint32_t next_lba = 0;
+  while (1)
+    {
+      // Insertion sort of the lowest dirty LBAs from next_lba up
+      int total = 0;
+      for (int i = 0; i < DISK_CACHE_TOTAL_SECTORS; i++)
+        {
+          struct disk_cache_entry *entry = &disk_cache.entries[i];
+          if (!entry->dirty || entry->disk != disk || entry->lba < next_lba
+              || (total == DISK_CACHE_FLUSH_BATCH
+                  && entry->lba > dirty[total - 1]->lba))
+            {
+              continue;
+            }
+
+          int at = total < DISK_CACHE_FLUSH_BATCH ? total++ : total - 1;
+          while (at > 0 && dirty[at - 1]->lba > entry->lba)
+            {
+              dirty[at] = dirty[at - 1];
+              at--;
+            }
+          dirty[at] = entry;
+        }
+
+      if (total == 0)
+        {
+          break;
+        }
+
+      disk_plug (disk);
+      for (int i = 0; i < total; i++)
+        {
+          disk_request_init (&requests[i], disk, DISK_REQUEST_WRITE,
+                             dirty[i]->lba, 1, dirty[i]->data);
+          submitted[i] = disk_submit (&requests[i]) == 0;
+        }
+      disk_unplug (disk);
+
+      for (int i = 0; i < total; i++)
+        {
+          // A request that was never queued never completes, don't wait
+          if (!submitted[i] || disk_request_wait (&requests[i]) < 0)
+            {
+              res = -EIO;
+              continue;
+            }
+
+          dirty[i]->dirty = 0;
+          disk_cache.stats.dirty--;
+          disk_cache.stats.writebacks++;
+        }
+
+      // Sectors that failed stay dirty, they're retried on the next flush
+      next_lba = dirty[total - 1]->lba + 1;
+    }
+
+  if (disk_cache.stats.dirty == 0)
+    {
+      disk_cache.dirty_since = 0;
+    }
+
+  return res;
+}
+
+/**
+ * @brief Writes back the dirty sectors of a disk.
+ * @param disk The disk, or 0 for every disk.
+ */
+int
+disk_cache_flush (struct disk *disk)
+{
+  if (!disk_cache.entries || disk_cache.stats.dirty == 0)
+    {
+      return 0;
+    }
+
+  if (disk)
+    {
+      return disk_cache_flush_disk (disk);
+    }
+
+  int res = 0;
+  for (int i = 0; i < DISK_CACHE_TOTAL_SECTORS && disk_cache.stats.dirty > 0;
+       i++)
+    {
+      struct disk_cache_entry *entry = &disk_cache.entries[i];
+      if (!entry->dirty)
+        {
+          continue;
+        }
+
+      res = disk_cache_flush_disk (entry->disk);
+      if (res < 0)
+        {
+          break;
+        }
+    }
+
+  return res;
+}
+
+/**
+ * @brief Writes everything back once the oldest dirty sector has been dirty
+ * for longer than LAMEOS_DISK_CACHE_WRITEBACK_CYCLES. There is no timer to
+ * drive this, the disk layer calls it on each request.
+ */
+int
+disk_cache_writeback_poll ()
+{
+  if (!disk_cache.entries || disk_cache.stats.dirty == 0)
+    {
+      return 0;
+    }
+
+  if (read_tsc () - disk_cache.dirty_since
+      < LAMEOS_DISK_CACHE_WRITEBACK_CYCLES)
+    {
+      return 0;
+    }
+
+  return disk_cache_flush (0);
+}
+
+void
+disk_cache_get_stats (struct disk_cache_stats *stats)
+{
+  *stats = disk_cache.stats;
+  stats->probation = disk_cache.lists[DISK_CACHE_LIST_PROBATION].count;
+  stats->protected = disk_cache.lists[DISK_CACHE_LIST_PROTECTED].count;
+}
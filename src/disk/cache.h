@@ -0,0 +1,35 @@
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include <stdint.h>
+
+struct disk;
+
+struct disk_cache_stats
+{
+  uint32_t hits;
+
+  // Sectors that had to be read from the device
+  uint32_t misses;
+  uint32_t evictions;
+
+  // Sectors written back to the device, and those still waiting to be
+  uint32_t writebacks;
+  uint32_t dirty;
+
+  // Sectors currently held in each segment
+  uint32_t probation;
+  uint32_t protected;
+};
+
+int disk_cache_init ();
+int disk_cache_read (struct disk *disk, uint32_t lba, void *out);
+int disk_cache_contains (struct disk *disk, uint32_t lba);
+int disk_cache_read_dirty (struct disk *disk, uint32_t lba, void *out);
+void disk_cache_insert (struct disk *disk, uint32_t lba, const void *data);
+int disk_cache_write (struct disk *disk, uint32_t lba, const void *data);
+int disk_cache_flush (struct disk *disk);
+int disk_cache_writeback_poll ();
+void disk_cache_get_stats (struct disk_cache_stats *stats);
+
+#endif
@@ -1,68 +1,956 @@
 #include "disk.h"
-#include "../io/io.h"
-#include "../memory/memory.h"
+#include "ahci.h"
+#include "ata.h"
+#include "cache.h"
+#include "ramdisk.h"
+#include "virtio.h"
+#include "io/io.h"
+#include "memory/heap/kheap.h"
+#include "memory/memory.h"
 #include "config.h"
 #include "status.h"
 
-struct disk disk;
+// Every disk found, whole drives first and then the partitions on them
+static struct disk disks[LAMEOS_MAX_DISKS];
+static int disks_total = 0;
 
-int
-disk_read_sector (int lba, int total, void *buf)
+static struct ata_device ata_devices[ATA_TOTAL_CHANNELS * 2];
+
+#define MBR_PARTITION_TABLE_OFFSET 446
+#define MBR_TOTAL_PARTITIONS 4
+#define MBR_SIGNATURE 0xAA55
+#define MBR_STATUS_ACTIVE 0x80
+
+// Extended partitions hold further partition tables rather than data
+#define MBR_TYPE_EXTENDED_CHS 0x05
+#define MBR_TYPE_EXTENDED_LBA 0x0F
+
+struct mbr_partition_entry
+{
+  uint8_t status;
+  uint8_t chs_first[3];
+  uint8_t type;
+  uint8_t chs_last[3];
+  uint32_t lba_start;
+  uint32_t total_sectors;
+} __attribute__ ((packed));
+
+static struct disk *
+disk_add (struct disk_driver *driver, void *driver_private,
+          uint32_t total_sectors)
 {
+  if (disks_total >= LAMEOS_MAX_DISKS)
+    {
+      return 0;
+    }
 
-  outb (0x1F6, (lba >> 24) | 0xE0);
-  outb (0x1F2, total);
-  outb (0x1F3, (unsigned char)(lba & 0xff));
-  outb (0x1F4, (unsigned char)(lba >> 8));
-  outb (0x1F5, (unsigned char)(lba >> 16));
-  outb (0x1F7, 0x20);
+  struct disk *idisk = &disks[disks_total];
+  memset (idisk, 0, sizeof (struct disk));
+  idisk->type = LAMEOS_DISK_TYPE_REAL;
+  idisk->sector_size = LAMEOS_SECTOR_SIZE;
+  idisk->id = disks_total;
+  idisk->driver = driver;
+  idisk->driver_private = driver_private;
+  idisk->total_sectors = total_sectors;
+  disks_total++;
+  return idisk;
+}
 
-  unsigned short *ptr = (unsigned short *)buf;
-  for (int b = 0; b < total; b++)
+/**
+ * @brief Adds a disk for each primary partition in the drive's MBR. Only
+ * called for drives that don't hold a filesystem from sector 0, a FAT boot
+ * sector carries the same 0x55AA signature.
+ */
+static void
+disk_scan_partitions (struct disk *parent)
+{
+  uint8_t mbr[LAMEOS_SECTOR_SIZE];
+  if (disk_read_block (parent, 0, 1, mbr) < 0)
     {
-      // wait for buffer to be ready
-      char c = insb (0x1F7);
-      while (!(c & 0x08))
+      return;
+    }
+
+  if (*(uint16_t *)&mbr[LAMEOS_SECTOR_SIZE - 2] != MBR_SIGNATURE)
+    {
+      return;
+    }
+
+  struct mbr_partition_entry *entries
+      = (struct mbr_partition_entry *)&mbr[MBR_PARTITION_TABLE_OFFSET];
+  for (int i = 0; i < MBR_TOTAL_PARTITIONS; i++)
+    {
+      // Anything but 0x00 or 0x80 means this isn't a partition table
+      if (entries[i].status != 0 && entries[i].status != MBR_STATUS_ACTIVE)
         {
-          c = insb (0x1F7);
+          return;
         }
+    }
 
-      // Copy from disk to memory
-      for (int i = 0; i < 256; i++)
+  for (int i = 0; i < MBR_TOTAL_PARTITIONS; i++)
+    {
+      struct mbr_partition_entry *entry = &entries[i];
+      if (entry->type == 0 || entry->type == MBR_TYPE_EXTENDED_CHS
+          || entry->type == MBR_TYPE_EXTENDED_LBA || entry->lba_start == 0
+          || entry->total_sectors == 0)
         {
-          *ptr = insw (0x1F0);
-          ptr++;
+          continue;
         }
+
+      if (parent->total_sectors
+          && (entry->lba_start >= parent->total_sectors
+              || entry->total_sectors
+                     > parent->total_sectors - entry->lba_start))
+        {
+          continue;
+        }
+
+      struct disk *partition = disk_add (parent->driver,
+                                         parent->driver_private,
+                                         entry->total_sectors);
+      if (!partition)
+        {
+          return;
+        }
+
+      partition->type = LAMEOS_DISK_TYPE_PARTITION;
+      partition->parent = parent;
+      partition->lba_offset = entry->lba_start;
+      partition->filesystem = fs_resolve (partition);
     }
-  return 0;
 }
 
+static void
+disk_probe_ata ()
+{
+  struct disk_driver *driver = ata_init ();
+  int found = 0;
+  for (int channel = 0; channel < ATA_TOTAL_CHANNELS; channel++)
+    {
+      for (int slave = 0; slave < 2; slave++)
+        {
+          struct ata_device *device = &ata_devices[(channel * 2) + slave];
+          if (ata_identify (device, channel, slave) == LAMEOS_OK)
+            {
+              disk_add (driver, device, device->total_sectors);
+              found++;
+            }
+        }
+    }
+
+  // If IDENTIFY doesn't answer, plain READ SECTORS still works on the
+  // primary master
+  if (!found)
+    {
+      ata_identify (&ata_devices[0], ATA_PRIMARY_CHANNEL, 0);
+      disk_add (driver, &ata_devices[0], 0);
+    }
+}
+
+static int disk_read_device (struct disk *idisk, uint32_t lba, int total,
+                             void *buf);
+
+/**
+ * @brief Adds a disk served from a disk image in memory.
+ * @param data The image, used in place, it must outlive the disk.
+ * @param total_sectors Size of the image in sectors.
+ * @return struct disk* The new disk, or 0 if it couldn't be added.
+ */
+struct disk *
+disk_add_ram (void *data, uint32_t total_sectors)
+{
+  struct ramdisk *ramdisk = ramdisk_new (data, total_sectors);
+  if (!ramdisk)
+    {
+      return 0;
+    }
+
+  struct disk *idisk = disk_add (ramdisk_init (), ramdisk, total_sectors);
+  if (!idisk)
+    {
+      kfree (ramdisk);
+      return 0;
+    }
+
+  idisk->type = LAMEOS_DISK_TYPE_RAM;
+  return idisk;
+}
+
+/**
+ * @brief Copies the boot drive, disk 0, into memory and swaps the copy into
+ * its place so the filesystem is served from memory. Must run before any
+ * filesystem is resolved, those hold on to disk ids.
+ * @return int The id the real boot drive moved to, or -1 if there's no
+ * initrd. Nothing may be mounted from it, it holds the same volume.
+ */
+static int
+disk_load_initrd ()
+{
+  struct disk *boot = disk_get (0);
+  if (!boot || boot->total_sectors == 0
+      || boot->total_sectors > LAMEOS_INITRD_MAX_SECTORS)
+    {
+      return -1;
+    }
+
+  char *data = kzalloc (boot->total_sectors * LAMEOS_SECTOR_SIZE);
+  if (!data)
+    {
+      return -1;
+    }
+
+  // Straight from the device, the copy would only evict the cache
+  for (uint32_t lba = 0; lba < boot->total_sectors;
+       lba += LAMEOS_DISK_QUEUE_MAX_MERGE_SECTORS)
+    {
+      int total = LAMEOS_DISK_QUEUE_MAX_MERGE_SECTORS;
+      if ((uint32_t)total > boot->total_sectors - lba)
+        {
+          total = boot->total_sectors - lba;
+        }
+
+      if (disk_read_device (boot, lba, total,
+                            data + (lba * LAMEOS_SECTOR_SIZE))
+          < 0)
+        {
+          kfree (data);
+          return -1;
+        }
+    }
+
+  struct disk *ram = disk_add_ram (data, boot->total_sectors);
+  if (!ram)
+    {
+      kfree (data);
+      return -1;
+    }
+
+  struct disk tmp = *boot;
+  *boot = *ram;
+  *ram = tmp;
+  boot->id = 0;
+  ram->id = disks_total - 1;
+  return ram->id;
+}
+
+/**
+ * @brief Finds every drive, virtio-blk first, then AHCI ports, then the
+ * IDE channels. A drive without a filesystem of its own is searched for
+ * MBR partitions, each becomes a disk of its own.
+ */
 void
 disk_search_and_init ()
 {
-  memset (&disk, 0, sizeof (disk));
-  disk.type = LAMEOS_DISK_TYPE_REAL;
-  disk.sector_size = LAMEOS_SECTOR_SIZE;
-  disk.id = 0;
-  disk.filesystem = fs_resolve(&disk);
+  memset (disks, 0, sizeof (disks));
+  disks_total = 0;
+  disk_cache_init ();
+
+  struct disk_driver *virtio = virtio_blk_init ();
+  if (virtio)
+    {
+      struct virtio_blk_device *device = virtio_blk_get_device ();
+      disk_add (virtio, device, device->total_sectors);
+    }
+
+  struct disk_driver *ahci = ahci_init ();
+  for (int i = 0; ahci && ahci_get_port (i); i++)
+    {
+      struct ahci_port *port = ahci_get_port (i);
+      disk_add (ahci, port, port->total_sectors);
+    }
+
+  // Legacy IDE is only probed if there's nothing better
+  if (disks_total == 0)
+    {
+      disk_probe_ata ();
+    }
+
+  int initrd_source = -1;
+  if (LAMEOS_INITRD)
+    {
+      initrd_source = disk_load_initrd ();
+    }
+
+  int drives = disks_total;
+  for (int i = 0; i < drives; i++)
+    {
+      // Mounting the drive the initrd was copied from would mount its
+      // volume twice, each mount overwriting the other's changes
+      if (i == initrd_source)
+        {
+          continue;
+        }
+
+      disks[i].filesystem = fs_resolve (&disks[i]);
+      if (!disks[i].filesystem)
+        {
+          disk_scan_partitions (&disks[i]);
+        }
+    }
 }
 
 struct disk *
 disk_get (int index)
 {
-  if (index != 0)
+  if (index < 0 || index >= disks_total)
     return 0;
 
-  return &disk;
+  return &disks[index];
+}
+
+/**
+ * @brief The whole drive a disk lies on, with lba moved from the disk's
+ * sectors to the drive's.
+ * @return struct disk* The drive, or 0 if the sectors are out of the disk.
+ */
+static struct disk *
+disk_get_device (struct disk *idisk, uint32_t *lba, int total)
+{
+  if (!idisk || idisk < disks || idisk >= disks + disks_total)
+    {
+      return 0;
+    }
+
+  if (idisk->total_sectors
+      && (*lba >= idisk->total_sectors
+          || (uint32_t)total > idisk->total_sectors - *lba))
+    {
+      return 0;
+    }
+
+  if (idisk->parent)
+    {
+      *lba += idisk->lba_offset;
+      return idisk->parent;
+    }
+
+  return idisk;
+}
+
+/**
+ * @brief Bumped by every write to the drive the disk lies on.
+ */
+uint32_t
+disk_write_generation (struct disk *idisk)
+{
+  return idisk->parent ? idisk->parent->write_generation
+                       : idisk->write_generation;
+}
+
+void
+disk_request_init (struct disk_request *request, struct disk *idisk,
+                   DISK_REQUEST_TYPE type, uint32_t lba, int total, void *buf)
+{
+  memset (request, 0, sizeof (struct disk_request));
+  request->disk = idisk;
+  request->type = type;
+  request->lba = lba;
+  request->total = total;
+  request->buf = buf;
+}
+
+/**
+ * @brief Sends a request to the driver of the drive its disk lies on.
+ * A request to a partition is moved to the drive's sectors first.
+ */
+int
+disk_submit (struct disk_request *request)
+{
+  struct disk *device
+      = disk_get_device (request->disk, &request->lba, request->total);
+  if (!device)
+    {
+      return -EINVARG;
+    }
+
+  request->disk = device;
+  disk_stats_submit (device, request);
+  return device->driver->submit (device, request);
+}
+
+/**
+ * @brief Takes a copy of the dirty cached sectors a read covers, they're
+ * newer than what the device will return. Nothing is written back, so this
+ * never waits on the device and is safe while the queue is plugged.
+ */
+static int
+disk_read_overlay (struct disk_request *request, struct disk *device,
+                   uint32_t lba)
+{
+  int dirty = 0;
+  for (int i = 0; i < request->total; i++)
+    {
+      dirty += disk_cache_read_dirty (device, lba + i, 0);
+    }
+
+  if (dirty == 0)
+    {
+      return 0;
+    }
+
+  uint8_t *overlay
+      = kzalloc (request->total + (dirty * LAMEOS_SECTOR_SIZE));
+  if (!overlay)
+    {
+      return -ENOMEM;
+    }
+
+  char *data = (char *)overlay + request->total;
+  for (int i = 0; i < request->total; i++)
+    {
+      if (disk_cache_read_dirty (device, lba + i, data))
+        {
+          overlay[i] = 1;
+          data += LAMEOS_SECTOR_SIZE;
+        }
+    }
+
+  request->overlay = overlay;
+  return 0;
+}
+
+/**
+ * @brief Starts a read without waiting for it, the request completes through
+ * request->done and its callback. A read the sector cache holds entirely
+ * completes at once. Otherwise it goes to the device in one request, with
+ * the sectors dirty in the cache laid over the device's data as it
+ * completes. Its sectors aren't added to the cache.
+ */
+int
+disk_read_async (struct disk_request *request)
+{
+  unsigned long long started = read_tsc ();
+  struct disk *idisk = request->disk;
+  uint32_t lba = request->lba;
+  struct disk *device = disk_get_device (idisk, &lba, request->total);
+  if (!device || request->type != DISK_REQUEST_READ)
+    {
+      return -EINVARG;
+    }
+
+  int res = 0;
+  int cached = device->type != LAMEOS_DISK_TYPE_RAM;
+  for (int i = 0; cached && i < request->total; i++)
+    {
+      cached = disk_cache_contains (device, lba + i);
+    }
+
+  if (cached)
+    {
+      for (int i = 0; i < request->total; i++)
+        {
+          int contiguous = 0;
+          disk_cache_read (device, lba + i,
+                           disk_request_chain_ptr (request, i, &contiguous));
+        }
+
+      idisk->stats.cache_hits += request->total;
+      request->completed = request->total;
+      disk_request_complete (request, LAMEOS_OK);
+      goto out;
+    }
+
+  if (device->type != LAMEOS_DISK_TYPE_RAM)
+    {
+      res = disk_read_overlay (request, device, lba);
+      if (res < 0)
+        {
+          goto out;
+        }
+
+      idisk->stats.cache_misses += request->total;
+    }
+
+  res = disk_submit (request);
+  if (res < 0 && request->overlay)
+    {
+      kfree (request->overlay);
+      request->overlay = 0;
+    }
+
+out:
+  disk_stats_block (idisk, 0, request->total, started);
+  return res;
+}
+
+/**
+ * @brief Holds requests submitted to the disk back until disk_unplug, so a
+ * batch merges before any of it is dispatched.
+ */
+void
+disk_plug (struct disk *idisk)
+{
+  idisk->driver->plug (idisk);
+}
+
+void
+disk_unplug (struct disk *idisk)
+{
+  idisk->driver->unplug (idisk);
+}
+
+int
+disk_request_wait (struct disk_request *request)
+{
+  request->disk->driver->wait (request->disk, request);
+  if (request->overlay)
+    {
+      kfree (request->overlay);
+      request->overlay = 0;
+    }
+  return request->status;
+}
+
+/**
+ * @brief Starts reading sectors into the cache without waiting for them.
+ * Sectors at either end the cache already holds are left out, and nothing is
+ * read for a RAM disk. A prefetch still active is finished first.
+ */
+int
+disk_prefetch_start (struct disk_prefetch *prefetch, struct disk *idisk,
+                     uint32_t lba, int total)
+{
+  disk_prefetch_finish (prefetch);
+
+  uint32_t device_lba = lba;
+  struct disk *device = disk_get_device (idisk, &device_lba, total);
+  if (!device || total <= 0)
+    {
+      return -EINVARG;
+    }
+
+  if (device->type == LAMEOS_DISK_TYPE_RAM)
+    {
+      return 0;
+    }
+
+  while (total > 0 && disk_cache_contains (device, device_lba))
+    {
+      lba++;
+      device_lba++;
+      total--;
+    }
+
+  while (total > 0 && disk_cache_contains (device, device_lba + total - 1))
+    {
+      total--;
+    }
+
+  if (total == 0)
+    {
+      return 0;
+    }
+
+  prefetch->buf = kzalloc (total * LAMEOS_SECTOR_SIZE);
+  if (!prefetch->buf)
+    {
+      return -ENOMEM;
+    }
+
+  disk_request_init (&prefetch->request, idisk, DISK_REQUEST_READ, lba, total,
+                     prefetch->buf);
+  prefetch->generation = disk_write_generation (idisk);
+  int res = disk_read_async (&prefetch->request);
+  if (res < 0)
+    {
+      kfree (prefetch->buf);
+      prefetch->buf = 0;
+      return res;
+    }
+
+  prefetch->active = 1;
+  return 0;
+}
+
+/**
+ * @brief Waits for a prefetch and adds its sectors to the cache. They are
+ * dropped if the drive was written since the prefetch started, as they may
+ * be older than what the cache has already let go of.
+ */
+void
+disk_prefetch_finish (struct disk_prefetch *prefetch)
+{
+  if (!prefetch->active)
+    {
+      return;
+    }
+
+  struct disk_request *request = &prefetch->request;
+  if (disk_request_wait (request) == LAMEOS_OK
+      && disk_write_generation (request->disk) == prefetch->generation)
+    {
+      // Submitting moved the request to the drive and its sectors
+      for (int i = 0; i < request->total; i++)
+        {
+          disk_cache_insert (request->disk, request->lba + i,
+                             prefetch->buf + (i * LAMEOS_SECTOR_SIZE));
+        }
+    }
+
+  kfree (prefetch->buf);
+  prefetch->buf = 0;
+  prefetch->active = 0;
+}
+
+int
+disk_get_queue_stats (struct disk *idisk, struct disk_queue_stats *stats)
+{
+  uint32_t lba = 0;
+  struct disk *device = disk_get_device (idisk, &lba, 0);
+  if (!device)
+    {
+      return -EIO;
+    }
+
+  device->driver->queue_stats (device, stats);
+  return 0;
+}
+
+/**
+ * @brief Copies out the disk's I/O statistics, with the current depth of
+ * its drive's queue.
+ */
+int
+disk_get_stats (struct disk *idisk, struct disk_stats *stats)
+{
+  struct disk_queue_stats queue_stats;
+  int res = disk_get_queue_stats (idisk, &queue_stats);
+  if (res < 0)
+    {
+      return res;
+    }
+
+  memcpy (stats, &idisk->stats, sizeof (struct disk_stats));
+  stats->queue_depth = queue_stats.depth;
+  stats->max_queue_depth = queue_stats.max_depth;
+  return 0;
+}
+
+/**
+ * @brief Prints the statistics of every disk, for debugging.
+ */
+void
+disk_dump_stats ()
+{
+  for (int i = 0; i < disks_total; i++)
+    {
+      disk_stats_dump (&disks[i]);
+    }
+}
+
+/**
+ * @brief Sectors a vector of buffers holds.
+ * @return int The total, or -EINVARG if a length isn't a multiple of the
+ * sector size.
+ */
+int
+disk_iovec_sectors (struct disk_iovec *iov, int iovcnt)
+{
+  int total = 0;
+  for (int i = 0; i < iovcnt; i++)
+    {
+      if (iov[i].len % LAMEOS_SECTOR_SIZE)
+        {
+          return -EINVARG;
+        }
+
+      total += iov[i].len / LAMEOS_SECTOR_SIZE;
+    }
+
+  return total;
+}
+
+/**
+ * @brief Finds where a sector of a vectored transfer goes.
+ * @param sector The sector, counted from the start of the first buffer.
+ * @param contiguous Out, sectors from there on that are in the same buffer,
+ * 0 if the buffers end before the sector.
+ */
+void *
+disk_iovec_ptr (struct disk_iovec *iov, int iovcnt, int sector,
+                int *contiguous)
+{
+  for (int i = 0; i < iovcnt; i++)
+    {
+      int sectors = iov[i].len / LAMEOS_SECTOR_SIZE;
+      if (sector < sectors)
+        {
+          *contiguous = sectors - sector;
+          return iov[i].buf + (sector * LAMEOS_SECTOR_SIZE);
+        }
+
+      sector -= sectors;
+    }
+
+  *contiguous = 0;
+  return 0;
+}
+
+/**
+ * @brief Moves sectors between the device and a vector of buffers with one
+ * request, the driver scatters or gathers them itself.
+ * @param iov_sector Where in the buffers the first sector goes.
+ */
+static int
+disk_transfer_device (struct disk *idisk, DISK_REQUEST_TYPE type,
+                      uint32_t lba, int total, struct disk_iovec *iov,
+                      int iovcnt, int iov_sector)
+{
+  struct disk_request request;
+  disk_request_init (&request, idisk, type, lba, total, 0);
+  request.iov = iov;
+  request.iovcnt = iovcnt;
+  request.iov_sector = iov_sector;
+  int res = disk_submit (&request);
+  if (res < 0)
+    {
+      return res;
+    }
+
+  return disk_request_wait (&request);
+}
+
+static int
+disk_read_device (struct disk *idisk, uint32_t lba, int total, void *buf)
+{
+  struct disk_request request;
+  disk_request_init (&request, idisk, DISK_REQUEST_READ, lba, total, buf);
+  int res = disk_submit (&request);
+  if (res < 0)
+    {
+      return res;
+    }
+
+  return disk_request_wait (&request);
+}
+
+/**
+ * @brief Reads a contiguous range of sectors into a vector of buffers, each
+ * a multiple of the sector size long. Sectors the cache misses are read by
+ * the driver straight into their buffer.
+ */
+int
+disk_readv (struct disk *idisk, unsigned int lba, struct disk_iovec *iov,
+            int iovcnt)
+{
+  unsigned long long started = read_tsc ();
+  int total = disk_iovec_sectors (iov, iovcnt);
+  if (total < 0)
+    {
+      return total;
+    }
+
+  // The cache is keyed by the drive, so a partition and its drive share it
+  struct disk *device = disk_get_device (idisk, &lba, total);
+  if (!device)
+    {
+      return -EIO;
+    }
+
+  int res = 0;
+
+  // Already in memory, caching it again would only cost a copy
+  if (device->type == LAMEOS_DISK_TYPE_RAM)
+    {
+      res = disk_transfer_device (device, DISK_REQUEST_READ, lba, total, iov,
+                                  iovcnt, 0);
+      goto out;
+    }
+
+  res = disk_cache_writeback_poll ();
+  if (res < 0)
+    {
+      goto out;
+    }
+
+  int i = 0;
+  while (i < total)
+    {
+      int contiguous = 0;
+      void *out = disk_iovec_ptr (iov, iovcnt, i, &contiguous);
+      if (disk_cache_read (device, lba + i, out))
+        {
+          idisk->stats.cache_hits++;
+          i++;
+          continue;
+        }
+
+      // Read the whole run of missing sectors with one command
+      int run = 1;
+      while (i + run < total && !disk_cache_contains (device, lba + i + run))
+        {
+          run++;
+        }
+
+      idisk->stats.cache_misses += run;
+      res = disk_transfer_device (device, DISK_REQUEST_READ, lba + i, run,
+                                  iov, iovcnt, i);
+      if (res < 0)
+        {
+          break;
+        }
+
+      for (int b = 0; b < run; b++)
+        {
+          disk_cache_insert (device, lba + i + b,
+                             disk_iovec_ptr (iov, iovcnt, i + b, &contiguous));
+        }
+
+      i += run;
+    }
+
+out:
+  disk_stats_block (idisk, 0, total, started);
+  return res;
 }
 
 int
 disk_read_block (struct disk *idisk, unsigned int lba, int total, void *buf)
 {
-  if (idisk != &disk)
+  if (total < 0)
     {
       return -EIO;
     }
 
-  return disk_read_sector (lba, total, buf);
-}
\ No newline at end of file
+  struct disk_iovec iov = { .buf = buf, .len = total * LAMEOS_SECTOR_SIZE };
+  return disk_readv (idisk, lba, &iov, 1);
+}
+
+/**
+ * @brief Writes sectors straight to the device, bypassing the cache.
+ */
+int
+disk_write_device (struct disk *idisk, uint32_t lba, int total,
+                   const void *buf)
+{
+  struct disk_request request;
+  disk_request_init (&request, idisk, DISK_REQUEST_WRITE, lba, total,
+                     (void *)buf);
+  int res = disk_submit (&request);
+  if (res < 0)
+    {
+      return res;
+    }
+
+  return disk_request_wait (&request);
+}
+
+/**
+ * @brief Writes a vector of buffers, each a multiple of the sector size
+ * long, to a contiguous range of sectors through the write-back cache.
+ */
+int
+disk_writev (struct disk *idisk, unsigned int lba, struct disk_iovec *iov,
+             int iovcnt)
+{
+  unsigned long long started = read_tsc ();
+  int total = disk_iovec_sectors (iov, iovcnt);
+  if (total < 0)
+    {
+      return total;
+    }
+
+  struct disk *device = disk_get_device (idisk, &lba, total);
+  if (!device)
+    {
+      return -EIO;
+    }
+
+  device->write_generation++;
+  int res = 0;
+  if (device->type == LAMEOS_DISK_TYPE_RAM)
+    {
+      res = disk_transfer_device (device, DISK_REQUEST_WRITE, lba, total, iov,
+                                  iovcnt, 0);
+      goto out;
+    }
+
+  res = disk_cache_writeback_poll ();
+  if (res < 0)
+    {
+      goto out;
+    }
+
+  for (int i = 0; i < total; i++)
+    {
+      int contiguous = 0;
+      const void *sector = disk_iovec_ptr (iov, iovcnt, i, &contiguous);
+      res = disk_cache_write (device, lba + i, sector);
+      if (res < 0)
+        {
+          goto out;
+        }
+
+      if (res == 0)
+        {
+          // No cache, write the rest through in one go
+          res = disk_transfer_device (device, DISK_REQUEST_WRITE, lba + i,
+                                      total - i, iov, iovcnt, i);
+          goto out;
+        }
+    }
+
+  res = 0;
+
+out:
+  disk_stats_block (idisk, 1, total, started);
+  return res;
+}
+
+/**
+ * @brief Writes sectors to the disk through the write-back cache. They reach
+ * the device later, use disk_sync to make sure they have.
+ */
+int
+disk_write_block (struct disk *idisk, unsigned int lba, int total,
+                  const void *buf)
+{
+  if (total < 0)
+    {
+      return -EIO;
+    }
+
+  struct disk_iovec iov = { .buf = (void *)buf,
+                            .len = total * LAMEOS_SECTOR_SIZE };
+  return disk_writev (idisk, lba, &iov, 1);
+}
+
+/**
+ * @brief Makes the drive commit its volatile write cache to the media. The
+ * driver completes the request at once if the drive has no such cache.
+ */
+int
+disk_flush_device (struct disk *idisk)
+{
+  struct disk_request request;
+  disk_request_init (&request, idisk, DISK_REQUEST_FLUSH, 0, 0, 0);
+  int res = disk_submit (&request);
+  if (res < 0)
+    {
+      return res;
+    }
+
+  return disk_request_wait (&request);
+}
+
+/**
+ * @brief Writes back every dirty cached sector of the disk, then flushes
+ * the drive's own write cache.
+ */
+int
+disk_sync (struct disk *idisk)
+{
+  uint32_t lba = 0;
+  idisk = disk_get_device (idisk, &lba, 0);
+  if (!idisk)
+    {
+      return -EIO;
+    }
+
+  int res = disk_cache_flush (idisk);
+  if (res < 0)
+    {
+      return res;
+    }
+
+  return disk_flush_device (idisk);
+}
@@ -2,17 +2,71 @@
 #define DISK_H
 
 #include "fs/file.h"
+#include "queue.h"
+#include "stats.h"
+#include <stdint.h>
 
 typedef unsigned int LAMEOS_DISK_TYPE;
 
+struct disk;
+struct disk_request;
+
+typedef int (*DISK_SUBMIT_FUNCTION) (struct disk *disk,
+                                     struct disk_request *request);
+
+typedef void (*DISK_WAIT_FUNCTION) (struct disk *disk,
+                                    struct disk_request *request);
+
+typedef void (*DISK_PLUG_FUNCTION) (struct disk *disk);
+
+typedef void (*DISK_UNPLUG_FUNCTION) (struct disk *disk);
+
+typedef void (*DISK_QUEUE_STATS_FUNCTION) (struct disk *disk,
+                                           struct disk_queue_stats *stats);
+
+struct disk_driver
+{
+  // Queues a request, completion is signalled through request->done
+  DISK_SUBMIT_FUNCTION submit;
+  // Returns once a submitted request is done
+  DISK_WAIT_FUNCTION wait;
+  // Holds dispatching back so a batch of requests can merge first
+  DISK_PLUG_FUNCTION plug;
+  DISK_UNPLUG_FUNCTION unplug;
+  DISK_QUEUE_STATS_FUNCTION queue_stats;
+
+  char name[20];
+};
+
 // Represents a real physical hard disk
 #define LAMEOS_DISK_TYPE_REAL 0
+// Represents a partition, a range of sectors on a real disk
+#define LAMEOS_DISK_TYPE_PARTITION 1
+// Represents a disk image held in memory
+#define LAMEOS_DISK_TYPE_RAM 2
 struct disk
 {
   LAMEOS_DISK_TYPE type;
   int sector_size;
   int id;
 
+  // Total addressable sectors, 0 if the drive didn't report it
+  uint32_t total_sectors;
+
+  // For a partition, the real disk it lies on and the sector it starts at
+  struct disk *parent;
+  uint32_t lba_offset;
+
+  // The driver moving the disk's sectors, and its data for this disk
+  struct disk_driver *driver;
+  void *driver_private;
+
+  // Bumped on every write, lets readers that keep their own copy of
+  // sectors notice they may be stale
+  uint32_t write_generation;
+
+  struct disk_stats stats;
+
   // filesystem bound to the disk.
   struct filesystem *filesystem;
 
@@ -20,8 +74,117 @@ struct disk
   void *fs_private;
 };
 
+// One buffer of a vectored transfer, len is a multiple of the sector size
+struct disk_iovec
+{
+  void *buf;
+  uint32_t len;
+};
+
+typedef void (*DISK_REQUEST_CALLBACK) (struct disk_request *request);
+
+typedef unsigned int DISK_REQUEST_TYPE;
+enum
+{
+  DISK_REQUEST_READ,
+  DISK_REQUEST_WRITE,
+  // Makes the device commit its volatile write cache, carries no data
+  DISK_REQUEST_FLUSH
+};
+
+// A transfer submitted to a disk driver. The driver completes it from its
+// interrupt handler, or when polled if interrupts are off.
+struct disk_request
+{
+  struct disk *disk;
+  DISK_REQUEST_TYPE type;
+  uint32_t lba;
+  int total;
+  void *buf;
+
+  // If set, the sectors go to these buffers rather than buf, starting
+  // iov_sector sectors into them
+  struct disk_iovec *iov;
+  int iovcnt;
+  int iov_sector;
+
+  // Sectors transferred so far
+  int completed;
+
+  // Set by the driver once the request finished, status holds the result
+  volatile int done;
+  volatile int status;
+
+  // Called once the request completes, just before done is set. It may run
+  // from the driver's interrupt handler.
+  DISK_REQUEST_CALLBACK callback;
+  void *private;
+
+  // Next request in the driver queue
+  struct disk_request *next;
+
+  // Requests for the sectors right after this one, served by the same
+  // command. Only the first request of such a chain sits in the queue.
+  struct disk_request *merged;
+
+  // Reads of sectors covered by this chain, copied out once it completes
+  struct disk_request *piggyback;
+
+  // Dispatches that went ahead of this request while it was queued
+  int passes;
+
+  // TSC when the request was submitted
+  unsigned long long started;
+
+  // For a read of sectors dirty in the write-back cache: a byte per sector,
+  // set for the dirty ones, followed by their cached data in order. Copied
+  // over what the device returns as the request completes, freed by
+  // disk_request_wait.
+  uint8_t *overlay;
+};
+
+// Sectors read in the background ahead of a reader. They are added to the
+// sector cache by disk_prefetch_finish, unless the drive was written to
+// meanwhile.
+struct disk_prefetch
+{
+  struct disk_request request;
+  char *buf;
+  uint32_t generation;
+  int active;
+};
+
 void disk_search_and_init ();
 struct disk *disk_get (int index);
+struct disk *disk_add_ram (void *data, uint32_t total_sectors);
+uint32_t disk_write_generation (struct disk *idisk);
 int disk_read_block (struct disk *idisk, unsigned int lba, int total,
                      void *buf);
+int disk_write_block (struct disk *idisk, unsigned int lba, int total,
+                      const void *buf);
+int disk_readv (struct disk *idisk, unsigned int lba, struct disk_iovec *iov,
+                int iovcnt);
+int disk_writev (struct disk *idisk, unsigned int lba,
+                 struct disk_iovec *iov, int iovcnt);
+int disk_iovec_sectors (struct disk_iovec *iov, int iovcnt);
+void *disk_iovec_ptr (struct disk_iovec *iov, int iovcnt, int sector,
+                      int *contiguous);
+int disk_write_device (struct disk *idisk, uint32_t lba, int total,
+                       const void *buf);
+int disk_sync (struct disk *idisk);
+int disk_flush_device (struct disk *idisk);
+void disk_plug (struct disk *idisk);
+void disk_unplug (struct disk *idisk);
+void disk_request_init (struct disk_request *request, struct disk *idisk,
+                        DISK_REQUEST_TYPE type, uint32_t lba, int total,
+                        void *buf);
+int disk_submit (struct disk_request *request);
+int disk_read_async (struct disk_request *request);
+int disk_request_wait (struct disk_request *request);
+int disk_prefetch_start (struct disk_prefetch *prefetch, struct disk *idisk,
+                         uint32_t lba, int total);
+void disk_prefetch_finish (struct disk_prefetch *prefetch);
+int disk_get_queue_stats (struct disk *idisk, struct disk_queue_stats *stats);
+int disk_get_stats (struct disk *idisk, struct disk_stats *stats);
+void disk_dump_stats ();
 #endif
\ No newline at end of file
@@ -0,0 +1,345 @@
+#include "queue.h"
+#include "config.h"
+#include "disk.h"
+#include "memory/memory.h"
+
+/*
+ * Block I/O scheduler between the filesystem and the disk drivers.
+ *
+ * Pending requests are kept sorted by LBA and dispatched C-LOOK, the head
+ * sweeps upwards and jumps back to the lowest request once nothing is left
+ * ahead of it. A request that has been passed over too many times is served
+ * next regardless, so a stream of requests ahead of the head can't starve
+ * it.
+ *
+ * A request for the sectors right before or after a queued request in the
+ * same direction is merged into it, the driver then moves the whole chain
+ * with one command. A read of sectors a queued read already covers doesn't
+ * go to the device at all, it's copied out of that read once it completes.
+ *
+ * While the queue is plugged requests only collect, so a batch submitted in
+ * one go merges fully before the first of it is dispatched.
+ */
+
+void
+disk_queue_init (struct disk_queue *queue)
+{
+  memset (queue, 0, sizeof (struct disk_queue));
+}
+
+int
+disk_request_chain_total (struct disk_request *request)
+{
+  int total = 0;
+  for (; request; request = request->merged)
+    {
+      total += request->total;
+    }
+
+  return total;
+}
+
+/**
+ * @brief Finds where a sector of a merged chain goes.
+ * @param sector The sector, counted from the start of the chain.
+ * @param contiguous Out, sectors from there on that are in the same buffer.
+ * @return void* Pointer into the buffer of the request that owns the sector.
+ */
+void *
+disk_request_chain_ptr (struct disk_request *request, int sector,
+                        int *contiguous)
+{
+  while (request->merged && sector >= request->total)
+    {
+      sector -= request->total;
+      request = request->merged;
+    }
+
+  if (request->iov)
+    {
+      void *ptr = disk_iovec_ptr (request->iov, request->iovcnt,
+                                  request->iov_sector + sector, contiguous);
+      if (*contiguous > request->total - sector)
+        {
+          *contiguous = request->total - sector;
+        }
+
+      return ptr;
+    }
+
+  *contiguous = request->total - sector;
+  return request->buf + (sector * LAMEOS_SECTOR_SIZE);
+}
+
+static int
+disk_request_chain_count (struct disk_request *request)
+{
+  int count = 0;
+  for (struct disk_request *merged = request; merged; merged = merged->merged)
+    {
+      count++;
+    }
+
+  for (struct disk_request *piggyback = request->piggyback; piggyback;
+       piggyback = piggyback->next)
+    {
+      count++;
+    }
+
+  return count;
+}
+
+/**
+ * @brief Signals a request done, after accounting it and running its
+ * callback.
+ */
+void
+disk_request_complete (struct disk_request *request, int status)
+{
+  // Sectors dirty in the cache when the read was sent are newer than the
+  // device's
+  if (status == 0 && request->overlay)
+    {
+      char *data = (char *)request->overlay + request->total;
+      for (int i = 0; i < request->total; i++)
+        {
+          if (request->overlay[i])
+            {
+              int contiguous = 0;
+              memcpy (disk_request_chain_ptr (request, i, &contiguous), data,
+                      LAMEOS_SECTOR_SIZE);
+              data += LAMEOS_SECTOR_SIZE;
+            }
+        }
+    }
+
+  request->status = status;
+  disk_stats_complete (request->disk, request);
+  if (request->callback)
+    {
+      request->callback (request);
+    }
+
+  request->done = 1;
+}
+
+/**
+ * @brief Completes every request a command served, copying the sectors
+ * piggybacking reads asked for out of the chain first.
+ */
+void
+disk_request_chain_finish (struct disk_request *request, int status)
+{
+  struct disk_request *piggyback = request->piggyback;
+  while (piggyback)
+    {
+      struct disk_request *next = piggyback->next;
+      if (status == 0)
+        {
+          int sector = piggyback->lba - request->lba;
+          int done = 0;
+          while (done < piggyback->total)
+            {
+              int contiguous = 0;
+              void *src = disk_request_chain_ptr (request, sector + done,
+                                                  &contiguous);
+              int out_contiguous = 0;
+              void *out = disk_request_chain_ptr (piggyback, done,
+                                                  &out_contiguous);
+              int total = contiguous > out_contiguous ? out_contiguous
+                                                      : contiguous;
+              memcpy (out, src, total * LAMEOS_SECTOR_SIZE);
+              done += total;
+            }
+        }
+
+      piggyback->completed = piggyback->total;
+      disk_request_complete (piggyback, status);
+      piggyback = next;
+    }
+
+  for (struct disk_request *merged = request; merged;
+       merged = merged->merged)
+    {
+      merged->completed = merged->total;
+      disk_request_complete (merged, status);
+    }
+}
+
+/**
+ * @return int 0 if the request can't join the queued chain, 1 if it was
+ * merged into it, 2 if it now heads the chain and still has to be queued.
+ */
+static int
+disk_queue_try_merge (struct disk_queue *queue, struct disk_request **link,
+                      struct disk_request *request)
+{
+  struct disk_request *queued = *link;
+  if (queued->disk != request->disk || queued->type != request->type
+      || request->type == DISK_REQUEST_FLUSH)
+    {
+      return 0;
+    }
+
+  int queued_total = disk_request_chain_total (queued);
+  uint32_t start = queued->lba;
+  uint32_t end = start + queued_total;
+
+  // Entirely inside the queued chain, served by it
+  if (request->type == DISK_REQUEST_READ && request->lba >= start
+      && request->lba + request->total <= end)
+    {
+      request->next = queued->piggyback;
+      queued->piggyback = request;
+      queue->stats.piggybacks++;
+      return 1;
+    }
+
+  if (queued_total + request->total > LAMEOS_DISK_QUEUE_MAX_MERGE_SECTORS)
+    {
+      return 0;
+    }
+
+  // Back merge, the request continues where the chain ends
+  if (request->lba == end)
+    {
+      struct disk_request *last = queued;
+      while (last->merged)
+        {
+          last = last->merged;
+        }
+
+      last->merged = request;
+      queue->stats.merges++;
+      return 1;
+    }
+
+  // Front merge, the request becomes the head of the chain. The chain is
+  // taken off the queue, the caller puts it back at its new LBA.
+  if (request->lba + request->total == start)
+    {
+      *link = queued->next;
+      request->merged = queued;
+      request->piggyback = queued->piggyback;
+      request->passes = queued->passes;
+      queued->piggyback = 0;
+      queued->next = 0;
+      queue->stats.merges++;
+      return 2;
+    }
+
+  return 0;
+}
+
+void
+disk_queue_add (struct disk_queue *queue, struct disk_request *request)
+{
+  request->next = 0;
+  request->merged = 0;
+  request->piggyback = 0;
+  request->passes = 0;
+
+  queue->stats.submitted++;
+  queue->stats.depth++;
+  if (queue->stats.depth > queue->stats.max_depth)
+    {
+      queue->stats.max_depth = queue->stats.depth;
+    }
+
+  for (struct disk_request **link = &queue->head; *link;
+       link = &(*link)->next)
+    {
+      int merged = disk_queue_try_merge (queue, link, request);
+      if (merged == 1)
+        {
+          return;
+        }
+
+      if (merged == 2)
+        {
+          break;
+        }
+    }
+
+  // Insert in LBA order
+  struct disk_request **link = &queue->head;
+  while (*link && (*link)->lba <= request->lba)
+    {
+      link = &(*link)->next;
+    }
+
+  request->next = *link;
+  *link = request;
+}
+
+/**
+ * @brief Takes the next request chain to send to the device.
+ * @return struct disk_request* The chain, or 0 if the queue is empty or
+ * plugged.
+ */
+struct disk_request *
+disk_queue_next (struct disk_queue *queue)
+{
+  if (!queue->head || queue->plugged)
+    {
+      return 0;
+    }
+
+  struct disk_request **pick = 0;
+  struct disk_request **ahead = 0;
+  for (struct disk_request **link = &queue->head; *link;
+       link = &(*link)->next)
+    {
+      if ((*link)->passes >= LAMEOS_DISK_QUEUE_MAX_PASSES)
+        {
+          pick = link;
+          break;
+        }
+
+      if (!ahead && (*link)->lba >= queue->next_lba)
+        {
+          ahead = link;
+        }
+    }
+
+  if (!pick)
+    {
+      // Nothing left ahead of the head, sweep again from the lowest LBA
+      pick = ahead ? ahead : &queue->head;
+    }
+
+  struct disk_request *request = *pick;
+  *pick = request->next;
+  request->next = 0;
+
+  for (struct disk_request *queued = queue->head; queued;
+       queued = queued->next)
+    {
+      queued->passes++;
+    }
+
+  queue->next_lba = request->lba + disk_request_chain_total (request);
+  queue->stats.dispatched++;
+  queue->stats.depth -= disk_request_chain_count (request);
+  return request;
+}
+
+void
+disk_queue_plug (struct disk_queue *queue)
+{
+  queue->plugged++;
+}
+
+/**
+ * @return int 1 once the last plug is gone and requests may be dispatched.
+ */
+int
+disk_queue_unplug (struct disk_queue *queue)
+{
+  if (queue->plugged > 0)
+    {
+      queue->plugged--;
+    }
+
+  return queue->plugged == 0;
+}
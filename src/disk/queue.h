@@ -0,0 +1,51 @@
+#ifndef DISKQUEUE_H
+#define DISKQUEUE_H
+
+#include <stdint.h>
+
+struct disk_request;
+
+struct disk_queue_stats
+{
+  // Requests waiting to be dispatched, and the most there have been
+  uint32_t depth;
+  uint32_t max_depth;
+
+  uint32_t submitted;
+
+  // Commands sent to the device
+  uint32_t dispatched;
+
+  // Requests joined onto an adjacent queued request
+  uint32_t merges;
+
+  // Reads served from an overlapping queued read
+  uint32_t piggybacks;
+};
+
+// Pending requests of one device queue, sorted by LBA and served C-LOOK
+struct disk_queue
+{
+  struct disk_request *head;
+
+  // The LBA the last dispatched request ended at
+  uint32_t next_lba;
+
+  // Nothing is dispatched while plugged, nests
+  int plugged;
+
+  struct disk_queue_stats stats;
+};
+
+void disk_queue_init (struct disk_queue *queue);
+void disk_queue_add (struct disk_queue *queue, struct disk_request *request);
+struct disk_request *disk_queue_next (struct disk_queue *queue);
+int disk_request_chain_total (struct disk_request *request);
+void *disk_request_chain_ptr (struct disk_request *request, int sector,
+                              int *contiguous);
+void disk_request_complete (struct disk_request *request, int status);
+void disk_request_chain_finish (struct disk_request *request, int status);
+void disk_queue_plug (struct disk_queue *queue);
+int disk_queue_unplug (struct disk_queue *queue);
+
+#endif
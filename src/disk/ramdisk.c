@@ -0,0 +1,146 @@
+#include "ramdisk.h"
+#include "config.h"
+#include "disk.h"
+#include "memory/heap/kheap.h"
+#include "memory/memory.h"
+#include "status.h"
+#include "string/string.h"
+
+/*
+ * Memory backed disks.
+ *
+ * disk_read_block and disk_write_block copy straight to and from the image,
+ * bypassing the sector cache. Requests submitted through the driver are
+ * completed on the spot, so code that drives a disk with disk_submit works
+ * on a RAM disk unchanged.
+ */
+
+static int ramdisk_submit (struct disk *disk, struct disk_request *request);
+static void ramdisk_wait (struct disk *disk, struct disk_request *request);
+static void ramdisk_plug (struct disk *disk);
+static void ramdisk_unplug (struct disk *disk);
+static void ramdisk_queue_stats (struct disk *disk,
+                                 struct disk_queue_stats *stats);
+
+struct disk_driver ramdisk_driver = { .submit = ramdisk_submit,
+                                      .wait = ramdisk_wait,
+                                      .plug = ramdisk_plug,
+                                      .unplug = ramdisk_unplug,
+                                      .queue_stats = ramdisk_queue_stats };
+
+struct disk_driver *
+ramdisk_init ()
+{
+  strcpy (ramdisk_driver.name, "RAMDISK");
+  return &ramdisk_driver;
+}
+
+/**
+ * @brief Wraps a disk image in memory.
+ * @param data The image, it's used in place and must outlive the disk.
+ * @param total_sectors Size of the image in sectors.
+ */
+struct ramdisk *
+ramdisk_new (void *data, uint32_t total_sectors)
+{
+  struct ramdisk *ramdisk = kzalloc (sizeof (struct ramdisk));
+  if (!ramdisk)
+    {
+      return 0;
+    }
+
+  ramdisk->data = data;
+  ramdisk->total_sectors = total_sectors;
+  return ramdisk;
+}
+
+static char *
+ramdisk_ptr (struct disk *disk, uint32_t lba, int total)
+{
+  struct ramdisk *ramdisk = disk->driver_private;
+  if (total < 0 || lba >= ramdisk->total_sectors
+      || (uint32_t)total > ramdisk->total_sectors - lba)
+    {
+      return 0;
+    }
+
+  return ramdisk->data + (lba * LAMEOS_SECTOR_SIZE);
+}
+
+int
+ramdisk_read (struct disk *disk, uint32_t lba, int total, void *out)
+{
+  char *ptr = ramdisk_ptr (disk, lba, total);
+  if (!ptr)
+    {
+      return -EIO;
+    }
+
+  memcpy (out, ptr, total * LAMEOS_SECTOR_SIZE);
+  return 0;
+}
+
+int
+ramdisk_write (struct disk *disk, uint32_t lba, int total, const void *in)
+{
+  char *ptr = ramdisk_ptr (disk, lba, total);
+  if (!ptr)
+    {
+      return -EIO;
+    }
+
+  memcpy (ptr, (void *)in, total * LAMEOS_SECTOR_SIZE);
+  return 0;
+}
+
+static int
+ramdisk_submit (struct disk *disk, struct disk_request *request)
+{
+  int res = 0;
+  int sector = 0;
+  while (res == 0 && request->type != DISK_REQUEST_FLUSH
+         && sector < request->total)
+    {
+      int contiguous = 0;
+      void *buf = disk_request_chain_ptr (request, sector, &contiguous);
+      if (contiguous <= 0)
+        {
+          res = -EIO;
+        }
+      else if (request->type == DISK_REQUEST_READ)
+        {
+          res = ramdisk_read (disk, request->lba + sector, contiguous, buf);
+        }
+      else
+        {
+          res = ramdisk_write (disk, request->lba + sector, contiguous, buf);
+        }
+
+      sector += contiguous;
+    }
+
+  request->completed = res == 0 ? request->total : 0;
+  disk_request_complete (request, res);
+  return LAMEOS_OK;
+}
+
+static void
+ramdisk_wait (struct disk *disk, struct disk_request *request)
+{
+}
+
+static void
+ramdisk_plug (struct disk *disk)
+{
+}
+
+static void
+ramdisk_unplug (struct disk *disk)
+{
+}
+
+static void
+ramdisk_queue_stats (struct disk *disk, struct disk_queue_stats *stats)
+{
+  memset (stats, 0, sizeof (struct disk_queue_stats));
+}
@@ -0,0 +1,22 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include <stdint.h>
+
+struct disk;
+struct disk_driver;
+
+struct ramdisk
+{
+  // The disk image, total_sectors * LAMEOS_SECTOR_SIZE bytes
+  char *data;
+  uint32_t total_sectors;
+};
+
+struct disk_driver *ramdisk_init ();
+struct ramdisk *ramdisk_new (void *data, uint32_t total_sectors);
+int ramdisk_read (struct disk *disk, uint32_t lba, int total, void *out);
+int ramdisk_write (struct disk *disk, uint32_t lba, int total,
+                   const void *in);
+
+#endif
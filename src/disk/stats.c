@@ -0,0 +1,152 @@
+#include "stats.h"
+#include "config.h"
+#include "disk.h"
+#include "io/io.h"
+#include "kernel.h"
+
+/*
+ * Per disk I/O accounting.
+ *
+ * block_cycles against device_cycles tells software overhead from device
+ * time. Within device time, many seeks with short latencies point at
+ * scattered small requests, few seeks with long latencies at transfers.
+ */
+
+/**
+ * @brief Accounts a disk_read_block or disk_write_block call.
+ * @param started The TSC when the call began.
+ */
+void
+disk_stats_block (struct disk *idisk, int write, int total,
+                  unsigned long long started)
+{
+  struct disk_stats *stats = &idisk->stats;
+  if (write)
+    {
+      stats->writes++;
+      stats->sectors_written += total;
+      stats->bytes_written += total * idisk->sector_size;
+    }
+  else
+    {
+      stats->reads++;
+      stats->sectors_read += total;
+      stats->bytes_read += total * idisk->sector_size;
+    }
+
+  stats->block_cycles += read_tsc () - started;
+}
+
+void
+disk_stats_submit (struct disk *device, struct disk_request *request)
+{
+  struct disk_stats *stats = &device->stats;
+  request->started = read_tsc ();
+  if (request->type == DISK_REQUEST_FLUSH)
+    {
+      stats->requests++;
+      return;
+    }
+
+  if (stats->requests && request->lba != stats->next_lba)
+    {
+      stats->seeks++;
+    }
+
+  stats->requests++;
+  stats->next_lba = request->lba + request->total;
+}
+
+void
+disk_stats_complete (struct disk *device, struct disk_request *request)
+{
+  // Never sent to the device
+  if (!request->started)
+    {
+      return;
+    }
+
+  struct disk_stats *stats = &device->stats;
+  unsigned long long cycles = read_tsc () - request->started;
+  stats->device_cycles += cycles;
+
+  int bucket = 0;
+  while (cycles > 1 && bucket < DISK_STATS_LATENCY_BUCKETS - 1)
+    {
+      cycles >>= 1;
+      bucket++;
+    }
+
+  stats->latency[bucket]++;
+}
+
+static void
+disk_stats_print_number (uint32_t number)
+{
+  char buf[11];
+  int i = sizeof (buf) - 1;
+  buf[i] = 0;
+  do
+    {
+      buf[--i] = '0' + (number % 10);
+      number /= 10;
+    }
+  while (number);
+
+  print (&buf[i]);
+}
+
+static void
+disk_stats_print (const char *name, uint32_t number)
+{
+  print (name);
+  disk_stats_print_number (number);
+  print ("\n");
+}
+
+/**
+ * @brief Prints the disk's statistics to the terminal, for debugging.
+ * Byte counts are printed in KB and cycle counts in millions.
+ */
+void
+disk_stats_dump (struct disk *idisk)
+{
+  struct disk_stats stats;
+  if (disk_get_stats (idisk, &stats) < 0)
+    {
+      return;
+    }
+
+  print ("disk ");
+  disk_stats_print_number (idisk->id);
+  print (" ");
+  print (idisk->parent ? idisk->parent->driver->name : idisk->driver->name);
+  print ("\n");
+  disk_stats_print ("reads ", stats.reads);
+  disk_stats_print ("writes ", stats.writes);
+  disk_stats_print ("sectors read ", stats.sectors_read);
+  disk_stats_print ("sectors written ", stats.sectors_written);
+  disk_stats_print ("KB read ", stats.bytes_read >> 10);
+  disk_stats_print ("KB written ", stats.bytes_written >> 10);
+  disk_stats_print ("cache hits ", stats.cache_hits);
+  disk_stats_print ("cache misses ", stats.cache_misses);
+  disk_stats_print ("block Mcycles ", stats.block_cycles >> 20);
+  disk_stats_print ("requests ", stats.requests);
+  disk_stats_print ("seeks ", stats.seeks);
+  disk_stats_print ("device Mcycles ", stats.device_cycles >> 20);
+  disk_stats_print ("queue depth ", stats.queue_depth);
+  disk_stats_print ("max queue depth ", stats.max_queue_depth);
+
+  // One line per populated bucket, "2^N cycles: requests"
+  for (int i = 0; i < DISK_STATS_LATENCY_BUCKETS; i++)
+    {
+      if (!stats.latency[i])
+        {
+          continue;
+        }
+
+      print ("2^");
+      disk_stats_print_number (i);
+      disk_stats_print (" cycles: ", stats.latency[i]);
+    }
+}
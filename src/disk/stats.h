@@ -0,0 +1,60 @@
+#ifndef DISKSTATS_H
+#define DISKSTATS_H
+
+#include <stdint.h>
+
+// Request latencies are counted in power of two buckets of TSC cycles
+#define DISK_STATS_LATENCY_BUCKETS 48
+
+struct disk;
+struct disk_request;
+
+struct disk_stats
+{
+  // Calls to disk_read_block and disk_write_block on this disk
+  uint32_t reads;
+  uint32_t writes;
+  uint32_t sectors_read;
+  uint32_t sectors_written;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+
+  // Sectors disk_read_block found in the sector cache, and those it had to
+  // read from the device
+  uint32_t cache_hits;
+  uint32_t cache_misses;
+
+  // TSC cycles spent in disk_read_block and disk_write_block, device time
+  // included
+  uint64_t block_cycles;
+
+  // The rest is only counted on whole drives, a partition's requests are
+  // sent to its drive
+
+  // Requests sent to the device, and those that didn't start where the
+  // previous one ended
+  uint32_t requests;
+  uint32_t seeks;
+
+  // TSC cycles from submitting a request until it was seen done, in total
+  // and as a histogram. latency[i] counts the requests that took at least
+  // 2^i cycles but less than 2^(i+1).
+  uint64_t device_cycles;
+  uint32_t latency[DISK_STATS_LATENCY_BUCKETS];
+
+  // Requests waiting in the driver queue, and the most there have been.
+  // Filled in by disk_get_stats.
+  uint32_t queue_depth;
+  uint32_t max_queue_depth;
+
+  // The sector after the last request sent to the device
+  uint32_t next_lba;
+};
+
+void disk_stats_block (struct disk *idisk, int write, int total,
+                       unsigned long long started);
+void disk_stats_submit (struct disk *device, struct disk_request *request);
+void disk_stats_complete (struct disk *device, struct disk_request *request);
+void disk_stats_dump (struct disk *idisk);
+
+#endif
@@ -1,6 +1,8 @@
 #include "streamer.h"
 #include "../config.h"
 #include "../memory/heap/kheap.h"
+#include "../memory/memory.h"
+#include "../status.h"
 
 struct disk_stream *
 diskstreamer_new (int disk_id)
@@ -12,6 +14,19 @@ diskstreamer_new (int disk_id)
     }
 
   struct disk_stream *streamer = kzalloc (sizeof (struct disk_stream));
+  if (!streamer)
+    {
+      return 0;
+    }
+
+  streamer->window = kzalloc (LAMEOS_DISK_STREAM_WINDOW_SECTORS
+                              * LAMEOS_SECTOR_SIZE);
+  if (!streamer->window)
+    {
+      kfree (streamer);
+      return 0;
+    }
+
   streamer->pos = 0;
   streamer->disk = disk;
 
@@ -25,37 +40,229 @@ diskstreamer_seek (struct disk_stream *stream, int pos)
   return 0;
 }
 
+static int
+diskstreamer_window_contains (struct disk_stream *stream, uint32_t sector)
+{
+  return stream->window_sectors > 0
+         && stream->window_generation == disk_write_generation (stream->disk)
+         && sector >= stream->window_lba
+         && sector < stream->window_lba + stream->window_sectors;
+}
+
+/**
+ * @brief Loads the window so it starts at the given sector.
+ * A sequential stream fills the whole window, reading ahead of what was
+ * asked for. Otherwise only the sectors needed are read.
+ */
+static int
+diskstreamer_fill_window (struct disk_stream *stream, uint32_t sector,
+                          int needed, int sequential)
+{
+  int total = LAMEOS_DISK_STREAM_WINDOW_SECTORS;
+  if (!sequential && needed < total)
+    {
+      total = needed;
+    }
+
+  // Don't read ahead past the end of the disk
+  uint32_t disk_sectors = stream->disk->total_sectors;
+  if (disk_sectors && sector + total > disk_sectors)
+    {
+      total = disk_sectors > sector ? disk_sectors - sector : 1;
+    }
+
+  stream->window_sectors = 0;
+  int res = disk_read_block (stream->disk, sector, total, stream->window);
+  if (res < 0)
+    {
+      return res;
+    }
+
+  stream->window_lba = sector;
+  stream->window_sectors = total;
+  stream->window_generation = disk_write_generation (stream->disk);
+  return 0;
+}
+
 int
 diskstreamer_read (struct disk_stream *stream, void *out, int total)
 {
-  int sector = stream->pos / LAMEOS_SECTOR_SIZE;
+  int res = 0;
+  int sequential = stream->pos == stream->last_pos;
+  char *ptr = out;
+  while (total > 0)
+    {
+      uint32_t sector = stream->pos / LAMEOS_SECTOR_SIZE;
+      int offset = stream->pos % LAMEOS_SECTOR_SIZE;
+
+      // Whole sectors not in the window go straight into the caller's buffer
+      if (offset == 0 && total >= LAMEOS_SECTOR_SIZE
+          && !diskstreamer_window_contains (stream, sector))
+        {
+          int sectors = total / LAMEOS_SECTOR_SIZE;
+          res = disk_read_block (stream->disk, sector, sectors, ptr);
+          if (res < 0)
+            {
+              goto out;
+            }
+
+          int bytes = sectors * LAMEOS_SECTOR_SIZE;
+          ptr += bytes;
+          total -= bytes;
+          stream->pos += bytes;
+          continue;
+        }
+
+      if (!diskstreamer_window_contains (stream, sector))
+        {
+          int needed = (offset + total + LAMEOS_SECTOR_SIZE - 1)
+                       / LAMEOS_SECTOR_SIZE;
+          res = diskstreamer_fill_window (stream, sector, needed, sequential);
+          if (res < 0)
+            {
+              goto out;
+            }
+        }
+
+      int window_offset
+          = ((sector - stream->window_lba) * LAMEOS_SECTOR_SIZE) + offset;
+      int available
+          = (stream->window_sectors * LAMEOS_SECTOR_SIZE) - window_offset;
+      int total_to_read = total > available ? available : total;
+      memcpy (ptr, stream->window + window_offset, total_to_read);
+
+      // Adjust the stream
+      ptr += total_to_read;
+      total -= total_to_read;
+      stream->pos += total_to_read;
+    }
+
+out:
+  stream->last_pos = stream->pos;
+  return res;
+}
+
+static void
+diskstreamer_request_complete (struct disk_request *disk_request)
+{
+  struct disk_stream_request *request = disk_request->private;
+  if (disk_request->status == 0 && request->bounce)
+    {
+      memcpy (request->out, request->bounce + request->offset,
+              request->total);
+    }
+
+  if (request->callback)
+    {
+      request->callback (request);
+    }
+}
+
+/**
+ * @brief Starts reading total bytes from the stream's position without
+ * waiting for them, the position moves on at once. Several reads may be in
+ * flight, see diskstreamer_plug to have them merge. The data is in out once
+ * the callback runs or diskstreamer_wait returns.
+ * @param callback Optional, called on completion, it may run from the
+ * driver's interrupt handler.
+ * @return struct disk_stream_request* The handle to wait on, or 0 if the
+ * read couldn't be started.
+ */
+struct disk_stream_request *
+diskstreamer_read_async (struct disk_stream *stream, void *out, int total,
+                         DISKSTREAMER_CALLBACK callback, void *private)
+{
+  if (total <= 0)
+    {
+      return 0;
+    }
+
+  struct disk_stream_request *request
+      = kzalloc (sizeof (struct disk_stream_request));
+  if (!request)
+    {
+      return 0;
+    }
+
+  uint32_t sector = stream->pos / LAMEOS_SECTOR_SIZE;
   int offset = stream->pos % LAMEOS_SECTOR_SIZE;
-  char buf[LAMEOS_SECTOR_SIZE];
+  int sectors = (offset + total + LAMEOS_SECTOR_SIZE - 1) / LAMEOS_SECTOR_SIZE;
+  void *buf = out;
 
-  int res = disk_read_block (stream->disk, sector, 1, buf);
-  if (res < 0)
+  // Only whole sectors can go straight into the caller's buffer
+  if (offset || total % LAMEOS_SECTOR_SIZE)
     {
-      goto out;
+      request->bounce = kzalloc (sectors * LAMEOS_SECTOR_SIZE);
+      if (!request->bounce)
+        {
+          kfree (request);
+          return 0;
+        }
+
+      buf = request->bounce;
     }
 
-  int total_to_read = total > LAMEOS_SECTOR_SIZE ? LAMEOS_SECTOR_SIZE : total;
-  for (int i = 0; i < total_to_read; i++)
+  request->out = out;
+  request->total = total;
+  request->offset = offset;
+  request->callback = callback;
+  request->private = private;
+
+  disk_request_init (&request->request, stream->disk, DISK_REQUEST_READ,
+                     sector, sectors, buf);
+  request->request.callback = diskstreamer_request_complete;
+  request->request.private = request;
+  if (disk_read_async (&request->request) < 0)
     {
-      *(char *)out++ = buf[offset + i];
+      if (request->bounce)
+        {
+          kfree (request->bounce);
+        }
+
+      kfree (request);
+      return 0;
     }
 
-  // Adjust the stream
-  stream->pos += total_to_read;
-  if(total > LAMEOS_SECTOR_SIZE)
-  {
-    res = diskstreamer_read(stream, out, total - LAMEOS_SECTOR_SIZE);
-  }
+  stream->pos += total;
+  stream->last_pos = stream->pos;
+  return request;
+}
 
-out:
+/**
+ * @brief Waits for an asynchronous read and frees its handle.
+ */
+int
+diskstreamer_wait (struct disk_stream_request *request)
+{
+  int res = disk_request_wait (&request->request);
+  if (request->bounce)
+    {
+      kfree (request->bounce);
+    }
+
+  kfree (request);
   return res;
 }
 
+/**
+ * @brief Holds reads started on the stream's disk back until
+ * diskstreamer_unplug, so a batch of them merges before it is dispatched.
+ * Don't wait on a read while plugged.
+ */
+void
+diskstreamer_plug (struct disk_stream *stream)
+{
+  disk_plug (stream->disk);
+}
+
+void
+diskstreamer_unplug (struct disk_stream *stream)
+{
+  disk_unplug (stream->disk);
+}
+
 void diskstreamer_close(struct disk_stream *stream)
 {
+  kfree(stream->window);
   kfree(stream);
-}
\ No newline at end of file
+}
@@ -2,11 +2,47 @@
 #define DISKSTREAMER_H
 
 #include "disk.h"
+#include <stdint.h>
 
 struct disk_stream
 {
   int pos;
   struct disk *disk;
+
+  // Where the previous read ended, a read starting here is sequential
+  int last_pos;
+
+  // Multi-sector window of the disk, refilled with one disk_read_block
+  char *window;
+  uint32_t window_lba;
+  int window_sectors;
+
+  // disk->write_generation when the window was filled, the window is stale
+  // once the disk has been written since
+  uint32_t window_generation;
+};
+
+struct disk_stream_request;
+
+typedef void (*DISKSTREAMER_CALLBACK) (struct disk_stream_request *request);
+
+// A read started by diskstreamer_read_async
+struct disk_stream_request
+{
+  struct disk_request request;
+
+  // Where the caller wants the data
+  char *out;
+  int total;
+
+  // A read that doesn't cover whole sectors goes through here, offset is
+  // where the data starts in it
+  char *bounce;
+  int offset;
+
+  // Called once the data is in out, it may run from an interrupt handler
+  DISKSTREAMER_CALLBACK callback;
+  void *private;
 };
 
 struct disk_stream *
@@ -18,5 +54,15 @@ diskstreamer_seek (struct disk_stream *stream, int pos);
 int
 diskstreamer_read (struct disk_stream *stream, void *out, int total);
 
+struct disk_stream_request *
+diskstreamer_read_async (struct disk_stream *stream, void *out, int total,
+                         DISKSTREAMER_CALLBACK callback, void *private);
+
+int
+diskstreamer_wait (struct disk_stream_request *request);
+
+void diskstreamer_plug (struct disk_stream *stream);
+void diskstreamer_unplug (struct disk_stream *stream);
+
 void diskstreamer_close(struct disk_stream *stream);
 #endif
@@ -0,0 +1,460 @@
+#include "virtio.h"
+#include "config.h"
+#include "disk.h"
+#include "idt/idt.h"
+#include "io/io.h"
+#include "memory/heap/kheap.h"
+#include "memory/memory.h"
+#include "pci/pci.h"
+#include "status.h"
+#include "string/string.h"
+
+/*
+ * virtio-blk driver over the legacy PCI transport.
+ *
+ * Requests go through a single split virtqueue. Each is a descriptor chain:
+ * the request header, one descriptor per contiguous buffer of the merged
+ * request chain, then the status byte the device fills in. Everything the
+ * scheduler hands out in one go is put on the available ring before the
+ * device is notified once, so a batch costs a single exit to the host.
+ *
+ * Completions are taken off the used ring from the device's interrupt, or
+ * polled while interrupts are off.
+ */
+
+#define VIRTIO_BLK_BAR 0
+
+static struct virtio_blk_device virtio_blk;
+static int virtio_blk_present = 0;
+
+static uint32_t
+virtio_align (uint32_t value)
+{
+  return (value + VIRTQ_ALIGN - 1) & ~(VIRTQ_ALIGN - 1);
+}
+
+/**
+ * @brief Allocates the virtqueue and hands it to the device. The descriptor
+ * table and available ring come first, the used ring starts on the next
+ * page boundary.
+ */
+static int
+virtio_blk_setup_queue (struct virtio_blk_device *device)
+{
+  outw (device->io_base + VIRTIO_REG_QUEUE_SELECT, 0);
+  uint16_t size = insw (device->io_base + VIRTIO_REG_QUEUE_SIZE);
+  if (size == 0)
+    {
+      return -EIO;
+    }
+
+  uint32_t avail_offset = size * sizeof (struct virtq_desc);
+  uint32_t used_offset = virtio_align (
+      avail_offset + sizeof (struct virtq_avail) + ((size + 1) * 2));
+  uint32_t total = used_offset
+                   + virtio_align (sizeof (struct virtq_used)
+                                   + (size * sizeof (struct virtq_used_elem))
+                                   + 2);
+
+  // Heap blocks are page aligned
+  char *ring = kzalloc (total);
+  device->inflight = kzalloc (size * sizeof (struct disk_request *));
+  device->headers = kzalloc (size * sizeof (struct virtio_blk_header));
+  device->statuses = kzalloc (size);
+  if (!ring || !device->inflight || !device->headers || !device->statuses)
+    {
+      return -ENOMEM;
+    }
+
+  device->queue_size = size;
+  device->desc = (struct virtq_desc *)ring;
+  device->avail = (struct virtq_avail *)(ring + avail_offset);
+  device->used = (struct virtq_used *)(ring + used_offset);
+
+  for (int i = 0; i < size; i++)
+    {
+      device->desc[i].next = i + 1;
+    }
+  device->free_head = 0;
+  device->free_count = size;
+  device->last_used = 0;
+
+  outdw (device->io_base + VIRTIO_REG_QUEUE_PFN, (uint32_t)ring / VIRTQ_ALIGN);
+  return LAMEOS_OK;
+}
+
+static uint16_t
+virtio_blk_alloc_desc (struct virtio_blk_device *device)
+{
+  uint16_t index = device->free_head;
+  device->free_head = device->desc[index].next;
+  device->free_count--;
+  return index;
+}
+
+static void
+virtio_blk_free_chain (struct virtio_blk_device *device, uint16_t head)
+{
+  uint16_t index = head;
+  while (1)
+    {
+      uint16_t flags = device->desc[index].flags;
+      uint16_t next = device->desc[index].next;
+      device->desc[index].next = device->free_head;
+      device->free_head = index;
+      device->free_count++;
+      if (!(flags & VIRTQ_DESC_F_NEXT))
+        {
+          break;
+        }
+      index = next;
+    }
+}
+
+/**
+ * @brief Buffers a request chain spans, one data descriptor each.
+ */
+static int
+virtio_blk_count_segments (struct disk_request *request, int total)
+{
+  int segments = 0;
+  int sector = 0;
+  while (sector < total)
+    {
+      int contiguous = 0;
+      disk_request_chain_ptr (request, sector, &contiguous);
+      sector += contiguous;
+      segments++;
+    }
+
+  return segments;
+}
+
+static void
+virtio_blk_set_desc (struct virtio_blk_device *device, uint16_t index,
+                     void *buf, uint32_t len, uint16_t flags)
+{
+  device->desc[index].addr = (uint32_t)buf;
+  device->desc[index].len = len;
+  device->desc[index].flags = flags;
+}
+
+/**
+ * @brief Builds the descriptor chain of a request and puts it on the
+ * available ring. The device isn't notified yet.
+ */
+static void
+virtio_blk_queue_request (struct virtio_blk_device *device,
+                          struct disk_request *request, int total)
+{
+  uint16_t head = virtio_blk_alloc_desc (device);
+  struct virtio_blk_header *header = &device->headers[head];
+  header->reserved = 0;
+  header->sector = request->lba;
+  header->type = VIRTIO_BLK_T_IN;
+  if (request->type == DISK_REQUEST_WRITE)
+    {
+      header->type = VIRTIO_BLK_T_OUT;
+    }
+  else if (request->type == DISK_REQUEST_FLUSH)
+    {
+      header->type = VIRTIO_BLK_T_FLUSH;
+    }
+
+  uint16_t data_flags = VIRTQ_DESC_F_NEXT;
+  if (request->type == DISK_REQUEST_READ)
+    {
+      data_flags |= VIRTQ_DESC_F_WRITE;
+    }
+
+  uint16_t prev = head;
+  virtio_blk_set_desc (device, head, header, sizeof (*header),
+                       VIRTQ_DESC_F_NEXT);
+  int sector = 0;
+  while (sector < total)
+    {
+      int contiguous = 0;
+      void *buf = disk_request_chain_ptr (request, sector, &contiguous);
+      uint16_t index = virtio_blk_alloc_desc (device);
+      virtio_blk_set_desc (device, index, buf,
+                           contiguous * LAMEOS_SECTOR_SIZE, data_flags);
+      device->desc[prev].next = index;
+      prev = index;
+      sector += contiguous;
+    }
+
+  uint16_t status = virtio_blk_alloc_desc (device);
+  device->statuses[head] = 0xFF;
+  virtio_blk_set_desc (device, status, (void *)&device->statuses[head], 1,
+                       VIRTQ_DESC_F_WRITE);
+  device->desc[prev].next = status;
+
+  device->inflight[head] = request;
+  uint16_t avail_idx = device->avail->idx;
+  device->avail->ring[avail_idx % device->queue_size] = head;
+
+  // The ring entry has to be visible before the index that publishes it
+  device->avail->idx = avail_idx + 1;
+}
+
+/**
+ * @brief Moves queued requests onto the virtqueue while descriptors last,
+ * then notifies the device once for all of them.
+ */
+static void
+virtio_blk_dispatch (struct virtio_blk_device *device)
+{
+  int queued = 0;
+  while (1)
+    {
+      struct disk_request *request = device->pending;
+      device->pending = 0;
+      if (!request)
+        {
+          request = disk_queue_next (&device->queue);
+        }
+
+      if (!request)
+        {
+          break;
+        }
+
+      int total = request->type == DISK_REQUEST_FLUSH
+                      ? 0
+                      : disk_request_chain_total (request);
+      int needed = 2 + virtio_blk_count_segments (request, total);
+      if (needed > device->queue_size)
+        {
+          disk_request_chain_finish (request, -EINVARG);
+          continue;
+        }
+
+      if (needed > device->free_count)
+        {
+          device->pending = request;
+          break;
+        }
+
+      virtio_blk_queue_request (device, request, total);
+      queued++;
+    }
+
+  if (queued)
+    {
+      outw (device->io_base + VIRTIO_REG_QUEUE_NOTIFY, 0);
+    }
+}
+
+/**
+ * @brief Completes every request the device has put on the used ring and
+ * refills the virtqueue.
+ */
+static void
+virtio_blk_service (struct virtio_blk_device *device)
+{
+  int completed = 0;
+  while (device->last_used != device->used->idx)
+    {
+      volatile struct virtq_used_elem *elem
+          = &device->used->ring[device->last_used % device->queue_size];
+      uint16_t head = elem->id;
+      struct disk_request *request = device->inflight[head];
+      int status = device->statuses[head] == VIRTIO_BLK_S_OK ? LAMEOS_OK
+                                                             : -EIO;
+      device->inflight[head] = 0;
+      virtio_blk_free_chain (device, head);
+      device->last_used++;
+      completed++;
+
+      disk_request_chain_finish (request, status);
+    }
+
+  if (completed)
+    {
+      virtio_blk_dispatch (device);
+    }
+}
+
+static void
+virtio_blk_interrupt ()
+{
+  // Reading the ISR status acknowledges the interrupt
+  insb (virtio_blk.io_base + VIRTIO_REG_ISR_STATUS);
+  virtio_blk_service (&virtio_blk);
+}
+
+static int virtio_blk_submit (struct disk *disk,
+                              struct disk_request *request);
+static void virtio_blk_wait (struct disk *disk, struct disk_request *request);
+static void virtio_blk_plug (struct disk *disk);
+static void virtio_blk_unplug (struct disk *disk);
+static void virtio_blk_queue_stats (struct disk *disk,
+                                    struct disk_queue_stats *stats);
+
+struct disk_driver virtio_blk_driver = { .submit = virtio_blk_submit,
+                                         .wait = virtio_blk_wait,
+                                         .plug = virtio_blk_plug,
+                                         .unplug = virtio_blk_unplug,
+                                         .queue_stats
+                                         = virtio_blk_queue_stats };
+
+/**
+ * @brief Finds a virtio-blk device and brings it up.
+ * @return struct disk_driver* The driver, or 0 if there is no device.
+ */
+struct disk_driver *
+virtio_blk_init ()
+{
+  strcpy (virtio_blk_driver.name, "VIRTIO-BLK");
+  memset (&virtio_blk, 0, sizeof (virtio_blk));
+  virtio_blk_present = 0;
+
+  struct pci_device pci;
+  if (pci_find_id (VIRTIO_PCI_VENDOR, VIRTIO_PCI_DEVICE_BLOCK, 0, &pci)
+      != LAMEOS_OK)
+    {
+      return 0;
+    }
+
+  struct virtio_blk_device *device = &virtio_blk;
+  device->io_base = pci_bar_io_base (&pci, VIRTIO_BLK_BAR);
+  device->irq = pci.interrupt_line;
+  if (!device->io_base)
+    {
+      return 0;
+    }
+
+  pci_enable_bus_master (&pci);
+  uint16_t io_base = device->io_base;
+
+  // Reset, then tell the device a driver has found it
+  outb (io_base + VIRTIO_REG_DEVICE_STATUS, 0);
+  outb (io_base + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+  outb (io_base + VIRTIO_REG_DEVICE_STATUS,
+        VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+  device->features = insdw (io_base + VIRTIO_REG_DEVICE_FEATURES)
+                     & VIRTIO_BLK_F_FLUSH;
+  outdw (io_base + VIRTIO_REG_GUEST_FEATURES, device->features);
+
+  if (virtio_blk_setup_queue (device) < 0)
+    {
+      outb (io_base + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+      return 0;
+    }
+
+  // Sectors past 32 bits aren't addressable by struct disk
+  uint32_t capacity_high = insdw (io_base + VIRTIO_REG_BLK_CAPACITY + 4);
+  device->total_sectors
+      = capacity_high ? 0xFFFFFFFF
+                      : insdw (io_base + VIRTIO_REG_BLK_CAPACITY);
+
+  disk_queue_init (&device->queue);
+  if (device->irq < IDT_TOTAL_IRQS)
+    {
+      idt_register_irq_handler (device->irq, virtio_blk_interrupt);
+    }
+
+  outb (io_base + VIRTIO_REG_DEVICE_STATUS,
+        VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER
+            | VIRTIO_STATUS_DRIVER_OK);
+  virtio_blk_present = 1;
+  return &virtio_blk_driver;
+}
+
+struct virtio_blk_device *
+virtio_blk_get_device ()
+{
+  return virtio_blk_present ? &virtio_blk : 0;
+}
+
+static int
+virtio_blk_submit (struct disk *disk, struct disk_request *request)
+{
+  struct virtio_blk_device *device = disk->driver_private;
+  request->completed = 0;
+  request->done = 0;
+  request->status = 0;
+
+  if (request->type == DISK_REQUEST_FLUSH
+      && !(device->features & VIRTIO_BLK_F_FLUSH))
+    {
+      disk_request_complete (request, LAMEOS_OK);
+      return LAMEOS_OK;
+    }
+
+  int interrupts_enabled = are_interrupts_enabled ();
+  disable_interrupts ();
+  disk_queue_add (&device->queue, request);
+  virtio_blk_dispatch (device);
+  if (interrupts_enabled)
+    {
+      enable_interrupts ();
+    }
+
+  return LAMEOS_OK;
+}
+
+/**
+ * @brief Waits for a submitted request. With interrupts on the CPU halts
+ * until the interrupt handler completes it, otherwise the used ring is
+ * polled.
+ */
+static void
+virtio_blk_wait (struct disk *disk, struct disk_request *request)
+{
+  struct virtio_blk_device *device = disk->driver_private;
+  if (!are_interrupts_enabled ())
+    {
+      while (!request->done)
+        {
+          virtio_blk_service (device);
+        }
+      return;
+    }
+
+  disable_interrupts ();
+  while (!request->done)
+    {
+      wait_for_interrupt ();
+      disable_interrupts ();
+    }
+  enable_interrupts ();
+}
+
+static void
+virtio_blk_plug (struct disk *disk)
+{
+  struct virtio_blk_device *device = disk->driver_private;
+  int interrupts_enabled = are_interrupts_enabled ();
+  disable_interrupts ();
+  disk_queue_plug (&device->queue);
+  if (interrupts_enabled)
+    {
+      enable_interrupts ();
+    }
+}
+
+static void
+virtio_blk_unplug (struct disk *disk)
+{
+  struct virtio_blk_device *device = disk->driver_private;
+  int interrupts_enabled = are_interrupts_enabled ();
+  disable_interrupts ();
+  if (disk_queue_unplug (&device->queue))
+    {
+      virtio_blk_dispatch (device);
+    }
+
+  if (interrupts_enabled)
+    {
+      enable_interrupts ();
+    }
+}
+
+static void
+virtio_blk_queue_stats (struct disk *disk, struct disk_queue_stats *stats)
+{
+  struct virtio_blk_device *device = disk->driver_private;
+  *stats = device->queue.stats;
+}
@@ -0,0 +1,119 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include "queue.h"
+#include <stdint.h>
+
+#define VIRTIO_PCI_VENDOR 0x1AF4
+// Transitional virtio-blk, it still has the legacy I/O port interface
+#define VIRTIO_PCI_DEVICE_BLOCK 0x1001
+
+// Legacy register offsets from the I/O base in BAR0
+#define VIRTIO_REG_DEVICE_FEATURES 0x00
+#define VIRTIO_REG_GUEST_FEATURES 0x04
+#define VIRTIO_REG_QUEUE_PFN 0x08
+#define VIRTIO_REG_QUEUE_SIZE 0x0C
+#define VIRTIO_REG_QUEUE_SELECT 0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY 0x10
+#define VIRTIO_REG_DEVICE_STATUS 0x12
+#define VIRTIO_REG_ISR_STATUS 0x13
+// virtio-blk configuration, the capacity in sectors is 64 bits
+#define VIRTIO_REG_BLK_CAPACITY 0x14
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER 0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FAILED 0x80
+
+#define VIRTIO_BLK_F_FLUSH 0x00000200
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+
+#define VIRTIO_BLK_S_OK 0
+
+#define VIRTQ_DESC_F_NEXT 0x01
+// The device writes into the buffer
+#define VIRTQ_DESC_F_WRITE 0x02
+
+// Legacy virtqueues align the used ring to a page
+#define VIRTQ_ALIGN 4096
+
+struct disk_request;
+struct disk_driver;
+
+struct virtq_desc
+{
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+} __attribute__ ((packed));
+
+struct virtq_avail
+{
+  uint16_t flags;
+  uint16_t idx;
+  uint16_t ring[];
+} __attribute__ ((packed));
+
+struct virtq_used_elem
+{
+  uint32_t id;
+  uint32_t len;
+} __attribute__ ((packed));
+
+struct virtq_used
+{
+  uint16_t flags;
+  uint16_t idx;
+  struct virtq_used_elem ring[];
+} __attribute__ ((packed));
+
+// Leads the descriptor chain of every virtio-blk request
+struct virtio_blk_header
+{
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t sector;
+} __attribute__ ((packed));
+
+struct virtio_blk_device
+{
+  uint16_t io_base;
+  uint8_t irq;
+
+  // Features both sides agreed on
+  uint32_t features;
+  uint32_t total_sectors;
+
+  // The split virtqueue, its three parts in one page aligned allocation
+  uint16_t queue_size;
+  volatile struct virtq_desc *desc;
+  volatile struct virtq_avail *avail;
+  volatile struct virtq_used *used;
+
+  // Chain of unused descriptors linked through next
+  uint16_t free_head;
+  uint16_t free_count;
+
+  // How far the used ring has been consumed
+  uint16_t last_used;
+
+  // Per head descriptor, the request chain it carries, its header and the
+  // status byte the device writes back
+  struct disk_request **inflight;
+  struct virtio_blk_header *headers;
+  volatile uint8_t *statuses;
+
+  // A request taken off the queue that waits for free descriptors
+  struct disk_request *pending;
+
+  struct disk_queue queue;
+};
+
+struct disk_driver *virtio_blk_init ();
+struct virtio_blk_device *virtio_blk_get_device ();
+
+#endif
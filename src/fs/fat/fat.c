@@ -0,0 +1,346 @@
+#include "fat.h"
+#include "disk/disk.h"
+#include "memory/heap/kheap.h"
+#include "memory/memory.h"
+#include "status.h"
+
+/*
+ * What FAT16 and FAT32 share: cluster chains held as extent maps, 8.3 names
+ * and writing a file back. Each driver keeps its own FAT, these only reach
+ * it through the callbacks they're given.
+ */
+
+void
+fat_free_extent_map (struct fat_extent_map *map)
+{
+  if (map->extents)
+    {
+      kfree (map->extents);
+    }
+
+  map->extents = 0;
+  map->total = 0;
+  map->capacity = 0;
+}
+
+/**
+ * @brief Walks a cluster chain and records it as runs of adjacent clusters.
+ * The chain is walked twice, to count the runs and then to fill them in, so
+ * the map is allocated once at its final size.
+ * @param total_clusters One past the highest cluster, a longer chain loops.
+ */
+int
+fat_build_extent_map (struct disk *disk, uint32_t first_cluster,
+                      uint32_t total_clusters,
+                      FAT_NEXT_CLUSTER_FUNCTION next_cluster,
+                      struct fat_extent_map *map)
+{
+  map->extents = 0;
+  map->total = 0;
+  map->capacity = 0;
+  if (first_cluster < LAMEOS_FAT_FIRST_CLUSTER
+      || first_cluster >= total_clusters)
+    {
+      return 0;
+    }
+
+  int total = 0;
+  for (int pass = 0; pass < 2; pass++)
+    {
+      int runs = 0;
+      int previous = -1;
+      uint32_t clusters = 0;
+      for (int cluster = first_cluster; cluster >= 0;
+           cluster = next_cluster (disk, cluster))
+        {
+          if (clusters >= total_clusters)
+            {
+              fat_free_extent_map (map);
+              return -EIO;
+            }
+
+          // A new run starts wherever the chain isn't contiguous
+          if (cluster != previous + 1)
+            {
+              if (pass == 1)
+                {
+                  map->extents[runs].file_cluster = clusters;
+                  map->extents[runs].disk_cluster = cluster;
+                }
+
+              runs++;
+            }
+
+          if (pass == 1)
+            {
+              map->extents[runs - 1].length++;
+            }
+
+          previous = cluster;
+          clusters++;
+        }
+
+      if (pass == 0)
+        {
+          total = runs;
+          map->extents = kzalloc (total * sizeof (struct fat_extent));
+          if (!map->extents)
+            {
+              return -ENOMEM;
+            }
+        }
+    }
+
+  map->total = total;
+  map->capacity = total;
+  return 0;
+}
+
+/**
+ * @brief Finds the run holding a cluster of the file with a binary search.
+ * @return struct fat_extent* The run, or 0 past the end of the chain.
+ */
+struct fat_extent *
+fat_extent_map_lookup (struct fat_extent_map *map, uint32_t file_cluster)
+{
+  int low = 0;
+  int high = map->total - 1;
+  while (low <= high)
+    {
+      int mid = low + (high - low) / 2;
+      struct fat_extent *extent = &map->extents[mid];
+      if (file_cluster < extent->file_cluster)
+        {
+          high = mid - 1;
+        }
+      else if (file_cluster >= extent->file_cluster + extent->length)
+        {
+          low = mid + 1;
+        }
+      else
+        {
+          return extent;
+        }
+    }
+
+  return 0;
+}
+
+/**
+ * @brief Makes room for one more extent, so the next append can't fail.
+ */
+int
+fat_extent_map_reserve (struct fat_extent_map *map)
+{
+  if (map->total < map->capacity)
+    {
+      return 0;
+    }
+
+  struct fat_extent *extents
+      = kzalloc ((map->total + 1) * sizeof (struct fat_extent));
+  if (!extents)
+    {
+      return -ENOMEM;
+    }
+
+  if (map->extents)
+    {
+      memcpy (extents, map->extents, map->total * sizeof (struct fat_extent));
+      kfree (map->extents);
+    }
+
+  map->extents = extents;
+  map->capacity = map->total + 1;
+  return 0;
+}
+
+/**
+ * @brief Adds a run of clusters to the end of an extent map, growing the
+ * last extent when the run follows on from it.
+ */
+int
+fat_extent_map_append (struct fat_extent_map *map, uint32_t disk_cluster,
+                       uint32_t length)
+{
+  uint32_t file_cluster = 0;
+  if (map->total)
+    {
+      struct fat_extent *last = &map->extents[map->total - 1];
+      file_cluster = last->file_cluster + last->length;
+      if (last->disk_cluster + last->length == disk_cluster)
+        {
+          last->length += length;
+          return 0;
+        }
+    }
+
+  int res = fat_extent_map_reserve (map);
+  if (res < 0)
+    {
+      return res;
+    }
+
+  map->extents[map->total].file_cluster = file_cluster;
+  map->extents[map->total].disk_cluster = disk_cluster;
+  map->extents[map->total].length = length;
+  map->total++;
+  return 0;
+}
+
+uint32_t
+fat_extent_map_clusters (struct fat_extent_map *map)
+{
+  if (!map->total)
+    {
+      return 0;
+    }
+
+  struct fat_extent *last = &map->extents[map->total - 1];
+  return last->file_cluster + last->length;
+}
+
+/**
+ * @brief Cuts a chain down to its first keep clusters and frees the rest.
+ * The map is cut down even if a FAT entry couldn't be changed, the clusters
+ * past keep are then lost rather than still in the file.
+ */
+int
+fat_truncate_clusters (struct disk *disk, struct fat_extent_map *map,
+                       uint32_t keep, FAT_SET_ENTRY_FUNCTION set_entry,
+                       uint32_t end_of_chain)
+{
+  int res = 0;
+  int total = 0;
+  for (int i = 0; i < map->total; i++)
+    {
+      struct fat_extent *extent = &map->extents[i];
+      for (uint32_t j = 0; j < extent->length && res == 0; j++)
+        {
+          uint32_t file_cluster = extent->file_cluster + j;
+          if (file_cluster + 1 == keep)
+            {
+              res = set_entry (disk, extent->disk_cluster + j, end_of_chain);
+            }
+          else if (file_cluster >= keep)
+            {
+              res = set_entry (disk, extent->disk_cluster + j,
+                               LAMEOS_FAT_UNUSED);
+            }
+        }
+
+      if (extent->file_cluster < keep)
+        {
+          if (extent->file_cluster + extent->length > keep)
+            {
+              extent->length = keep - extent->file_cluster;
+            }
+
+          total = i + 1;
+        }
+    }
+
+  map->total = total;
+  if (!total)
+    {
+      fat_free_extent_map (map);
+    }
+
+  return res;
+}
+
+/**
+ * @brief Packs a path component into the form directory entries store
+ * names in, "a.txt" becomes "A       TXT".
+ * @return int 0, or -EINVARG if the name can't be an 8.3 name.
+ */
+int
+fat_pack_name (const char *name, struct fat_packed_name *packed)
+{
+  uint8_t *out = (uint8_t *)packed->words;
+  memset (out, ' ', LAMEOS_FAT_NAME_LENGTH);
+  out[LAMEOS_FAT_NAME_LENGTH] = 0;
+
+  // "." and ".." are stored as they are
+  if (name[0] == '.')
+    {
+      int dots = name[1] == '.' ? 2 : 1;
+      if (name[dots] != 0)
+        {
+          return -EINVARG;
+        }
+
+      memcpy (out, (void *)name, dots);
+      return 0;
+    }
+
+  int i = 0;
+  int limit = 8;
+  for (; *name; name++)
+    {
+      char c = *name;
+      if (c == '.')
+        {
+          // Only one dot, and it moves on to the extension
+          if (limit != 8)
+            {
+              return -EINVARG;
+            }
+
+          i = 8;
+          limit = LAMEOS_FAT_NAME_LENGTH;
+          continue;
+        }
+
+      if (i >= limit)
+        {
+          return -EINVARG;
+        }
+
+      if (c >= 'a' && c <= 'z')
+        {
+          c -= 'a' - 'A';
+        }
+
+      out[i++] = c;
+    }
+
+  if (out[0] == ' ')
+    {
+      return -EINVARG;
+    }
+
+  if (out[0] == LAMEOS_FAT_DELETED)
+    {
+      out[0] = LAMEOS_FAT_E5_ESCAPE;
+    }
+
+  return 0;
+}
+
+int
+fat_name_matches (struct fat_directory_item *item,
+                  struct fat_packed_name *name)
+{
+  // Entries are 32 bytes in a block aligned buffer, so the name is aligned.
+  // The byte after the extension is the attribute, masked out.
+  uint32_t *raw = (uint32_t *)item->filename;
+  return raw[0] == name->words[0] && raw[1] == name->words[1]
+         && (raw[2] & 0x00FFFFFF) == name->words[2];
+}
+
+/**
+ * @brief Writes back the FAT changes made for a file, then its data, which
+ * may still only be in the write-back cache.
+ */
+int
+fat_sync (struct disk *disk, FAT_FLUSH_FUNCTION flush_fat)
+{
+  int res = flush_fat (disk);
+  if (res < 0)
+    {
+      return res;
+    }
+
+  return disk_sync (disk);
+}
@@ -0,0 +1,104 @@
+#ifndef FAT_H
+#define FAT_H
+#include <stdint.h>
+
+struct disk;
+
+// Bytes of a directory entry's name and extension
+#define LAMEOS_FAT_NAME_LENGTH 11
+
+// A deleted entry starts with 0xE5, a name that really starts with it is
+// stored with 0x05 instead
+#define LAMEOS_FAT_DELETED 0xE5
+#define LAMEOS_FAT_E5_ESCAPE 0x05
+
+// Data clusters are numbered from 2, a FAT entry of 0 is a free cluster
+#define LAMEOS_FAT_FIRST_CLUSTER 0x02
+#define LAMEOS_FAT_UNUSED 0x00
+
+// FAT directory entry attribute bitmask
+#define FAT_FILE_READ_ONLY 0x01
+#define FAT_FILE_HIDDEN 0x02
+#define FAT_FILE_SYSTEM 0x04
+#define FAT_FILE_VOLUME_LABEL 0x08
+#define FAT_FILE_SUBDIRECTORY 0x10
+#define FAT_FILE_ARCHIVE 0x20
+#define FAT_FILE_DEVICE 0x40
+#define FAT_FILE_RESERVED 0x80
+
+struct fat_directory_item
+{
+  uint8_t filename[8];
+  uint8_t ext[3];
+  uint8_t attribute;
+  uint8_t reserved;
+  uint8_t creation_time_tenths_of_a_sec;
+  uint16_t creation_time;
+  uint16_t creation_date;
+  uint16_t last_access;
+  uint16_t high_16_bits_first_cluster;
+  uint16_t last_mod_time;
+  uint16_t last_mod_date;
+  uint16_t low_16_bits_first_cluster;
+  uint32_t filesize;
+} __attribute__ ((packed));
+
+// An 8.3 name as a directory entry stores it, uppercase and space padded.
+// Held as words so it compares with three loads, the twelfth byte is 0.
+struct fat_packed_name
+{
+  uint32_t words[3];
+};
+
+// A run of clusters that lie one after another on the disk
+struct fat_extent
+{
+  // Index of the run's first cluster within the file
+  uint32_t file_cluster;
+  uint32_t disk_cluster;
+  uint32_t length;
+};
+
+// A cluster chain as runs, sorted by file_cluster
+struct fat_extent_map
+{
+  struct fat_extent *extents;
+  int total;
+
+  // Extents the array has room for
+  int capacity;
+};
+
+// Returns the cluster after one in its chain, or a negative status where
+// the chain ends or is broken
+typedef int (*FAT_NEXT_CLUSTER_FUNCTION) (struct disk *disk,
+                                          uint32_t cluster);
+
+// Changes a FAT entry in memory, the driver writes it back later
+typedef int (*FAT_SET_ENTRY_FUNCTION) (struct disk *disk, uint32_t cluster,
+                                       uint32_t value);
+
+typedef int (*FAT_FLUSH_FUNCTION) (struct disk *disk);
+
+void fat_free_extent_map (struct fat_extent_map *map);
+int fat_build_extent_map (struct disk *disk, uint32_t first_cluster,
+                          uint32_t total_clusters,
+                          FAT_NEXT_CLUSTER_FUNCTION next_cluster,
+                          struct fat_extent_map *map);
+struct fat_extent *fat_extent_map_lookup (struct fat_extent_map *map,
+                                          uint32_t file_cluster);
+int fat_extent_map_reserve (struct fat_extent_map *map);
+int fat_extent_map_append (struct fat_extent_map *map, uint32_t disk_cluster,
+                           uint32_t length);
+uint32_t fat_extent_map_clusters (struct fat_extent_map *map);
+int fat_truncate_clusters (struct disk *disk, struct fat_extent_map *map,
+                           uint32_t keep, FAT_SET_ENTRY_FUNCTION set_entry,
+                           uint32_t end_of_chain);
+
+int fat_pack_name (const char *name, struct fat_packed_name *packed);
+int fat_name_matches (struct fat_directory_item *item,
+                      struct fat_packed_name *name);
+
+int fat_sync (struct disk *disk, FAT_FLUSH_FUNCTION flush_fat);
+
+#endif
@@ -1,4 +1,6 @@
 #include "fat16.h"
+#include "fat.h"
+#include "config.h"
 #include "disk/disk.h"
 #include "disk/streamer.h"
 #include "kernel.h"
@@ -10,23 +12,16 @@
 
 #define LAMEOS_FAT16_SIGNATURE 0x29
 #define LAMEOS_FAT16_FAT_ENTRY_SIZE 0x02
-#define LAMEOS_FAT16_BAD_SECTOR 0xFF7
-#define LAMEOS_FAT16_UNUSED 0x00
-
-// Internal use, don't represent anything on the disk
-typedef unsigned int FAT_ITEM_TYPE;
-#define FAT_ITEM_TYPE_DIRECTORY 0
-#define FAT_ITEM_TYPE_FILE 1
-
-// FAT directory entry attribute bitmask
-#define FAT_FILE_READ_ONLY 0x01
-#define FAT_FILE_HIDDEN 0x02
-#define FAT_FILE_SYSTEM 0x04
-#define FAT_FILE_VOLUME_LABEL 0x08
-#define FAT_FILE_SUBDIRECTORY 0x10
-#define FAT_FILE_ARCHIVE 0x20
-#define FAT_FILE_DEVICE 0x40
-#define FAT_FILE_RESERVED 0x80
+#define LAMEOS_FAT16_BAD_SECTOR 0xFFF7
+
+// Entries from here up are reserved, bad or end the chain
+#define LAMEOS_FAT16_RESERVED_CLUSTERS 0xFFF0
+
+// Cluster reads a read keeps in flight while it walks the chain
+#define LAMEOS_FAT16_READS_IN_FLIGHT 4
+
+// Written into the FAT entry of a chain's last cluster
+#define LAMEOS_FAT16_END_OF_CHAIN 0xFFFF
 
 struct fat_header_extended
 {
@@ -65,46 +60,83 @@ struct fat_h
   } shared;
 };
 
-struct fat_directory_item
-{
-  uint8_t filename[8];
-  uint8_t ext[3];
-  uint8_t attribute;
-  uint8_t reserved;
-  uint8_t creation_time_tenths_of_a_sec;
-  uint16_t creation_time;
-  uint16_t creation_date;
-  uint16_t last_access;
-  uint16_t high_16_bits_first_cluster;
-  uint16_t last_mod_time;
-  uint16_t last_mod_date;
-  uint16_t low_16_bits_first_cluster;
-  uint32_t filesize;
-} __attribute__ ((packed));
-
 struct fat_directory
 {
   struct fat_directory_item *item;
   int total;
   int sector_pos;
   int ending_sector_pos;
+
+  // Where a subdirectory's items lie, empty for the root directory which
+  // is sector_pos onwards
+  struct fat_extent_map extents;
 };
 
-struct fat_item
+// A name looked up in a directory, and what it resolved to
+struct fat_dentry
 {
-  union
-  {
-    struct fat_directory_item *item;
-    struct fat_directory *directory;
-  };
+  // The directory it was looked up in, 0 for the root
+  struct fat_dentry *parent;
+  uint32_t hash;
+  struct fat_packed_name name;
+
+  // Set if the directory has no such item
+  int negative;
+  struct fat_directory_item item;
+
+  // Slot of the item in the parent directory
+  int index;
+
+  // For a directory, its items once something was looked up in it
+  struct fat_directory *directory;
+
+  // The item's cluster chain, built on first use
+  struct fat_extent_map extents;
+  int extents_valid;
+
+  // Cached entries looked up in this one and open descriptors, they pin it
+  // in the cache
+  int children;
+  int refs;
+
+  int used;
+  struct fat_dentry *hash_next;
+
+  // Neighbours on the LRU list, head is most recently used
+  struct fat_dentry *prev;
+  struct fat_dentry *next;
+};
 
-  FAT_ITEM_TYPE type;
+struct fat_dentry_cache
+{
+  struct fat_dentry *entries;
+  struct fat_dentry *buckets[LAMEOS_FAT16_DENTRY_HASH_BUCKETS];
+  struct fat_dentry *head;
+  struct fat_dentry *tail;
 };
 
 struct fat_file_descriptor
 {
-  struct fat_item *item;
+  struct disk *disk;
+
+  // The file's cache entry, pinned while the descriptor is open
+  struct fat_dentry *dentry;
   uint32_t pos;
+  FILE_MODE mode;
+
+  // Set once the file's directory entry changed and has to be written back
+  int dirty;
+
+  // Where the previous read ended, a read starting there is sequential
+  uint32_t ra_next;
+
+  // Bytes read ahead of a sequential reader, 0 while reads are random
+  uint32_t ra_window;
+
+  // The part of the file read ahead last, and the read if it's in flight
+  uint32_t ra_start;
+  uint32_t ra_end;
+  struct disk_prefetch prefetch;
 };
 
 struct fat_private
@@ -112,11 +144,24 @@ struct fat_private
   struct fat_h header;
   struct fat_directory root_directory;
 
+  // Resolved path components, so repeated opens skip the directory scans
+  struct fat_dentry_cache dentries;
+
   // Used to stream data clusters
   struct disk_stream *cluster_read_stream;
 
-  // Used to stream the file allocation table
-  struct disk_stream *fat_read_stream;
+  // The first copy of the file allocation table, loaded at resolve
+  uint16_t *fat;
+  uint32_t fat_entries;
+
+  // One byte per FAT sector, set for those changed since the FAT was last
+  // written back
+  uint8_t *fat_dirty;
+
+  // Bit set for every free cluster, and one past the highest cluster
+  uint32_t *free_clusters;
+  uint32_t total_clusters;
+  uint32_t free_total;
 
   // Used in situations where we stream the directory
   struct disk_stream *directory_stream;
@@ -129,13 +174,22 @@ int fat16_read (struct disk *disk, void *descriptor, uint32_t size,
 int fat16_seek (void *private, uint32_t offset, FILE_SEEK_MODE seek_mode);
 int fat16_stat (struct disk *disk, void *private, struct file_stat *stat);
 int fat16_close (void *private);
+int fat16_write (struct disk *disk, void *descriptor, uint32_t size,
+                 uint32_t nmemb, const char *in_ptr);
+int fat16_truncate (struct disk *disk, void *descriptor, uint32_t size);
+int fat16_unlink (struct disk *disk, struct path_part *path);
+int fat16_statfs (struct disk *disk, struct fs_stat *stat);
 
 struct filesystem fat16_fs = { .resolve = fat16_resolve,
                                .open = fat16_open,
                                .read = fat16_read,
                                .seek = fat16_seek,
                                .stat = fat16_stat,
-                               .close = fat16_close };
+                               .close = fat16_close,
+                               .write = fat16_write,
+                               .truncate = fat16_truncate,
+                               .unlink = fat16_unlink,
+                               .statfs = fat16_statfs };
 
 struct filesystem *
 fat16_init ()
@@ -150,7 +204,6 @@ fat16_init_private (struct disk *disk, struct fat_private *private)
 {
   memset (private, 0, sizeof (struct fat_private));
   private->cluster_read_stream = diskstreamer_new (disk->id);
-  private->fat_read_stream = diskstreamer_new (disk->id);
   private->directory_stream = diskstreamer_new (disk->id);
 };
 
@@ -160,55 +213,6 @@ fat16_sector_to_absolute (struct disk *disk, int sector)
   return sector * disk->sector_size;
 }
 
-int
-fat16_get_total_items_for_directory (struct disk *disk,
-                                     uint32_t directory_start_sector)
-{
-  struct fat_directory_item item;
-  struct fat_directory_item empty_item;
-  memset (&empty_item, 0, sizeof (empty_item));
-
-  struct fat_private *fat_private = disk->fs_private;
-
-  int res = 0;
-  int i = 0;
-  int directory_start_pos = directory_start_sector * disk->sector_size;
-  struct disk_stream *stream = fat_private->directory_stream;
-  if (diskstreamer_seek (stream, directory_start_pos) != LAMEOS_OK)
-    {
-      res = -EIO;
-      goto out;
-    }
-
-  while (1)
-    {
-      if (diskstreamer_read (stream, &item, sizeof (item)) != LAMEOS_OK)
-        {
-          res = -EIO;
-          goto out;
-        }
-
-      if (item.filename[0] == 0x00)
-        {
-          // We are done
-          break;
-        }
-
-      // Is the item unused
-      if (item.filename[0] == 0xE5)
-        {
-          continue;
-        }
-
-      i++;
-    }
-
-  res = i;
-
-out:
-  return res;
-}
-
 int
 fat16_get_root_directory (struct disk *disk, struct fat_private *fat_private,
                           struct fat_directory *directory)
@@ -226,9 +230,6 @@ fat16_get_root_directory (struct disk *disk, struct fat_private *fat_private,
       total_sectors += 1;
     }
 
-  int total_items
-      = fat16_get_total_items_for_directory (disk, root_dir_sector_pos);
-
   struct fat_directory_item *dir = kzalloc (root_dir_size);
   if (!dir)
     {
@@ -251,20 +252,113 @@ fat16_get_root_directory (struct disk *disk, struct fat_private *fat_private,
       goto out;
     }
 
+  // Every slot, the scan stops at the first never used one
   directory->item = dir;
-  directory->total = total_items;
+  directory->total = root_dir_entries;
   directory->sector_pos = root_dir_sector_pos;
   directory->ending_sector_pos
       = root_dir_sector_pos + (root_dir_size / disk->sector_size);
 out:
+  if (res < 0 && dir)
+    {
+      kfree (dir);
+    }
   return res;
 }
 
+/**
+ * @brief Reads the whole first FAT into memory with one request, so walking
+ * a cluster chain is array lookups rather than a disk read per cluster.
+ */
+static int
+fat16_load_fat (struct disk *disk, struct fat_private *private)
+{
+  struct fat_header *primary_header = &private->header.primary_header;
+  int sectors = primary_header->sectors_per_fat;
+  if (sectors == 0)
+    {
+      return -EFSNOTUS;
+    }
+
+  private->fat = kzalloc (sectors * disk->sector_size);
+  if (!private->fat)
+    {
+      return -ENOMEM;
+    }
+
+  private->fat_dirty = kzalloc (sectors);
+  if (!private->fat_dirty)
+    {
+      return -ENOMEM;
+    }
+
+  private->fat_entries
+      = (sectors * disk->sector_size) / LAMEOS_FAT16_FAT_ENTRY_SIZE;
+  if (disk_read_block (disk, primary_header->reserved_sectors, sectors,
+                       private->fat)
+      < 0)
+    {
+      return -EIO;
+    }
+
+  return 0;
+}
+
+/**
+ * @brief Records which data clusters are free, from the FAT loaded in
+ * memory. Needs the root directory, the data clusters start after it.
+ */
+static int
+fat16_build_free_bitmap (struct fat_private *private)
+{
+  struct fat_header *primary_header = &private->header.primary_header;
+  uint32_t total_sectors = primary_header->number_of_sectors
+                               ? primary_header->number_of_sectors
+                               : primary_header->sectors_big;
+  uint32_t data_start = private->root_directory.ending_sector_pos;
+  if (total_sectors <= data_start || !primary_header->sectors_per_cluster)
+    {
+      return -EFSNOTUS;
+    }
+
+  private->total_clusters
+      = ((total_sectors - data_start) / primary_header->sectors_per_cluster)
+        + LAMEOS_FAT_FIRST_CLUSTER;
+  if (private->total_clusters > private->fat_entries)
+    {
+      private->total_clusters = private->fat_entries;
+    }
+
+  private->free_clusters
+      = kzalloc (((private->total_clusters + 31) / 32) * sizeof (uint32_t));
+  if (!private->free_clusters)
+    {
+      return -ENOMEM;
+    }
+
+  for (uint32_t cluster = LAMEOS_FAT_FIRST_CLUSTER;
+       cluster < private->total_clusters; cluster++)
+    {
+      if (private->fat[cluster] == LAMEOS_FAT_UNUSED)
+        {
+          private->free_clusters[cluster / 32] |= 1 << (cluster % 32);
+          private->free_total++;
+        }
+    }
+
+  return 0;
+}
+
 int
 fat16_resolve (struct disk *disk)
 {
   int res = 0;
   struct fat_private *fat_private = kzalloc (sizeof (struct fat_private));
+  if (!fat_private)
+    {
+      return -ENOMEM;
+    }
+
   fat16_init_private (disk, fat_private);
 
   disk->fs_private = fat_private;
@@ -291,6 +385,20 @@ fat16_resolve (struct disk *disk)
       goto out;
     }
 
+  res = fat16_load_fat (disk, fat_private);
+  if (res < 0)
+    {
+      goto out;
+    }
+
+  fat_private->dentries.entries = kzalloc (
+      LAMEOS_FAT16_DENTRY_CACHE_ENTRIES * sizeof (struct fat_dentry));
+  if (!fat_private->dentries.entries)
+    {
+      res = -ENOMEM;
+      goto out;
+    }
+
   if (fat16_get_root_directory (disk, fat_private,
                                 &fat_private->root_directory)
       != LAMEOS_OK)
@@ -299,6 +407,12 @@ fat16_resolve (struct disk *disk)
       goto out;
     }
 
+  res = fat16_build_free_bitmap (fat_private);
+  if (res < 0)
+    {
+      goto out;
+    }
+
 out:
   if (stream)
     {
@@ -307,213 +421,427 @@ out:
 
   if (res < 0)
     {
+      if (fat_private->fat)
+        {
+          kfree (fat_private->fat);
+        }
+
+      if (fat_private->fat_dirty)
+        {
+          kfree (fat_private->fat_dirty);
+        }
+
+      if (fat_private->free_clusters)
+        {
+          kfree (fat_private->free_clusters);
+        }
+
+      if (fat_private->dentries.entries)
+        {
+          kfree (fat_private->dentries.entries);
+        }
+
+      if (fat_private->root_directory.item)
+        {
+          kfree (fat_private->root_directory.item);
+        }
+
+      // Every disk that isn't FAT16 comes through here, FAT32 ones included
+      if (fat_private->cluster_read_stream)
+        {
+          diskstreamer_close (fat_private->cluster_read_stream);
+        }
+
+      if (fat_private->directory_stream)
+        {
+          diskstreamer_close (fat_private->directory_stream);
+        }
+
       kfree (fat_private);
       disk->fs_private = 0;
     }
   return res;
 }
 
-void
-fat16_to_proper_string (char **out, const char *in)
+static uint32_t
+fat16_get_first_cluster (struct fat_directory_item *item)
 {
-  while (*in != 0x00 && *in != 0x20)
-    {
-      **out = *in;
-      *out += 1;
-      in += 1;
-    }
+  return (item->high_16_bits_first_cluster) | item->low_16_bits_first_cluster;
+}
 
-  if (*in == 0x20)
-    {
-      **out = 0x00;
-    }
+static void
+fat16_set_first_cluster (struct fat_directory_item *item, uint32_t cluster)
+{
+  item->high_16_bits_first_cluster = 0;
+  item->low_16_bits_first_cluster = cluster;
 }
 
-void
-fat16_get_full_relative_filename (struct fat_directory_item *item, char *out,
-                                  int max_len)
+static int
+fat16_cluster_to_sector (struct fat_private *private, int cluster)
 {
-  memset (out, 0x00, max_len);
-  char *out_tmp = out;
-  fat16_to_proper_string (&out_tmp, (const char *)item->filename);
-  if (item->ext[0] != 0x00 && item->ext[0] != 0x20)
-    {
-      *out_tmp++ = '.';
-      fat16_to_proper_string (&out_tmp, (const char *)item->ext);
-    }
+  return private->root_directory.ending_sector_pos
+         + ((cluster - 2)
+            * private->header.primary_header.sectors_per_cluster);
 }
 
-struct fat_directory_item *
-fat16_clone_directory_item (struct fat_directory_item *item, int size)
+static int
+fat16_get_fat_entry (struct disk *disk, int cluster)
 {
-  struct fat_directory_item *item_copy = 0;
-  if (size < sizeof (struct fat_directory_item))
+  struct fat_private *private = disk->fs_private;
+  if (cluster < 0 || (uint32_t)cluster >= private->fat_entries)
     {
-      return 0;
+      return -EIO;
     }
 
-  item_copy = kzalloc (size);
-  if (!item_copy)
+  return private->fat[cluster];
+}
+
+static int
+fat16_next_cluster (struct disk *disk, uint32_t cluster)
+{
+  int entry = fat16_get_fat_entry (disk, cluster);
+
+  // The chain ends, or the next cluster is free, bad or reserved
+  if (entry < LAMEOS_FAT_FIRST_CLUSTER
+      || entry >= LAMEOS_FAT16_RESERVED_CLUSTERS)
     {
-      return 0;
+      return -EIO;
     }
 
-  memcpy (item_copy, item, size);
-
-  return item_copy;
+  return entry;
 }
 
-static uint32_t
-fat16_get_first_cluster (struct fat_directory_item *item)
+static int
+fat16_build_extent_map (struct disk *disk, uint32_t first_cluster,
+                        struct fat_extent_map *map)
 {
-  return (item->high_16_bits_first_cluster) | item->low_16_bits_first_cluster;
+  struct fat_private *private = disk->fs_private;
+  return fat_build_extent_map (disk, first_cluster, private->total_clusters,
+                               fat16_next_cluster, map);
 }
 
 static int
-fat16_cluster_to_sector (struct fat_private *private, int cluster)
+fat16_cluster_free (struct fat_private *private, uint32_t cluster)
 {
-  return private->root_directory.ending_sector_pos
-         + ((cluster - 2)
-            * private->header.primary_header.sectors_per_cluster);
+  return (private->free_clusters[cluster / 32] >> (cluster % 32)) & 1;
 }
 
-static uint32_t
-fat16_get_first_fat_sector (struct fat_private *private)
+/**
+ * @brief Changes a FAT entry in memory and marks its sector for
+ * fat16_flush_fat. Keeps the free cluster bitmap in step.
+ */
+static int
+fat16_set_fat_entry (struct disk *disk, uint32_t cluster, uint32_t value)
 {
-  return private->header.primary_header.reserved_sectors;
+  struct fat_private *private = disk->fs_private;
+  int was_free = fat16_cluster_free (private, cluster);
+  private->fat[cluster] = value;
+  private->fat_dirty[(cluster * LAMEOS_FAT16_FAT_ENTRY_SIZE)
+                     / disk->sector_size]
+      = 1;
+
+  if (value == LAMEOS_FAT_UNUSED && !was_free)
+    {
+      private->free_clusters[cluster / 32] |= 1 << (cluster % 32);
+      private->free_total++;
+    }
+  else if (value != LAMEOS_FAT_UNUSED && was_free)
+    {
+      private->free_clusters[cluster / 32] &= ~(1 << (cluster % 32));
+      private->free_total--;
+    }
+
+  return 0;
 }
 
+/**
+ * @brief Writes the FAT sectors changed since the last flush to every copy
+ * of the FAT, one write per run of adjacent changed sectors.
+ */
 static int
-fat16_get_fat_entry (struct disk *disk, int cluster)
+fat16_flush_fat (struct disk *disk)
 {
-  int res = -1;
   struct fat_private *private = disk->fs_private;
-  struct disk_stream *stream = private->fat_read_stream;
-  if (!stream)
+  struct fat_header *primary_header = &private->header.primary_header;
+  int sectors = primary_header->sectors_per_fat;
+  int sector = 0;
+  while (sector < sectors)
     {
-      goto out;
-    }
+      if (!private->fat_dirty[sector])
+        {
+          sector++;
+          continue;
+        }
+
+      int run = 1;
+      while (sector + run < sectors && private->fat_dirty[sector + run]
+             && run < LAMEOS_DISK_MAX_TRANSFER_SECTORS)
+        {
+          run++;
+        }
 
-  uint32_t fat_table_position
-      = fat16_get_first_fat_sector (private) * disk->sector_size;
+      char *data = (char *)private->fat + (sector * disk->sector_size);
+      for (int copy = 0; copy < primary_header->fat_copies; copy++)
+        {
+          int lba = primary_header->reserved_sectors
+                    + (copy * sectors) + sector;
+          if (disk_write_block (disk, lba, run, data) < 0)
+            {
+              return -EIO;
+            }
+        }
 
-  res = diskstreamer_seek (
-      stream, fat_table_position * (cluster * LAMEOS_FAT16_FAT_ENTRY_SIZE));
+      memset (&private->fat_dirty[sector], 0, run);
+      sector += run;
+    }
 
-  if (res < 0)
+  return 0;
+}
+
+/**
+ * @brief Finds free clusters for a file, preferring to continue it at hint,
+ * then the first run long enough, then the longest run there is. Words of
+ * the bitmap with no free cluster are skipped whole.
+ * @return uint32_t Clusters in the run found, at most wanted.
+ */
+static uint32_t
+fat16_find_free_run (struct fat_private *private, uint32_t hint,
+                     uint32_t wanted, uint32_t *start)
+{
+  uint32_t length = 0;
+  if (hint >= LAMEOS_FAT_FIRST_CLUSTER && hint < private->total_clusters)
     {
-      goto out;
+      while (length < wanted && hint + length < private->total_clusters
+             && fat16_cluster_free (private, hint + length))
+        {
+          length++;
+        }
+
+      if (length)
+        {
+          *start = hint;
+          return length;
+        }
     }
 
-  uint16_t result = 0;
-  res = diskstreamer_read (stream, &result, sizeof (result));
-  if (res < 0)
+  uint32_t best = 0;
+  uint32_t cluster = LAMEOS_FAT_FIRST_CLUSTER;
+  while (cluster < private->total_clusters && best < wanted)
     {
-      goto out;
+      if (private->free_clusters[cluster / 32] == 0)
+        {
+          cluster = ((cluster / 32) + 1) * 32;
+          continue;
+        }
+
+      if (!fat16_cluster_free (private, cluster))
+        {
+          cluster++;
+          continue;
+        }
+
+      uint32_t run = 0;
+      while (run < wanted && cluster + run < private->total_clusters
+             && fat16_cluster_free (private, cluster + run))
+        {
+          run++;
+        }
+
+      if (run > best)
+        {
+          best = run;
+          *start = cluster;
+        }
+
+      cluster += run;
     }
 
-  res = result;
+  return best;
+}
 
-out:
-  return res;
+static void
+fat16_truncate_clusters (struct disk *disk, struct fat_extent_map *map,
+                         uint32_t keep)
+{
+  // Changing an entry of the resident FAT can't fail
+  fat_truncate_clusters (disk, map, keep, fat16_set_fat_entry,
+                         LAMEOS_FAT16_END_OF_CHAIN);
 }
 
+/**
+ * @brief Adds clusters to the end of a chain, in as few runs as the free
+ * space allows, and records them in the chain's extent map. The map keeps
+ * up with the FAT at every step, so a failure can give back every cluster
+ * it took.
+ * @param first Set to the first cluster allocated if the chain was empty.
+ * @return int 0, or a negative status with nothing allocated.
+ */
 static int
-fat16_get_cluster_for_offset (struct disk *disk, int starting_cluster,
-                              int offset)
+fat16_allocate_clusters (struct disk *disk, struct fat_extent_map *map,
+                         uint32_t wanted, uint32_t *first)
 {
   int res = 0;
   struct fat_private *private = disk->fs_private;
-  int size_of_cluster_bytes
-      = private->header.primary_header.sectors_per_cluster * disk->sector_size;
-  int cluster_to_use = starting_cluster;
-  int clusters_ahead = offset / size_of_cluster_bytes;
-  for (int i = 0; i < clusters_ahead; i++)
+  if (wanted > private->free_total)
+    {
+      return -ENOSPC;
+    }
+
+  uint32_t old_clusters = fat_extent_map_clusters (map);
+  uint32_t last = 0;
+  if (map->total)
+    {
+      struct fat_extent *extent = &map->extents[map->total - 1];
+      last = extent->disk_cluster + extent->length - 1;
+    }
+
+  while (wanted > 0)
     {
-      int entry = fat16_get_fat_entry (disk, cluster_to_use);
-      if (entry == 0xFF8 || entry == 0xFFF)
+      uint32_t start = 0;
+      uint32_t length
+          = fat16_find_free_run (private, last ? last + 1 : 0, wanted, &start);
+      if (length == 0)
         {
-          // At the last entry in the file
-          res = -EIO;
+          res = -ENOSPC;
           goto out;
         }
 
-      // Check if sector marked 'bad'
-      if (entry == LAMEOS_FAT16_BAD_SECTOR)
+      // Reserved before the FAT changes, the append after them can't fail
+      res = fat_extent_map_reserve (map);
+      if (res < 0)
         {
-          res = -EIO;
           goto out;
         }
 
-      // Check for reserved sectors
-      if (entry == 0xFF0 || entry == 0xFF6)
+      for (uint32_t i = 0; i < length; i++)
         {
-          res = -EIO;
-          goto out;
+          fat16_set_fat_entry (disk, start + i,
+                               i + 1 < length ? start + i + 1
+                                              : LAMEOS_FAT16_END_OF_CHAIN);
         }
 
-      if (entry == 0x00)
+      if (last)
         {
-          res = -EIO;
-          goto out;
+          fat16_set_fat_entry (disk, last, start);
+        }
+      else
+        {
+          *first = start;
         }
 
-      cluster_to_use = entry;
+      fat_extent_map_append (map, start, length);
+      last = start + length - 1;
+      wanted -= length;
     }
 
-  res = cluster_to_use;
-
 out:
+  if (res < 0)
+    {
+      fat16_truncate_clusters (disk, map, old_clusters);
+    }
   return res;
 }
 
+/**
+ * @brief Reads across clusters with one read per run of adjacent clusters,
+ * capped at LAMEOS_DISK_MAX_TRANSFER_SECTORS. Each read is started without
+ * waiting, so the device works on it while the next one is set up. At most
+ * LAMEOS_FAT16_READS_IN_FLIGHT are outstanding.
+ * @param map The cluster chain being read.
+ */
 static int
 fat16_read_internal_from_stream (struct disk *disk, struct disk_stream *stream,
-                                 int cluster, int offset, int total, void *out)
+                                 struct fat_extent_map *map, int offset,
+                                 int total, void *out)
 {
   int res = 0;
   struct fat_private *private = disk->fs_private;
-  int size_of_cluster_bytes
+  struct disk_stream_request *inflight[LAMEOS_FAT16_READS_IN_FLIGHT];
+  int head = 0;
+  int count = 0;
+  uint32_t size_of_cluster_bytes
       = private->header.primary_header.sectors_per_cluster * disk->sector_size;
-  int cluster_to_use = fat16_get_cluster_for_offset (disk, cluster, offset);
-  if (cluster_to_use < 0)
-    {
-      res = cluster_to_use;
-      goto out;
-    }
+  uint32_t max_transfer_bytes
+      = LAMEOS_DISK_MAX_TRANSFER_SECTORS * disk->sector_size;
 
-  int offset_from_cluster = offset % size_of_cluster_bytes;
+  char *ptr = out;
+  uint32_t file_offset = offset;
+  while (total > 0)
+    {
+      uint32_t file_cluster = file_offset / size_of_cluster_bytes;
+      struct fat_extent *extent = fat_extent_map_lookup (map, file_cluster);
+      if (!extent)
+        {
+          res = -EIO;
+          goto out;
+        }
 
-  int starting_sector = fat16_cluster_to_sector (private, cluster_to_use);
+      uint32_t cluster_to_use
+          = extent->disk_cluster + (file_cluster - extent->file_cluster);
+      uint32_t offset_from_cluster = file_offset % size_of_cluster_bytes;
 
-  int starting_pos
-      = (starting_sector * disk->sector_size) + offset_from_cluster;
+      // Everything from here to the end of the run is one read
+      uint32_t available
+          = ((extent->file_cluster + extent->length - file_cluster)
+             * size_of_cluster_bytes)
+            - offset_from_cluster;
+      if (available > max_transfer_bytes)
+        {
+          available = max_transfer_bytes;
+        }
 
-  int total_to_read
-      = total > size_of_cluster_bytes ? size_of_cluster_bytes : total;
+      int total_to_read = (uint32_t)total > available ? available : total;
+      int starting_sector = fat16_cluster_to_sector (private, cluster_to_use);
+      int starting_pos
+          = (starting_sector * disk->sector_size) + offset_from_cluster;
 
-  res = diskstreamer_seek (stream, starting_pos);
-  if (res != LAMEOS_OK)
-    {
-      goto out;
-    }
+      if (count == LAMEOS_FAT16_READS_IN_FLIGHT)
+        {
+          res = diskstreamer_wait (inflight[head]);
+          head = (head + 1) % LAMEOS_FAT16_READS_IN_FLIGHT;
+          count--;
+          if (res != LAMEOS_OK)
+            {
+              goto out;
+            }
+        }
 
-  res = diskstreamer_read (stream, out, total_to_read);
-  if (res != LAMEOS_OK)
-    {
-      goto out;
+      res = diskstreamer_seek (stream, starting_pos);
+      if (res != LAMEOS_OK)
+        {
+          goto out;
+        }
+
+      struct disk_stream_request *request
+          = diskstreamer_read_async (stream, ptr, total_to_read, 0, 0);
+      if (!request)
+        {
+          res = -EIO;
+          goto out;
+        }
+
+      inflight[(head + count) % LAMEOS_FAT16_READS_IN_FLIGHT] = request;
+      count++;
+
+      ptr += total_to_read;
+      total -= total_to_read;
+      file_offset += total_to_read;
     }
 
-  total -= total_to_read;
-  if (total > 0)
+out:
+  // Every read started has to be waited for, its handle is freed then
+  while (count > 0)
     {
-      // Still have more to read
-      res = fat16_read_internal_from_stream (disk, stream, cluster,
-                                             offset + total_to_read, total,
-                                             out + total_to_read);
+      int wait_res = diskstreamer_wait (inflight[head]);
+      if (res == LAMEOS_OK)
+        {
+          res = wait_res;
+        }
+
+      head = (head + 1) % LAMEOS_FAT16_READS_IN_FLIGHT;
+      count--;
     }
 
-out:
   return res;
 }
 
@@ -530,34 +858,23 @@ fat16_free_directory (struct fat_directory *directory)
       kfree (directory->item);
     }
 
+  fat_free_extent_map (&directory->extents);
   kfree (directory);
 }
 
-void
-fat16_fat_item_free (struct fat_item *item)
-{
-  if (item->type == FAT_ITEM_TYPE_DIRECTORY)
-    {
-      fat16_free_directory (item->directory);
-    }
-  else if (item->type == FAT_ITEM_TYPE_FILE)
-    {
-      kfree (item->item);
-    }
-
-  kfree (item);
-}
-
 static int
-fat16_read_internal (struct disk *disk, int starting_cluster, int offset,
-                     int total, void *out)
+fat16_read_internal (struct disk *disk, struct fat_extent_map *map,
+                     int offset, int total, void *out)
 {
   struct fat_private *fs_private = disk->fs_private;
   struct disk_stream *stream = fs_private->cluster_read_stream;
-  return fat16_read_internal_from_stream (disk, stream, starting_cluster,
-                                          offset, total, out);
+  return fat16_read_internal_from_stream (disk, stream, map, offset, total,
+                                          out);
 }
 
+/**
+ * @brief Loads every item of a subdirectory, its whole cluster chain.
+ */
 struct fat_directory *
 fat16_load_fat_directory (struct disk *disk, struct fat_directory_item *item)
 {
@@ -578,10 +895,27 @@ fat16_load_fat_directory (struct disk *disk, struct fat_directory_item *item)
     }
 
   int cluster = fat16_get_first_cluster (item);
-  int cluster_sector = fat16_cluster_to_sector (fat_private, cluster);
-  int total_items = fat16_get_total_items_for_directory (disk, cluster_sector);
-  directory->total = total_items;
-  int directory_size = directory->total * sizeof (struct fat_directory_item);
+  struct fat_extent_map *map = &directory->extents;
+  res = fat16_build_extent_map (disk, cluster, map);
+  if (res < 0)
+    {
+      goto out;
+    }
+
+  if (map->total == 0)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  struct fat_extent *last = &map->extents[map->total - 1];
+  int size_of_cluster_bytes
+      = fat_private->header.primary_header.sectors_per_cluster
+        * disk->sector_size;
+  int directory_size
+      = (last->file_cluster + last->length) * size_of_cluster_bytes;
+  directory->total = directory_size / sizeof (struct fat_directory_item);
+  directory->sector_pos = fat16_cluster_to_sector (fat_private, cluster);
   directory->item = kzalloc (directory_size);
   if (!directory->item)
     {
@@ -589,7 +923,7 @@ fat16_load_fat_directory (struct disk *disk, struct fat_directory_item *item)
       goto out;
     }
 
-  res = fat16_read_internal (disk, cluster, 0x00, directory_size,
+  res = fat16_read_internal (disk, map, 0x00, directory_size,
                              directory->item);
   if (res != LAMEOS_OK)
     {
@@ -600,221 +934,1159 @@ out:
   if (res != LAMEOS_OK)
     {
       fat16_free_directory (directory);
+      directory = 0;
     }
   return directory;
 }
 
-struct fat_item *
-fat16_new_fat_item_for_directory_item (struct disk *disk,
-                                       struct fat_directory_item *item)
+/**
+ * @brief Finds an item by its packed name, stopping at the first match or
+ * at the first slot that was never used. Deleted items and the volume label
+ * are skipped.
+ */
+static struct fat_directory_item *
+fat16_find_item_in_directory (struct fat_directory *directory,
+                              struct fat_packed_name *name)
 {
-  struct fat_item *f_item = kzalloc (sizeof (struct fat_item));
-  if (!f_item)
+  for (int i = 0; i < directory->total; i++)
     {
-      return 0;
+      struct fat_directory_item *item = &directory->item[i];
+      if (item->filename[0] == 0x00)
+        {
+          break;
+        }
+
+      if (item->filename[0] == LAMEOS_FAT_DELETED
+          || (item->attribute & FAT_FILE_VOLUME_LABEL))
+        {
+          continue;
+        }
+
+      if (fat_name_matches (item, name))
+        {
+          return item;
+        }
     }
 
-  if (item->attribute & FAT_FILE_SUBDIRECTORY)
+  return 0;
+}
+
+static uint32_t
+fat16_dentry_hash (struct fat_dentry *parent, struct fat_packed_name *name)
+{
+  // FNV-1a over the parent and the name's words
+  uint32_t hash = 2166136261u ^ (uint32_t)parent;
+  for (int i = 0; i < 3; i++)
     {
-      f_item->directory = fat16_load_fat_directory (disk, item);
-      f_item->type = FAT_ITEM_TYPE_DIRECTORY;
+      hash = (hash ^ name->words[i]) * 16777619u;
     }
 
-  f_item->type = FAT_ITEM_TYPE_FILE;
-  f_item->item
-      = fat16_clone_directory_item (item, sizeof (struct fat_directory_item));
-  return f_item;
+  return hash;
 }
 
-struct fat_item *
-fat16_find_item_in_directory (struct disk *disk,
-                              struct fat_directory *directory,
-                              const char *name)
+static void
+fat16_dentry_lru_remove (struct fat_dentry_cache *cache,
+                         struct fat_dentry *dentry)
 {
-  struct fat_item *f_item = 0;
-  char tmp_filename[LAMEOS_MAX_PATH];
-  for (int i = 0; i < directory->total; i++)
+  if (dentry->prev)
     {
-      fat16_get_full_relative_filename (&directory->item[i], tmp_filename,
-                                        sizeof (tmp_filename));
-      if (istrncmp (tmp_filename, name, sizeof (tmp_filename)) == 0)
-        {
-          // Found, create new fat_item
-          f_item = fat16_new_fat_item_for_directory_item (disk,
-                                                          &directory->item[i]);
-        }
+      dentry->prev->next = dentry->next;
+    }
+  else
+    {
+      cache->head = dentry->next;
+    }
+
+  if (dentry->next)
+    {
+      dentry->next->prev = dentry->prev;
+    }
+  else
+    {
+      cache->tail = dentry->prev;
     }
 
-  return f_item;
+  dentry->prev = 0;
+  dentry->next = 0;
 }
 
-struct fat_item *
-fat16_get_directory_entry (struct disk *disk, struct path_part *path)
+static void
+fat16_dentry_lru_push (struct fat_dentry_cache *cache,
+                       struct fat_dentry *dentry)
 {
-  struct fat_private *fat_private = disk->fs_private;
-  struct fat_item *current_item = 0;
-  struct fat_item *root_item = fat16_find_item_in_directory (
-      disk, &fat_private->root_directory, path->part);
+  dentry->prev = 0;
+  dentry->next = cache->head;
+  if (cache->head)
+    {
+      cache->head->prev = dentry;
+    }
 
-  if (!root_item)
+  cache->head = dentry;
+  if (!cache->tail)
     {
-      goto out;
+      cache->tail = dentry;
     }
+}
 
-  struct path_part *next_part = path->next;
-  current_item = root_item;
-  while (next_part != 0)
+static struct fat_dentry *
+fat16_dentry_lookup (struct fat_dentry_cache *cache, struct fat_dentry *parent,
+                     struct fat_packed_name *name)
+{
+  uint32_t hash = fat16_dentry_hash (parent, name);
+  struct fat_dentry *dentry
+      = cache->buckets[hash % LAMEOS_FAT16_DENTRY_HASH_BUCKETS];
+  for (; dentry; dentry = dentry->hash_next)
     {
-      if (current_item->type != FAT_ITEM_TYPE_DIRECTORY)
+      if (dentry->hash == hash && dentry->parent == parent
+          && dentry->name.words[0] == name->words[0]
+          && dentry->name.words[1] == name->words[1]
+          && dentry->name.words[2] == name->words[2])
         {
-          current_item = 0;
-          break;
+          fat16_dentry_lru_remove (cache, dentry);
+          fat16_dentry_lru_push (cache, dentry);
+          return dentry;
         }
-
-      struct fat_item *tmp_item = fat16_find_item_in_directory (
-          disk, current_item->directory, next_part->part);
-
-      fat16_fat_item_free (current_item);
-      current_item = tmp_item;
-      next_part = next_part->next;
     }
-out:
-  return current_item;
+
+  return 0;
 }
 
-void *
-fat16_open (struct disk *disk, struct path_part *path, FILE_MODE mode)
+static void
+fat16_dentry_evict (struct fat_dentry_cache *cache, struct fat_dentry *dentry)
 {
-  if (mode != FILE_MODE_READ)
+  struct fat_dentry **link
+      = &cache->buckets[dentry->hash % LAMEOS_FAT16_DENTRY_HASH_BUCKETS];
+  while (*link && *link != dentry)
     {
-      return ERROR (-ERDONLY);
+      link = &(*link)->hash_next;
     }
 
-  struct fat_file_descriptor *descriptor = 0;
-  descriptor = kzalloc (sizeof (struct fat_file_descriptor));
-  if (!descriptor)
+  if (*link)
     {
-      return ERROR (-ENOMEM);
+      *link = dentry->hash_next;
     }
 
-  descriptor->item = fat16_get_directory_entry (disk, path);
-  if (!descriptor->item)
+  fat16_dentry_lru_remove (cache, dentry);
+  if (dentry->parent)
     {
-      return ERROR (-EIO);
+      dentry->parent->children--;
     }
 
-  descriptor->pos = 0;
-  return descriptor;
+  fat16_free_directory (dentry->directory);
+  fat_free_extent_map (&dentry->extents);
+  memset (dentry, 0, sizeof (struct fat_dentry));
 }
 
-static void
-fat16_free_file_descriptor (struct fat_file_descriptor *desc)
+/**
+ * @brief Takes an unused entry, or evicts the least recently used one that
+ * isn't open and no cached entry was looked up in.
+ * @param keep An entry that must stay, the parent of the one being added.
+ */
+static struct fat_dentry *
+fat16_dentry_alloc (struct fat_dentry_cache *cache, struct fat_dentry *keep)
 {
-  fat16_fat_item_free (desc->item);
-  kfree (desc);
+  for (int i = 0; i < LAMEOS_FAT16_DENTRY_CACHE_ENTRIES; i++)
+    {
+      if (!cache->entries[i].used)
+        {
+          return &cache->entries[i];
+        }
+    }
+
+  for (struct fat_dentry *dentry = cache->tail; dentry; dentry = dentry->prev)
+    {
+      if (dentry->children == 0 && dentry->refs == 0 && dentry != keep)
+        {
+          fat16_dentry_evict (cache, dentry);
+          return dentry;
+        }
+    }
+
+  return 0;
 }
 
-int
-fat16_close (void *private)
+/**
+ * @brief Caches the result of looking a name up in a directory.
+ * @param item The item found, or 0 to cache that there is none.
+ */
+static struct fat_dentry *
+fat16_dentry_insert (struct fat_dentry_cache *cache, struct fat_dentry *parent,
+                     struct fat_packed_name *name,
+                     struct fat_directory_item *item, int index)
 {
-  fat16_free_file_descriptor ((struct fat_file_descriptor *)private);
-  return 0;
+  struct fat_dentry *dentry = fat16_dentry_alloc (cache, parent);
+  if (!dentry)
+    {
+      return 0;
+    }
+
+  dentry->used = 1;
+  dentry->parent = parent;
+  dentry->hash = fat16_dentry_hash (parent, name);
+  dentry->name = *name;
+  if (item)
+    {
+      memcpy (&dentry->item, item, sizeof (struct fat_directory_item));
+      dentry->index = index;
+    }
+  else
+    {
+      dentry->negative = 1;
+    }
+
+  if (parent)
+    {
+      parent->children++;
+    }
+
+  int bucket = dentry->hash % LAMEOS_FAT16_DENTRY_HASH_BUCKETS;
+  dentry->hash_next = cache->buckets[bucket];
+  cache->buckets[bucket] = dentry;
+  fat16_dentry_lru_push (cache, dentry);
+  return dentry;
 }
 
-int
-fat16_stat (struct disk *disk, void *private, struct file_stat *stat)
+/**
+ * @brief The items of a cached directory, loaded on first use and kept
+ * while the entry stays cached. 0 for the root is the root directory.
+ */
+static struct fat_directory *
+fat16_dentry_directory (struct disk *disk, struct fat_dentry *dentry)
 {
-  int res = 0;
+  struct fat_private *fat_private = disk->fs_private;
+  if (!dentry)
+    {
+      return &fat_private->root_directory;
+    }
 
-  struct fat_file_descriptor *descriptor
-      = (struct fat_file_descriptor *)private;
+  if (!dentry->directory)
+    {
+      dentry->directory = fat16_load_fat_directory (disk, &dentry->item);
+    }
+
+  return dentry->directory;
+}
 
-  struct fat_item *desc_item = descriptor->item;
-  if (desc_item->type != FAT_ITEM_TYPE_FILE)
+/**
+ * @brief Resolves one path component within a directory, from the dentry
+ * cache if it's there.
+ * @return struct fat_dentry* The entry, negative if there is no such item,
+ * or 0 if the lookup failed.
+ */
+static struct fat_dentry *
+fat16_lookup (struct disk *disk, struct fat_dentry *parent, const char *name)
+{
+  struct fat_private *fat_private = disk->fs_private;
+  struct fat_dentry_cache *cache = &fat_private->dentries;
+  struct fat_packed_name key;
+  if (fat_pack_name (name, &key) < 0)
     {
-      res = -EINVARG;
-      goto out;
+      return 0;
     }
 
-  struct fat_directory_item *ritem = desc_item->item;
-  stat->filesize = ritem->filesize;
-  stat->flags = 0x00;
+  struct fat_dentry *dentry = fat16_dentry_lookup (cache, parent, &key);
+  if (dentry)
+    {
+      return dentry;
+    }
 
-  if (ritem->attribute & FAT_FILE_READ_ONLY)
+  struct fat_directory *directory = fat16_dentry_directory (disk, parent);
+  if (!directory)
     {
-      stat->flags |= FILE_STAT_READ_ONLY;
+      return 0;
     }
 
-out:
-  return res;
+  struct fat_directory_item *item
+      = fat16_find_item_in_directory (directory, &key);
+  return fat16_dentry_insert (cache, parent, &key, item,
+                              item ? item - directory->item : 0);
 }
 
-int
-fat16_read (struct disk *disk, void *descriptor, uint32_t size, uint32_t nmemb,
-            char *out_ptr)
+/**
+ * @brief Resolves every component of a path.
+ * @return struct fat_dentry* The last component's entry, negative if only
+ * that one is missing, or 0 if the path can't be resolved.
+ */
+static struct fat_dentry *
+fat16_resolve_path (struct disk *disk, struct path_part *path)
 {
-  int res = 0;
+  struct fat_dentry *dentry = 0;
+  for (struct path_part *part = path; part; part = part->next)
+    {
+      if (dentry
+          && (dentry->negative
+              || !(dentry->item.attribute & FAT_FILE_SUBDIRECTORY)))
+        {
+          return 0;
+        }
 
-  struct fat_file_descriptor *fat_desc = descriptor;
-  struct fat_directory_item *item = fat_desc->item->item;
-  int offset = fat_desc->pos;
-  for (uint32_t i = 0; i < nmemb; i++)
+      dentry = fat16_lookup (disk, dentry, part->part);
+      if (!dentry)
+        {
+          return 0;
+        }
+    }
+
+  return dentry;
+}
+
+/**
+ * @brief The cluster chain of a cached item, built on first use and kept
+ * up to date as the file grows and shrinks.
+ */
+static struct fat_extent_map *
+fat16_dentry_extents (struct disk *disk, struct fat_dentry *dentry)
+{
+  if (!dentry->extents_valid)
     {
-      res = fat16_read_internal (disk, fat16_get_first_cluster (item), offset,
-                                 size, out_ptr);
+      if (fat16_build_extent_map (disk,
+                                  fat16_get_first_cluster (&dentry->item),
+                                  &dentry->extents)
+          < 0)
+        {
+          return 0;
+        }
 
-      if (ISERR (res))
+      dentry->extents_valid = 1;
+    }
+
+  return &dentry->extents;
+}
+
+static uint32_t
+fat16_cluster_bytes (struct disk *disk)
+{
+  struct fat_private *private = disk->fs_private;
+  return private->header.primary_header.sectors_per_cluster
+         * disk->sector_size;
+}
+
+/**
+ * @brief Writes across clusters with one write per run of adjacent whole
+ * sectors. Sectors only partly written are read, changed and written back.
+ */
+static int
+fat16_write_internal (struct disk *disk, struct fat_extent_map *map,
+                      uint32_t offset, uint32_t total, const char *in)
+{
+  int res = 0;
+  struct fat_private *private = disk->fs_private;
+  uint32_t size_of_cluster_bytes = fat16_cluster_bytes (disk);
+  uint32_t max_transfer_bytes
+      = LAMEOS_DISK_MAX_TRANSFER_SECTORS * disk->sector_size;
+  char *bounce = 0;
+  while (total > 0)
+    {
+      uint32_t file_cluster = offset / size_of_cluster_bytes;
+      struct fat_extent *extent = fat_extent_map_lookup (map, file_cluster);
+      if (!extent)
         {
+          res = -EIO;
           goto out;
         }
 
-      out_ptr += size;
-      offset += size;
+      uint32_t cluster_to_use
+          = extent->disk_cluster + (file_cluster - extent->file_cluster);
+      uint32_t offset_from_cluster = offset % size_of_cluster_bytes;
+      uint32_t available
+          = ((extent->file_cluster + extent->length - file_cluster)
+             * size_of_cluster_bytes)
+            - offset_from_cluster;
+      if (available > max_transfer_bytes)
+        {
+          available = max_transfer_bytes;
+        }
+
+      uint32_t chunk = total > available ? available : total;
+      int lba = fat16_cluster_to_sector (private, cluster_to_use)
+                + (offset_from_cluster / disk->sector_size);
+      uint32_t offset_from_sector = offset_from_cluster % disk->sector_size;
+      if (offset_from_sector || chunk < disk->sector_size)
+        {
+          if (!bounce)
+            {
+              bounce = kzalloc (disk->sector_size);
+              if (!bounce)
+                {
+                  res = -ENOMEM;
+                  goto out;
+                }
+            }
+
+          if (chunk > disk->sector_size - offset_from_sector)
+            {
+              chunk = disk->sector_size - offset_from_sector;
+            }
+
+          if (disk_read_block (disk, lba, 1, bounce) < 0)
+            {
+              res = -EIO;
+              goto out;
+            }
+
+          memcpy (bounce + offset_from_sector, (void *)in, chunk);
+          if (disk_write_block (disk, lba, 1, bounce) < 0)
+            {
+              res = -EIO;
+              goto out;
+            }
+        }
+      else
+        {
+          chunk -= chunk % disk->sector_size;
+          if (disk_write_block (disk, lba, chunk / disk->sector_size, in) < 0)
+            {
+              res = -EIO;
+              goto out;
+            }
+        }
+
+      in += chunk;
+      offset += chunk;
+      total -= chunk;
     }
 
-  res = nmemb;
 out:
+  if (bounce)
+    {
+      kfree (bounce);
+    }
+
   return res;
 }
 
-int
-fat16_seek (void *private, uint32_t offset, FILE_SEEK_MODE seek_mode)
+/**
+ * @brief Writes the sector holding one item of a directory from the items
+ * in memory.
+ */
+static int
+fat16_write_directory_item (struct disk *disk, struct fat_directory *directory,
+                            int index)
 {
-  int res = 0;
-  struct fat_file_descriptor *desc = private;
+  struct fat_private *private = disk->fs_private;
+  uint32_t offset = index * sizeof (struct fat_directory_item);
+  uint32_t sector_offset = offset - (offset % disk->sector_size);
+  int lba = directory->sector_pos + (offset / disk->sector_size);
+  if (directory->extents.total)
+    {
+      uint32_t size_of_cluster_bytes = fat16_cluster_bytes (disk);
+      uint32_t file_cluster = offset / size_of_cluster_bytes;
+      struct fat_extent *extent
+          = fat_extent_map_lookup (&directory->extents, file_cluster);
+      if (!extent)
+        {
+          return -EIO;
+        }
+
+      lba = fat16_cluster_to_sector (private,
+                                     extent->disk_cluster + file_cluster
+                                         - extent->file_cluster)
+            + ((offset % size_of_cluster_bytes) / disk->sector_size);
+    }
 
-  struct fat_item *desc_item = desc->item;
-  if (desc_item->type != FAT_ITEM_TYPE_FILE)
+  if (disk_write_block (disk, lba, 1, (char *)directory->item + sector_offset)
+      < 0)
     {
-      res = -EINVARG;
-      goto out;
+      return -EIO;
     }
 
-  struct fat_directory_item *ritem = desc_item->item;
-  if (offset >= ritem->filesize)
+  return 0;
+}
+
+/**
+ * @brief Writes a cached item back into its directory.
+ */
+static int
+fat16_update_item (struct disk *disk, struct fat_dentry *dentry)
+{
+  struct fat_directory *directory
+      = fat16_dentry_directory (disk, dentry->parent);
+  if (!directory)
     {
-      res = -EIO;
-      goto out;
+      return -EIO;
     }
 
-  switch (seek_mode)
+  memcpy (&directory->item[dentry->index], &dentry->item,
+          sizeof (struct fat_directory_item));
+  return fat16_write_directory_item (disk, directory, dentry->index);
+}
+
+/**
+ * @brief Adds a zeroed cluster to the end of a subdirectory. The directory
+ * only grows once the cluster is on disk, a failure leaves it as it was.
+ */
+static int
+fat16_grow_directory (struct disk *disk, struct fat_dentry *dentry,
+                      struct fat_directory *directory)
+{
+  int res = 0;
+  uint32_t size_of_cluster_bytes = fat16_cluster_bytes (disk);
+  uint32_t old_size = directory->total * sizeof (struct fat_directory_item);
+  uint32_t old_clusters = fat_extent_map_clusters (&directory->extents);
+  uint32_t first = 0;
+  struct fat_directory_item *items = kzalloc (old_size + size_of_cluster_bytes);
+  if (!items)
     {
-    case SEEK_SET:
-      break;
+      res = -ENOMEM;
+      goto out;
+    }
 
-    case SEEK_END:
-      res = -EUNIMP;
-      break;
+  res = fat16_allocate_clusters (disk, &directory->extents, 1, &first);
+  if (res < 0)
+    {
+      goto out;
+    }
 
-    case SEEK_CUR:
-      desc->pos += offset;
-      break;
+  // The chain changed under the directory's own map
+  fat_free_extent_map (&dentry->extents);
+  dentry->extents_valid = 0;
 
-    default:
-      res = -EINVARG;
-      break;
+  res = fat16_write_internal (disk, &directory->extents, old_size,
+                              size_of_cluster_bytes, (char *)items + old_size);
+  if (res < 0)
+    {
+      fat16_truncate_clusters (disk, &directory->extents, old_clusters);
+      goto out;
     }
 
+  memcpy (items, directory->item, old_size);
+  kfree (directory->item);
+  directory->item = items;
+  directory->total += size_of_cluster_bytes / sizeof (struct fat_directory_item);
+  items = 0;
+
+  res = fat16_flush_fat (disk);
+
 out:
+  if (items)
+    {
+      kfree (items);
+    }
   return res;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Creates an empty file for a negative entry, in the first deleted
+ * or never used slot of its directory. A subdirectory with no slot left
+ * grows by a cluster, the root directory can't.
+ */
+static int
+fat16_create_item (struct disk *disk, struct fat_dentry *dentry)
+{
+  int res = 0;
+  struct fat_directory *directory
+      = fat16_dentry_directory (disk, dentry->parent);
+  if (!directory)
+    {
+      return -EIO;
+    }
+
+  int index = 0;
+  for (; index < directory->total; index++)
+    {
+      uint8_t first = directory->item[index].filename[0];
+      if (first == 0x00 || first == LAMEOS_FAT_DELETED)
+        {
+          break;
+        }
+    }
+
+  if (index == directory->total)
+    {
+      if (!dentry->parent)
+        {
+          return -ENOSPC;
+        }
+
+      res = fat16_grow_directory (disk, dentry->parent, directory);
+      if (res < 0)
+        {
+          return res;
+        }
+    }
+
+  struct fat_directory_item *item = &directory->item[index];
+  memset (item, 0, sizeof (struct fat_directory_item));
+  memcpy (item->filename, dentry->name.words, LAMEOS_FAT_NAME_LENGTH);
+  item->attribute = FAT_FILE_ARCHIVE;
+  res = fat16_write_directory_item (disk, directory, index);
+  if (res < 0)
+    {
+      return res;
+    }
+
+  memcpy (&dentry->item, item, sizeof (struct fat_directory_item));
+  dentry->index = index;
+  dentry->negative = 0;
+  return 0;
+}
+
+/**
+ * @brief Makes a file's chain big enough to hold size bytes. The clusters
+ * added are allocated together, so the file stays in as few runs as the
+ * free space allows.
+ */
+static int
+fat16_extend_file (struct disk *disk, struct fat_dentry *dentry, uint32_t size)
+{
+  struct fat_extent_map *map = fat16_dentry_extents (disk, dentry);
+  if (!map)
+    {
+      return -EIO;
+    }
+
+  uint32_t size_of_cluster_bytes = fat16_cluster_bytes (disk);
+  uint32_t needed = (size / size_of_cluster_bytes)
+                    + (size % size_of_cluster_bytes ? 1 : 0);
+  uint32_t have = fat_extent_map_clusters (map);
+  if (needed <= have)
+    {
+      return 0;
+    }
+
+  uint32_t first = 0;
+  int res = fat16_allocate_clusters (disk, map, needed - have, &first);
+  if (res < 0)
+    {
+      return res;
+    }
+
+  if (have == 0)
+    {
+      fat16_set_first_cluster (&dentry->item, first);
+    }
+
+  return 0;
+}
+
+void *
+fat16_open (struct disk *disk, struct path_part *path, FILE_MODE mode)
+{
+  int res = 0;
+  struct fat_file_descriptor *descriptor = 0;
+  struct fat_dentry *dentry = fat16_resolve_path (disk, path);
+  if (!dentry)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  if (dentry->negative)
+    {
+      if (mode == FILE_MODE_READ)
+        {
+          res = -EIO;
+          goto out;
+        }
+
+      res = fat16_create_item (disk, dentry);
+      if (res < 0)
+        {
+          goto out;
+        }
+    }
+  else if (mode != FILE_MODE_READ)
+    {
+      if (dentry->item.attribute & FAT_FILE_SUBDIRECTORY)
+        {
+          res = -EINVARG;
+          goto out;
+        }
+
+      if (dentry->item.attribute & FAT_FILE_READ_ONLY)
+        {
+          res = -ERDONLY;
+          goto out;
+        }
+    }
+
+  descriptor = kzalloc (sizeof (struct fat_file_descriptor));
+  if (!descriptor)
+    {
+      res = -ENOMEM;
+      goto out;
+    }
+
+  descriptor->disk = disk;
+  descriptor->dentry = dentry;
+  descriptor->mode = mode;
+  dentry->refs++;
+
+  if (mode == FILE_MODE_WRITE && dentry->item.filesize)
+    {
+      res = fat16_truncate (disk, descriptor, 0);
+      if (res < 0)
+        {
+          goto out;
+        }
+    }
+
+  if (mode == FILE_MODE_APPEND)
+    {
+      descriptor->pos = dentry->item.filesize;
+    }
+
+out:
+  if (res < 0)
+    {
+      if (descriptor)
+        {
+          dentry->refs--;
+          kfree (descriptor);
+        }
+
+      return ERROR (res);
+    }
+
+  return descriptor;
+}
+
+int
+fat16_close (void *private)
+{
+  struct fat_file_descriptor *desc = private;
+  struct disk *disk = desc->disk;
+  disk_prefetch_finish (&desc->prefetch);
+  if (desc->dirty)
+    {
+      // Left open if the file can't be written back, so it can be retried
+      int res = fat16_update_item (disk, desc->dentry);
+      if (res == 0)
+        {
+          res = fat_sync (disk, fat16_flush_fat);
+        }
+
+      if (res < 0)
+        {
+          return res;
+        }
+    }
+
+  desc->dentry->refs--;
+  kfree (desc);
+  return 0;
+}
+
+int
+fat16_stat (struct disk *disk, void *private, struct file_stat *stat)
+{
+  struct fat_file_descriptor *descriptor
+      = (struct fat_file_descriptor *)private;
+
+  struct fat_directory_item *ritem = &descriptor->dentry->item;
+  stat->filesize = ritem->filesize;
+  stat->flags = 0x00;
+
+  if (ritem->attribute & FAT_FILE_READ_ONLY)
+    {
+      stat->flags |= FILE_STAT_READ_ONLY;
+    }
+
+  return 0;
+}
+
+/**
+ * @brief Grows the read-ahead window for a read that starts where the
+ * previous one ended, doubling it up to LAMEOS_READAHEAD_MAX_SECTORS. Any
+ * other read collapses it.
+ */
+static void
+fat16_readahead_update (struct disk *disk, struct fat_file_descriptor *desc,
+                        uint32_t offset, uint32_t total)
+{
+  uint32_t min_window = LAMEOS_READAHEAD_MIN_SECTORS * disk->sector_size;
+  uint32_t max_window = LAMEOS_READAHEAD_MAX_SECTORS * disk->sector_size;
+  if (offset != desc->ra_next)
+    {
+      desc->ra_window = 0;
+      return;
+    }
+
+  if (!desc->ra_window)
+    {
+      desc->ra_window = total > min_window ? total : min_window;
+    }
+  else
+    {
+      desc->ra_window *= 2;
+    }
+
+  if (desc->ra_window > max_window)
+    {
+      desc->ra_window = max_window;
+    }
+}
+
+/**
+ * @brief Puts read ahead data in the sector cache before a read that may
+ * want it. A read ahead still in flight is only waited for if the read
+ * overlaps it.
+ */
+static void
+fat16_readahead_collect (struct fat_file_descriptor *desc, uint32_t offset,
+                         uint32_t end)
+{
+  struct disk_prefetch *prefetch = &desc->prefetch;
+  if (prefetch->active
+      && (prefetch->request.done
+          || (offset < desc->ra_end && end > desc->ra_start)))
+    {
+      disk_prefetch_finish (prefetch);
+    }
+}
+
+/**
+ * @brief Starts reading the window after a sequential read, once less than
+ * half of what was read ahead is left. Reads one run of adjacent clusters at
+ * a time and never waits, a read ahead still in flight holds the next back.
+ * @param end Where the read just done ended.
+ */
+static void
+fat16_readahead_start (struct disk *disk, struct fat_file_descriptor *desc,
+                       struct fat_extent_map *map, uint32_t end)
+{
+  struct fat_private *private = disk->fs_private;
+  if (!desc->ra_window || desc->prefetch.active)
+    {
+      return;
+    }
+
+  uint32_t start = end;
+  if (desc->ra_end > end)
+    {
+      if (desc->ra_end - end >= desc->ra_window / 2)
+        {
+          return;
+        }
+
+      start = desc->ra_end;
+    }
+
+  uint32_t limit = end + desc->ra_window;
+  if (limit > desc->dentry->item.filesize)
+    {
+      limit = desc->dentry->item.filesize;
+    }
+
+  if (start >= limit)
+    {
+      return;
+    }
+
+  uint32_t size_of_cluster_bytes = fat16_cluster_bytes (disk);
+  uint32_t file_cluster = start / size_of_cluster_bytes;
+  struct fat_extent *extent = fat_extent_map_lookup (map, file_cluster);
+  if (!extent)
+    {
+      return;
+    }
+
+  uint32_t offset_from_cluster = start % size_of_cluster_bytes;
+  uint32_t available
+      = ((extent->file_cluster + extent->length - file_cluster)
+         * size_of_cluster_bytes)
+        - offset_from_cluster;
+  uint32_t length = limit - start > available ? available : limit - start;
+  uint32_t offset_from_sector = offset_from_cluster % disk->sector_size;
+  int lba = fat16_cluster_to_sector (
+                private,
+                extent->disk_cluster + (file_cluster - extent->file_cluster))
+            + (offset_from_cluster / disk->sector_size);
+  int sectors = (offset_from_sector + length + disk->sector_size - 1)
+                / disk->sector_size;
+  if (disk_prefetch_start (&desc->prefetch, disk, lba, sectors) < 0)
+    {
+      return;
+    }
+
+  desc->ra_start = start;
+  desc->ra_end = start + length;
+}
+
+int
+fat16_read (struct disk *disk, void *descriptor, uint32_t size, uint32_t nmemb,
+            char *out_ptr)
+{
+  int res = 0;
+
+  struct fat_file_descriptor *fat_desc = descriptor;
+  struct fat_extent_map *map = fat16_dentry_extents (disk, fat_desc->dentry);
+  if (!map)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  uint32_t offset = fat_desc->pos;
+  uint32_t total = size * nmemb;
+  fat16_readahead_update (disk, fat_desc, offset, total);
+  fat16_readahead_collect (fat_desc, offset, offset + total);
+  for (uint32_t i = 0; i < nmemb; i++)
+    {
+      res = fat16_read_internal (disk, map, offset, size, out_ptr);
+
+      if (ISERR (res))
+        {
+          goto out;
+        }
+
+      out_ptr += size;
+      offset += size;
+    }
+
+  fat_desc->pos = offset;
+  fat_desc->ra_next = offset;
+  fat16_readahead_start (disk, fat_desc, map, offset);
+  res = nmemb;
+out:
+  return res;
+}
+
+int
+fat16_write (struct disk *disk, void *descriptor, uint32_t size,
+             uint32_t nmemb, const char *in_ptr)
+{
+  int res = 0;
+  struct fat_file_descriptor *desc = descriptor;
+  struct fat_dentry *dentry = desc->dentry;
+  if (desc->mode == FILE_MODE_READ)
+    {
+      res = -ERDONLY;
+      goto out;
+    }
+
+  uint32_t total = size * nmemb;
+  if (nmemb == 0 || total / nmemb != size)
+    {
+      res = -EINVARG;
+      goto out;
+    }
+
+  if (desc->mode == FILE_MODE_APPEND)
+    {
+      desc->pos = dentry->item.filesize;
+    }
+
+  uint32_t end = desc->pos + total;
+  if (end < desc->pos)
+    {
+      res = -EINVARG;
+      goto out;
+    }
+
+  // Every cluster the write needs is allocated up front, in one go
+  res = fat16_extend_file (disk, dentry, end);
+  desc->dirty = 1;
+  if (res < 0)
+    {
+      goto out;
+    }
+
+  res = fat16_write_internal (disk, &dentry->extents, desc->pos, total,
+                              in_ptr);
+  if (res < 0)
+    {
+      goto out;
+    }
+
+  desc->pos = end;
+  if (end > dentry->item.filesize)
+    {
+      dentry->item.filesize = end;
+    }
+
+  res = nmemb;
+out:
+  return res;
+}
+
+int
+fat16_truncate (struct disk *disk, void *descriptor, uint32_t size)
+{
+  int res = 0;
+  struct fat_file_descriptor *desc = descriptor;
+  struct fat_dentry *dentry = desc->dentry;
+  char *zeroes = 0;
+  if (desc->mode == FILE_MODE_READ)
+    {
+      res = -ERDONLY;
+      goto out;
+    }
+
+  struct fat_extent_map *map = fat16_dentry_extents (disk, dentry);
+  if (!map)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  uint32_t size_of_cluster_bytes = fat16_cluster_bytes (disk);
+  uint32_t filesize = dentry->item.filesize;
+  desc->dirty = 1;
+  if (size < filesize)
+    {
+      uint32_t keep = (size / size_of_cluster_bytes)
+                      + (size % size_of_cluster_bytes ? 1 : 0);
+      fat16_truncate_clusters (disk, map, keep);
+      if (keep == 0)
+        {
+          fat16_set_first_cluster (&dentry->item, 0);
+        }
+    }
+  else if (size > filesize)
+    {
+      res = fat16_extend_file (disk, dentry, size);
+      if (res < 0)
+        {
+          goto out;
+        }
+
+      // The bytes the file grows by read back as zero
+      zeroes = kzalloc (size_of_cluster_bytes);
+      if (!zeroes)
+        {
+          res = -ENOMEM;
+          goto out;
+        }
+
+      for (uint32_t pos = filesize; pos < size;)
+        {
+          uint32_t chunk = size - pos > size_of_cluster_bytes
+                               ? size_of_cluster_bytes
+                               : size - pos;
+          res = fat16_write_internal (disk, map, pos, chunk, zeroes);
+          if (res < 0)
+            {
+              goto out;
+            }
+
+          pos += chunk;
+        }
+    }
+
+  dentry->item.filesize = size;
+  if (desc->pos > size)
+    {
+      desc->pos = size;
+    }
+
+out:
+  if (zeroes)
+    {
+      kfree (zeroes);
+    }
+
+  return res;
+}
+
+int
+fat16_unlink (struct disk *disk, struct path_part *path)
+{
+  int res = 0;
+  struct fat_dentry *dentry = fat16_resolve_path (disk, path);
+  if (!dentry || dentry->negative)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  if (dentry->item.attribute & FAT_FILE_SUBDIRECTORY)
+    {
+      res = -EINVARG;
+      goto out;
+    }
+
+  if (dentry->item.attribute & FAT_FILE_READ_ONLY)
+    {
+      res = -ERDONLY;
+      goto out;
+    }
+
+  if (dentry->refs)
+    {
+      res = -EISTKN;
+      goto out;
+    }
+
+  struct fat_directory *directory
+      = fat16_dentry_directory (disk, dentry->parent);
+  struct fat_extent_map *map = fat16_dentry_extents (disk, dentry);
+  if (!directory || !map)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  // The entry goes before its clusters are freed. If writing it fails the
+  // file is left intact rather than pointing at clusters a new file may get
+  struct fat_directory_item *item = &directory->item[dentry->index];
+  uint8_t first = item->filename[0];
+  item->filename[0] = LAMEOS_FAT_DELETED;
+  res = fat16_write_directory_item (disk, directory, dentry->index);
+  if (res < 0)
+    {
+      item->filename[0] = first;
+      goto out;
+    }
+
+  fat16_truncate_clusters (disk, map, 0);
+  res = fat16_flush_fat (disk);
+
+  // Later lookups find the name missing without scanning the directory
+  memset (&dentry->item, 0, sizeof (struct fat_directory_item));
+  dentry->negative = 1;
+  dentry->extents_valid = 0;
+
+out:
+  return res;
+}
+
+int
+fat16_seek (void *private, uint32_t offset, FILE_SEEK_MODE seek_mode)
+{
+  int res = 0;
+  struct fat_file_descriptor *desc = private;
+  struct fat_directory_item *ritem = &desc->dentry->item;
+  switch (seek_mode)
+    {
+    case SEEK_SET:
+      if (offset > ritem->filesize)
+        {
+          res = -EIO;
+          break;
+        }
+
+      desc->pos = offset;
+      break;
+
+    case SEEK_END:
+      res = -EUNIMP;
+      break;
+
+    case SEEK_CUR:
+      if (offset > ritem->filesize - desc->pos)
+        {
+          res = -EIO;
+          break;
+        }
+
+      desc->pos += offset;
+      break;
+
+    default:
+      res = -EINVARG;
+      break;
+    }
+
+  return res;
+}
+
+int
+fat16_statfs (struct disk *disk, struct fs_stat *stat)
+{
+  struct fat_private *private = disk->fs_private;
+  stat->block_size = fat16_cluster_bytes (disk);
+  stat->total_blocks = private->total_clusters - LAMEOS_FAT_FIRST_CLUSTER;
+  stat->free_blocks = private->free_total;
+  return 0;
+}
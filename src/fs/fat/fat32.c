@@ -0,0 +1,1885 @@
+#include "fat32.h"
+#include "fat.h"
+#include "config.h"
+#include "disk/disk.h"
+#include "kernel.h"
+#include "memory/heap/kheap.h"
+#include "memory/memory.h"
+#include "status.h"
+#include "string/string.h"
+#include <stdint.h>
+
+/*
+ * FAT32 volumes.
+ *
+ * The FAT is kept in memory like FAT16's, but it can run to megabytes, so it
+ * is read a chunk at a time the first time a cluster in the chunk is looked
+ * at rather than all at mount, and clean chunks are dropped again once
+ * LAMEOS_FAT32_RESIDENT_FAT_CHUNKS are held. Free space comes from the
+ * FSInfo sector: its free count answers statfs and its next free hint is
+ * where allocation starts looking, so neither walks the whole FAT. Both are
+ * kept up to date and written back with the FAT.
+ */
+
+#define LAMEOS_FAT32_SIGNATURE 0x29
+#define LAMEOS_FAT32_OLD_SIGNATURE 0x28
+#define LAMEOS_FAT32_FAT_ENTRY_SIZE 0x04
+
+// Only the low 28 bits of an entry are the cluster, the top 4 are reserved
+// and kept as they are when the entry is changed
+#define LAMEOS_FAT32_ENTRY_MASK 0x0FFFFFFF
+
+// Masked entries from here up are reserved, bad or end the chain
+#define LAMEOS_FAT32_RESERVED_CLUSTERS 0x0FFFFFF0
+
+// What the last cluster of a chain points to
+#define LAMEOS_FAT32_END_OF_CHAIN 0x0FFFFFFF
+
+// FAT sectors allocated and read together the first time one of them is
+// needed
+#define LAMEOS_FAT32_FAT_CHUNK_SECTORS 64
+
+// Set in the extended flags when only one FAT is in use, the low 4 bits
+// then say which
+#define LAMEOS_FAT32_NO_MIRRORING 0x80
+#define LAMEOS_FAT32_ACTIVE_FAT_MASK 0x0F
+
+#define LAMEOS_FAT32_FSINFO_LEAD_SIGNATURE 0x41615252
+#define LAMEOS_FAT32_FSINFO_STRUCT_SIGNATURE 0x61417272
+#define LAMEOS_FAT32_FSINFO_TRAIL_SIGNATURE 0xAA550000
+
+// FSInfo's value for a count or hint that isn't known
+#define LAMEOS_FAT32_FSINFO_UNKNOWN 0xFFFFFFFF
+
+struct fat32_header
+{
+  uint8_t short_jmp_ins[3];
+  uint8_t oem_identifier[8];
+  uint16_t bytes_per_sector;
+  uint8_t sectors_per_cluster;
+  uint16_t reserved_sectors;
+  uint8_t fat_copies;
+  // Both 0 on FAT32, the root directory is a cluster chain and the FAT size
+  // is in the extended header
+  uint16_t root_dir_entries;
+  uint16_t number_of_sectors;
+  uint8_t media_type;
+  uint16_t sectors_per_fat;
+  uint16_t sectors_per_track;
+  uint16_t number_of_heads;
+  uint32_t hidden_setors;
+  uint32_t sectors_big;
+} __attribute__ ((packed));
+
+struct fat32_header_extended
+{
+  uint32_t sectors_per_fat;
+  uint16_t flags;
+  uint16_t version;
+  uint32_t root_cluster;
+  uint16_t fsinfo_sector;
+  uint16_t backup_boot_sector;
+  uint8_t reserved[12];
+  uint8_t drive_number;
+  uint8_t win_nt_bit;
+  uint8_t signature;
+  uint32_t volume_id;
+  uint8_t volume_id_string[11];
+  uint8_t system_id_string[8];
+} __attribute__ ((packed));
+
+struct fat32_h
+{
+  struct fat32_header primary_header;
+  struct fat32_header_extended extended_header;
+} __attribute__ ((packed));
+
+// The FSInfo sector, one sector long
+struct fat32_fsinfo
+{
+  uint32_t lead_signature;
+  uint8_t reserved[480];
+  uint32_t struct_signature;
+  uint32_t free_count;
+  uint32_t next_free;
+  uint8_t reserved2[12];
+  uint32_t trail_signature;
+} __attribute__ ((packed));
+
+// Where a name was found in a directory, or where it can be added
+struct fat32_lookup
+{
+  int found;
+  struct fat_directory_item item;
+
+  // First cluster of the directory, and the item's slot in it
+  uint32_t directory_cluster;
+  int index;
+
+  // First deleted or never used slot, -1 if the directory is full
+  int free_index;
+  uint32_t last_cluster;
+  int slots;
+};
+
+// An open file, shared by every descriptor open on it
+struct fat32_node
+{
+  uint32_t directory_cluster;
+  int index;
+  struct fat_directory_item item;
+
+  // The file's cluster chain, built on first use
+  struct fat_extent_map extents;
+  int extents_valid;
+
+  int refs;
+  struct fat32_node *next;
+};
+
+struct fat32_file_descriptor
+{
+  struct disk *disk;
+  struct fat32_node *node;
+  uint32_t pos;
+  FILE_MODE mode;
+
+  // Set when close has to write the directory entry back
+  int dirty;
+};
+
+// A chunk of the FAT held in memory
+struct fat32_fat_chunk
+{
+  // One byte per sector of the chunk, set for those changed since the FAT
+  // was last written back
+  uint8_t dirty[LAMEOS_FAT32_FAT_CHUNK_SECTORS];
+  uint32_t entries[];
+};
+
+struct fat32_private
+{
+  struct fat32_h header;
+  struct fat32_fsinfo fsinfo;
+
+  // Set if the volume has a valid FSInfo sector to write back
+  int has_fsinfo;
+  int fsinfo_dirty;
+
+  // Free clusters, or LAMEOS_FAT32_FSINFO_UNKNOWN until counted, and where
+  // the next allocation starts looking. The count from FSInfo is only a
+  // hint, free_counted is set once it was counted from the FAT.
+  uint32_t free_count;
+  uint32_t next_free;
+  int free_counted;
+
+  // First sector of cluster 2, and one past the highest cluster
+  uint32_t data_sector;
+  uint32_t total_clusters;
+
+  // The FAT in use, a pointer per chunk, 0 until the chunk is first needed.
+  // Memory use follows what's touched, not the size of the volume.
+  struct fat32_fat_chunk **fat_chunks;
+  uint32_t fat_total_chunks;
+
+  // Chunks held, and where the search for a clean one to drop starts
+  uint32_t fat_resident;
+  uint32_t fat_evict_next;
+  uint32_t fat_chunk_entries;
+  uint32_t fat_entries;
+  uint32_t fat_sector;
+
+  struct fat32_node *nodes;
+};
+
+int fat32_resolve (struct disk *disk);
+void *fat32_open (struct disk *disk, struct path_part *path, FILE_MODE mode);
+int fat32_read (struct disk *disk, void *descriptor, uint32_t size,
+                uint32_t nmemb, char *out_ptr);
+int fat32_seek (void *private, uint32_t offset, FILE_SEEK_MODE seek_mode);
+int fat32_stat (struct disk *disk, void *private, struct file_stat *stat);
+int fat32_close (void *private);
+int fat32_write (struct disk *disk, void *descriptor, uint32_t size,
+                 uint32_t nmemb, const char *in_ptr);
+int fat32_truncate (struct disk *disk, void *descriptor, uint32_t size);
+int fat32_unlink (struct disk *disk, struct path_part *path);
+int fat32_statfs (struct disk *disk, struct fs_stat *stat);
+
+struct filesystem fat32_fs = { .resolve = fat32_resolve,
+                               .open = fat32_open,
+                               .read = fat32_read,
+                               .seek = fat32_seek,
+                               .stat = fat32_stat,
+                               .close = fat32_close,
+                               .write = fat32_write,
+                               .truncate = fat32_truncate,
+                               .unlink = fat32_unlink,
+                               .statfs = fat32_statfs };
+
+struct filesystem *
+fat32_init ()
+{
+  strcpy (fat32_fs.name, "FAT32");
+  return &fat32_fs;
+}
+
+static uint32_t
+fat32_cluster_bytes (struct disk *disk)
+{
+  struct fat32_private *private = disk->fs_private;
+  return private->header.primary_header.sectors_per_cluster
+         * disk->sector_size;
+}
+
+static uint32_t
+fat32_cluster_to_sector (struct fat32_private *private, uint32_t cluster)
+{
+  return private->data_sector
+         + ((cluster - LAMEOS_FAT_FIRST_CLUSTER)
+            * private->header.primary_header.sectors_per_cluster);
+}
+
+static uint32_t
+fat32_get_first_cluster (struct fat_directory_item *item)
+{
+  return ((uint32_t)item->high_16_bits_first_cluster << 16)
+         | item->low_16_bits_first_cluster;
+}
+
+static void
+fat32_set_first_cluster (struct fat_directory_item *item, uint32_t cluster)
+{
+  item->high_16_bits_first_cluster = cluster >> 16;
+  item->low_16_bits_first_cluster = cluster & 0xFFFF;
+}
+
+/**
+ * @brief Reads one chunk of the FAT, the last may be short.
+ */
+static int
+fat32_read_fat_chunk (struct disk *disk, uint32_t chunk, uint32_t *entries)
+{
+  struct fat32_private *private = disk->fs_private;
+  uint32_t sectors_per_fat = private->header.extended_header.sectors_per_fat;
+  uint32_t first = chunk * LAMEOS_FAT32_FAT_CHUNK_SECTORS;
+  uint32_t total = sectors_per_fat - first;
+  if (total > LAMEOS_FAT32_FAT_CHUNK_SECTORS)
+    {
+      total = LAMEOS_FAT32_FAT_CHUNK_SECTORS;
+    }
+
+  if (disk_read_block (disk, private->fat_sector + first, total, entries)
+      < 0)
+    {
+      return -EIO;
+    }
+
+  return 0;
+}
+
+/**
+ * @brief Drops a chunk with no changes waiting to be written back, looking
+ * round from after the last one dropped.
+ * @return int 1 if a chunk was dropped, 0 if every chunk held is dirty.
+ */
+static int
+fat32_evict_fat_chunk (struct fat32_private *private)
+{
+  for (uint32_t n = 0; n < private->fat_total_chunks; n++)
+    {
+      uint32_t chunk
+          = (private->fat_evict_next + n) % private->fat_total_chunks;
+      struct fat32_fat_chunk *fat_chunk = private->fat_chunks[chunk];
+      if (!fat_chunk)
+        {
+          continue;
+        }
+
+      int dirty = 0;
+      for (int i = 0; i < LAMEOS_FAT32_FAT_CHUNK_SECTORS && !dirty; i++)
+        {
+          dirty = fat_chunk->dirty[i];
+        }
+
+      if (dirty)
+        {
+          continue;
+        }
+
+      kfree (fat_chunk);
+      private->fat_chunks[chunk] = 0;
+      private->fat_resident--;
+      private->fat_evict_next = chunk + 1;
+      return 1;
+    }
+
+  return 0;
+}
+
+/**
+ * @brief Finds a cluster's entry, reading the chunk of the FAT holding it
+ * unless it's held already. With LAMEOS_FAT32_RESIDENT_FAT_CHUNKS held, or
+ * no memory for another, clean chunks are dropped first. Dirty ones stay
+ * until the next flush, so the limit can be passed while they're waiting.
+ */
+static int
+fat32_fat_entry_ptr (struct disk *disk, uint32_t cluster, uint32_t **out)
+{
+  struct fat32_private *private = disk->fs_private;
+  uint32_t chunk = cluster / private->fat_chunk_entries;
+  uint32_t index = cluster % private->fat_chunk_entries;
+  if (private->fat_chunks[chunk])
+    {
+      *out = &private->fat_chunks[chunk]->entries[index];
+      return 0;
+    }
+
+  if (private->fat_resident >= LAMEOS_FAT32_RESIDENT_FAT_CHUNKS)
+    {
+      fat32_evict_fat_chunk (private);
+    }
+
+  uint32_t size = sizeof (struct fat32_fat_chunk)
+                  + (LAMEOS_FAT32_FAT_CHUNK_SECTORS * disk->sector_size);
+  struct fat32_fat_chunk *fat_chunk = kzalloc (size);
+  while (!fat_chunk && fat32_evict_fat_chunk (private))
+    {
+      fat_chunk = kzalloc (size);
+    }
+
+  if (!fat_chunk)
+    {
+      return -ENOMEM;
+    }
+
+  int res = fat32_read_fat_chunk (disk, chunk, fat_chunk->entries);
+  if (res < 0)
+    {
+      kfree (fat_chunk);
+      return res;
+    }
+
+  private->fat_chunks[chunk] = fat_chunk;
+  private->fat_resident++;
+  *out = &fat_chunk->entries[index];
+  return 0;
+}
+
+static void
+fat32_free_fat (struct fat32_private *private)
+{
+  if (!private->fat_chunks)
+    {
+      return;
+    }
+
+  for (uint32_t i = 0; i < private->fat_total_chunks; i++)
+    {
+      if (private->fat_chunks[i])
+        {
+          kfree (private->fat_chunks[i]);
+        }
+    }
+
+  kfree (private->fat_chunks);
+  private->fat_chunks = 0;
+}
+
+static int
+fat32_get_fat_entry (struct disk *disk, uint32_t cluster)
+{
+  struct fat32_private *private = disk->fs_private;
+  if (cluster >= private->total_clusters)
+    {
+      return -EIO;
+    }
+
+  uint32_t *entry = 0;
+  int res = fat32_fat_entry_ptr (disk, cluster, &entry);
+  if (res < 0)
+    {
+      return res;
+    }
+
+  return *entry & LAMEOS_FAT32_ENTRY_MASK;
+}
+
+/**
+ * @brief Changes a FAT entry in memory and marks its sector for
+ * fat32_flush_fat. Keeps the free count and hint in step.
+ */
+static int
+fat32_set_fat_entry (struct disk *disk, uint32_t cluster, uint32_t value)
+{
+  struct fat32_private *private = disk->fs_private;
+  int old = fat32_get_fat_entry (disk, cluster);
+  if (old < 0)
+    {
+      return old;
+    }
+
+  // Held now that its old value was read
+  uint32_t *entry = 0;
+  fat32_fat_entry_ptr (disk, cluster, &entry);
+  *entry = (*entry & ~LAMEOS_FAT32_ENTRY_MASK)
+           | (value & LAMEOS_FAT32_ENTRY_MASK);
+
+  uint32_t index = cluster % private->fat_chunk_entries;
+  private->fat_chunks[cluster / private->fat_chunk_entries]
+      ->dirty[(index * LAMEOS_FAT32_FAT_ENTRY_SIZE) / disk->sector_size]
+      = 1;
+
+  if (private->free_count != LAMEOS_FAT32_FSINFO_UNKNOWN)
+    {
+      if (old == LAMEOS_FAT_UNUSED && value != LAMEOS_FAT_UNUSED)
+        {
+          private->free_count--;
+        }
+      else if (old != LAMEOS_FAT_UNUSED && value == LAMEOS_FAT_UNUSED)
+        {
+          private->free_count++;
+        }
+    }
+
+  // A freed cluster lower down is where the next allocation looks
+  if (value == LAMEOS_FAT_UNUSED && cluster < private->next_free)
+    {
+      private->next_free = cluster;
+    }
+
+  private->fsinfo_dirty = 1;
+  return 0;
+}
+
+static int
+fat32_next_cluster (struct disk *disk, uint32_t cluster)
+{
+  int entry = fat32_get_fat_entry (disk, cluster);
+
+  // Past the end of the chain, or an entry that isn't a cluster number
+  if (entry < LAMEOS_FAT_FIRST_CLUSTER
+      || entry >= LAMEOS_FAT32_RESERVED_CLUSTERS)
+    {
+      return -EIO;
+    }
+
+  return entry;
+}
+
+static int
+fat32_build_extent_map (struct disk *disk, uint32_t first_cluster,
+                        struct fat_extent_map *map)
+{
+  struct fat32_private *private = disk->fs_private;
+  return fat_build_extent_map (disk, first_cluster, private->total_clusters,
+                               fat32_next_cluster, map);
+}
+
+/**
+ * @brief Looks for free clusters from one cluster up to another, a chunk of
+ * the FAT at a time. A chunk that isn't held is read into scratch, allocated
+ * on first use, and not kept, so a scan over the whole FAT leaves what's
+ * held as it was.
+ * @param count Counts every free cluster if set, otherwise the scan stops
+ * at the first and sets found.
+ * @return int 1 if a free cluster was found, 0 if not, or a negative status.
+ */
+static int
+fat32_scan_free (struct disk *disk, uint32_t from, uint32_t to,
+                 uint32_t **scratch, uint32_t *found, uint32_t *count)
+{
+  struct fat32_private *private = disk->fs_private;
+  uint32_t cluster = from;
+  while (cluster < to)
+    {
+      uint32_t chunk = cluster / private->fat_chunk_entries;
+      uint32_t first = chunk * private->fat_chunk_entries;
+      uint32_t end = first + private->fat_chunk_entries;
+      if (end > to)
+        {
+          end = to;
+        }
+
+      uint32_t *entries = 0;
+      if (private->fat_chunks[chunk])
+        {
+          entries = private->fat_chunks[chunk]->entries;
+        }
+      else
+        {
+          if (!*scratch)
+            {
+              *scratch = kzalloc (LAMEOS_FAT32_FAT_CHUNK_SECTORS
+                                  * disk->sector_size);
+              if (!*scratch)
+                {
+                  return -ENOMEM;
+                }
+            }
+
+          int res = fat32_read_fat_chunk (disk, chunk, *scratch);
+          if (res < 0)
+            {
+              return res;
+            }
+
+          entries = *scratch;
+        }
+
+      for (; cluster < end; cluster++)
+        {
+          if ((entries[cluster - first] & LAMEOS_FAT32_ENTRY_MASK)
+              != LAMEOS_FAT_UNUSED)
+            {
+              continue;
+            }
+
+          if (!count)
+            {
+              *found = cluster;
+              return 1;
+            }
+
+          (*count)++;
+        }
+    }
+
+  return 0;
+}
+
+/**
+ * @brief Counts the free clusters, for a volume whose FSInfo sector doesn't
+ * say or whose count turned out wrong.
+ */
+static int
+fat32_count_free (struct disk *disk)
+{
+  struct fat32_private *private = disk->fs_private;
+  uint32_t *scratch = 0;
+  uint32_t free_count = 0;
+  int res = fat32_scan_free (disk, LAMEOS_FAT_FIRST_CLUSTER,
+                             private->total_clusters, &scratch, 0,
+                             &free_count);
+  if (scratch)
+    {
+      kfree (scratch);
+    }
+
+  if (res < 0)
+    {
+      return res;
+    }
+
+  private->free_count = free_count;
+  private->free_counted = 1;
+  private->fsinfo_dirty = 1;
+  return 0;
+}
+
+/**
+ * @brief Writes the FAT sectors changed since the last flush to every
+ * mirrored copy of the FAT, one write per run of adjacent changed sectors,
+ * then the FSInfo sector.
+ */
+static int
+fat32_flush_fat (struct disk *disk)
+{
+  struct fat32_private *private = disk->fs_private;
+  struct fat32_header *primary_header = &private->header.primary_header;
+  struct fat32_header_extended *extended_header
+      = &private->header.extended_header;
+  uint32_t sectors = extended_header->sectors_per_fat;
+  int copies = primary_header->fat_copies;
+  uint32_t first_copy_sector = primary_header->reserved_sectors;
+  if (extended_header->flags & LAMEOS_FAT32_NO_MIRRORING)
+    {
+      copies = 1;
+      first_copy_sector = private->fat_sector;
+    }
+
+  for (uint32_t chunk = 0; chunk < private->fat_total_chunks; chunk++)
+    {
+      struct fat32_fat_chunk *fat_chunk = private->fat_chunks[chunk];
+      if (!fat_chunk)
+        {
+          continue;
+        }
+
+      uint32_t first = chunk * LAMEOS_FAT32_FAT_CHUNK_SECTORS;
+      uint32_t total = sectors - first;
+      if (total > LAMEOS_FAT32_FAT_CHUNK_SECTORS)
+        {
+          total = LAMEOS_FAT32_FAT_CHUNK_SECTORS;
+        }
+
+      uint32_t sector = 0;
+      while (sector < total)
+        {
+          if (!fat_chunk->dirty[sector])
+            {
+              sector++;
+              continue;
+            }
+
+          uint32_t run = 1;
+          while (sector + run < total && fat_chunk->dirty[sector + run])
+            {
+              run++;
+            }
+
+          char *data
+              = (char *)fat_chunk->entries + (sector * disk->sector_size);
+          for (int copy = 0; copy < copies; copy++)
+            {
+              uint32_t lba
+                  = first_copy_sector + (copy * sectors) + first + sector;
+              if (disk_write_block (disk, lba, run, data) < 0)
+                {
+                  return -EIO;
+                }
+            }
+
+          memset (&fat_chunk->dirty[sector], 0, run);
+          sector += run;
+        }
+    }
+
+  if (private->has_fsinfo && private->fsinfo_dirty)
+    {
+      private->fsinfo.free_count = private->free_count;
+      private->fsinfo.next_free = private->next_free;
+      if (disk_write_block (disk, extended_header->fsinfo_sector, 1,
+                            &private->fsinfo)
+          < 0)
+        {
+          return -EIO;
+        }
+
+      private->fsinfo_dirty = 0;
+    }
+
+  return 0;
+}
+
+/**
+ * @brief Finds a free cluster from the next free hint onwards, wrapping
+ * round to the start. The hint is kept at the lowest cluster that may be
+ * free, so this normally stops at once.
+ */
+static int
+fat32_find_free_cluster (struct disk *disk, uint32_t *out)
+{
+  struct fat32_private *private = disk->fs_private;
+  uint32_t start = private->next_free;
+  if (start < LAMEOS_FAT_FIRST_CLUSTER || start >= private->total_clusters)
+    {
+      start = LAMEOS_FAT_FIRST_CLUSTER;
+    }
+
+  uint32_t *scratch = 0;
+  int res = fat32_scan_free (disk, start, private->total_clusters, &scratch,
+                             out, 0);
+  if (res == 0)
+    {
+      res = fat32_scan_free (disk, LAMEOS_FAT_FIRST_CLUSTER, start, &scratch,
+                             out, 0);
+    }
+
+  if (scratch)
+    {
+      kfree (scratch);
+    }
+
+  if (res < 0)
+    {
+      return res;
+    }
+
+  return res ? 0 : -ENOSPC;
+}
+
+static int
+fat32_truncate_clusters (struct disk *disk, struct fat_extent_map *map,
+                         uint32_t keep)
+{
+  return fat_truncate_clusters (disk, map, keep, fat32_set_fat_entry,
+                                LAMEOS_FAT32_END_OF_CHAIN);
+}
+
+/**
+ * @brief Adds clusters to the end of a chain and records them in the
+ * chain's extent map. Each cluster continues the chain on the disk when the
+ * one after its last is free, so a file written in one go stays in one run.
+ * The free count from FSInfo is only trusted to say there's room, when it
+ * says there isn't or turns out wrong the FAT is counted instead.
+ * @param first Set to the first cluster allocated if the chain was empty.
+ * @return int 0, or a negative status with nothing allocated.
+ */
+static int
+fat32_allocate_clusters (struct disk *disk, struct fat_extent_map *map,
+                         uint32_t wanted, uint32_t *first)
+{
+  int res = 0;
+  struct fat32_private *private = disk->fs_private;
+  if (private->free_count == LAMEOS_FAT32_FSINFO_UNKNOWN
+      || (wanted > private->free_count && !private->free_counted))
+    {
+      res = fat32_count_free (disk);
+      if (res < 0)
+        {
+          return res;
+        }
+    }
+
+  if (wanted > private->free_count)
+    {
+      return -ENOSPC;
+    }
+
+  uint32_t old_clusters = fat_extent_map_clusters (map);
+  uint32_t last = 0;
+  if (map->total)
+    {
+      struct fat_extent *extent = &map->extents[map->total - 1];
+      last = extent->disk_cluster + extent->length - 1;
+    }
+
+  for (; wanted > 0; wanted--)
+    {
+      uint32_t cluster = last + 1;
+      if (!last || cluster >= private->total_clusters
+          || fat32_get_fat_entry (disk, cluster) != LAMEOS_FAT_UNUSED)
+        {
+          res = fat32_find_free_cluster (disk, &cluster);
+          if (res < 0)
+            {
+              goto out;
+            }
+        }
+
+      // Room in the map first, once the FAT has changed the append can't
+      // be allowed to fail
+      res = fat_extent_map_reserve (map);
+      if (res < 0)
+        {
+          goto out;
+        }
+
+      res = fat32_set_fat_entry (disk, cluster, LAMEOS_FAT32_END_OF_CHAIN);
+      if (res < 0)
+        {
+          goto out;
+        }
+
+      fat_extent_map_append (map, cluster, 1);
+      if (last)
+        {
+          res = fat32_set_fat_entry (disk, last, cluster);
+          if (res < 0)
+            {
+              goto out;
+            }
+        }
+      else
+        {
+          *first = cluster;
+        }
+
+      private->next_free = cluster + 1;
+      last = cluster;
+    }
+
+out:
+  if (res < 0)
+    {
+      fat32_truncate_clusters (disk, map, old_clusters);
+
+      // Running out with clusters left to go means the count was too high
+      if (res == -ENOSPC && !private->free_counted)
+        {
+          fat32_count_free (disk);
+        }
+    }
+  return res;
+}
+
+/**
+ * @brief Reads or writes across clusters with one transfer per run of
+ * adjacent whole sectors. Sectors only partly covered go through a bounce
+ * sector, read and for a write changed and written back.
+ */
+static int
+fat32_transfer (struct disk *disk, struct fat_extent_map *map,
+                uint32_t offset, uint32_t total, char *buf, int write)
+{
+  int res = 0;
+  struct fat32_private *private = disk->fs_private;
+  uint32_t size_of_cluster_bytes = fat32_cluster_bytes (disk);
+  uint32_t max_transfer_bytes
+      = LAMEOS_DISK_MAX_TRANSFER_SECTORS * disk->sector_size;
+  char *bounce = 0;
+  while (total > 0)
+    {
+      uint32_t file_cluster = offset / size_of_cluster_bytes;
+      struct fat_extent *extent = fat_extent_map_lookup (map, file_cluster);
+      if (!extent)
+        {
+          res = -EIO;
+          goto out;
+        }
+
+      uint32_t cluster_to_use
+          = extent->disk_cluster + (file_cluster - extent->file_cluster);
+      uint32_t offset_from_cluster = offset % size_of_cluster_bytes;
+      uint32_t available
+          = ((extent->file_cluster + extent->length - file_cluster)
+             * size_of_cluster_bytes)
+            - offset_from_cluster;
+      if (available > max_transfer_bytes)
+        {
+          available = max_transfer_bytes;
+        }
+
+      uint32_t chunk = total > available ? available : total;
+      uint32_t lba = fat32_cluster_to_sector (private, cluster_to_use)
+                     + (offset_from_cluster / disk->sector_size);
+      uint32_t offset_from_sector = offset_from_cluster % disk->sector_size;
+      if (offset_from_sector || chunk < disk->sector_size)
+        {
+          if (!bounce)
+            {
+              bounce = kzalloc (disk->sector_size);
+              if (!bounce)
+                {
+                  res = -ENOMEM;
+                  goto out;
+                }
+            }
+
+          if (chunk > disk->sector_size - offset_from_sector)
+            {
+              chunk = disk->sector_size - offset_from_sector;
+            }
+
+          if (disk_read_block (disk, lba, 1, bounce) < 0)
+            {
+              res = -EIO;
+              goto out;
+            }
+
+          if (!write)
+            {
+              memcpy (buf, bounce + offset_from_sector, chunk);
+            }
+          else
+            {
+              memcpy (bounce + offset_from_sector, buf, chunk);
+              if (disk_write_block (disk, lba, 1, bounce) < 0)
+                {
+                  res = -EIO;
+                  goto out;
+                }
+            }
+        }
+      else
+        {
+          chunk -= chunk % disk->sector_size;
+          int sectors = chunk / disk->sector_size;
+          res = write ? disk_write_block (disk, lba, sectors, buf)
+                      : disk_read_block (disk, lba, sectors, buf);
+          if (res < 0)
+            {
+              res = -EIO;
+              goto out;
+            }
+
+          res = 0;
+        }
+
+      buf += chunk;
+      offset += chunk;
+      total -= chunk;
+    }
+
+out:
+  if (bounce)
+    {
+      kfree (bounce);
+    }
+
+  return res;
+}
+
+/**
+ * @brief Finds the cluster and sector holding one slot of a directory.
+ */
+static int
+fat32_directory_slot_sector (struct disk *disk, uint32_t directory_cluster,
+                             int index, uint32_t *lba, uint32_t *offset)
+{
+  struct fat32_private *private = disk->fs_private;
+  uint32_t size_of_cluster_bytes = fat32_cluster_bytes (disk);
+  uint32_t byte = index * sizeof (struct fat_directory_item);
+  int cluster = directory_cluster;
+  for (uint32_t i = byte / size_of_cluster_bytes; i > 0; i--)
+    {
+      cluster = fat32_next_cluster (disk, cluster);
+      if (cluster < 0)
+        {
+          return -EIO;
+        }
+    }
+
+  byte %= size_of_cluster_bytes;
+  *lba = fat32_cluster_to_sector (private, cluster) + (byte / disk->sector_size);
+  *offset = byte % disk->sector_size;
+  return 0;
+}
+
+/**
+ * @brief Writes one slot of a directory, reading and writing back the
+ * sector around it.
+ */
+static int
+fat32_write_directory_item (struct disk *disk, uint32_t directory_cluster,
+                            int index, struct fat_directory_item *item)
+{
+  int res = 0;
+  uint32_t lba = 0;
+  uint32_t offset = 0;
+  char *sector = kzalloc (disk->sector_size);
+  if (!sector)
+    {
+      return -ENOMEM;
+    }
+
+  res = fat32_directory_slot_sector (disk, directory_cluster, index, &lba,
+                                     &offset);
+  if (res < 0)
+    {
+      goto out;
+    }
+
+  if (disk_read_block (disk, lba, 1, sector) < 0)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  memcpy (sector + offset, item, sizeof (struct fat_directory_item));
+  if (disk_write_block (disk, lba, 1, sector) < 0)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+out:
+  kfree (sector);
+  return res;
+}
+
+/**
+ * @brief Looks a name up in a directory, a cluster at a time, stopping at
+ * the first match or at the first slot that was never used. Notes the first
+ * free slot on the way for fat32_create_item.
+ */
+static int
+fat32_find_item (struct disk *disk, uint32_t directory_cluster,
+                 struct fat_packed_name *name, struct fat32_lookup *lookup)
+{
+  int res = 0;
+  struct fat32_private *private = disk->fs_private;
+  uint32_t size_of_cluster_bytes = fat32_cluster_bytes (disk);
+  int per_cluster = size_of_cluster_bytes / sizeof (struct fat_directory_item);
+  memset (lookup, 0, sizeof (struct fat32_lookup));
+  lookup->directory_cluster = directory_cluster;
+  lookup->free_index = -1;
+
+  struct fat_directory_item *items = kzalloc (size_of_cluster_bytes);
+  if (!items)
+    {
+      return -ENOMEM;
+    }
+
+  int index = 0;
+  uint32_t clusters = 0;
+  for (int cluster = directory_cluster; cluster >= 0;
+       cluster = fat32_next_cluster (disk, cluster))
+    {
+      if (clusters++ >= private->total_clusters)
+        {
+          res = -EIO;
+          goto out;
+        }
+
+      lookup->last_cluster = cluster;
+      if (disk_read_block (disk, fat32_cluster_to_sector (private, cluster),
+                           private->header.primary_header.sectors_per_cluster,
+                           items)
+          < 0)
+        {
+          res = -EIO;
+          goto out;
+        }
+
+      for (int i = 0; i < per_cluster; i++, index++)
+        {
+          struct fat_directory_item *item = &items[i];
+          if (item->filename[0] == 0x00)
+            {
+              if (lookup->free_index < 0)
+                {
+                  lookup->free_index = index;
+                }
+
+              goto out;
+            }
+
+          if (item->filename[0] == LAMEOS_FAT_DELETED)
+            {
+              if (lookup->free_index < 0)
+                {
+                  lookup->free_index = index;
+                }
+
+              continue;
+            }
+
+          if (item->attribute & FAT_FILE_VOLUME_LABEL)
+            {
+              continue;
+            }
+
+          if (fat_name_matches (item, name))
+            {
+              memcpy (&lookup->item, item,
+                      sizeof (struct fat_directory_item));
+              lookup->index = index;
+              lookup->found = 1;
+              goto out;
+            }
+        }
+    }
+
+out:
+  lookup->slots = index;
+  kfree (items);
+  return res;
+}
+
+/**
+ * @brief Resolves every component of a path.
+ * @param lookup Filled in for the last component, found or not.
+ * @return int 0, or an error if a directory on the way is missing.
+ */
+static int
+fat32_resolve_path (struct disk *disk, struct path_part *path,
+                    struct fat32_lookup *lookup)
+{
+  struct fat32_private *private = disk->fs_private;
+  uint32_t directory_cluster = private->header.extended_header.root_cluster;
+  memset (lookup, 0, sizeof (struct fat32_lookup));
+  for (struct path_part *part = path; part; part = part->next)
+    {
+      struct fat_packed_name name;
+      if (fat_pack_name (part->part, &name) < 0)
+        {
+          return -EBADPATH;
+        }
+
+      int res = fat32_find_item (disk, directory_cluster, &name, lookup);
+      if (res < 0)
+        {
+          return res;
+        }
+
+      if (!part->next)
+        {
+          break;
+        }
+
+      if (!lookup->found
+          || !(lookup->item.attribute & FAT_FILE_SUBDIRECTORY))
+        {
+          return -EBADPATH;
+        }
+
+      // ".." in a subdirectory of the root points at cluster 0
+      directory_cluster = fat32_get_first_cluster (&lookup->item);
+      if (!directory_cluster)
+        {
+          directory_cluster = private->header.extended_header.root_cluster;
+        }
+    }
+
+  return 0;
+}
+
+/**
+ * @brief Creates an empty file where a lookup found none, in the first free
+ * slot of the directory. A full directory grows by a zeroed cluster.
+ */
+static int
+fat32_create_item (struct disk *disk, struct fat_packed_name *name,
+                   struct fat32_lookup *lookup)
+{
+  int res = 0;
+  if (lookup->free_index < 0)
+    {
+      struct fat_extent_map map = { 0 };
+      uint32_t size_of_cluster_bytes = fat32_cluster_bytes (disk);
+      char *zeroes = kzalloc (size_of_cluster_bytes);
+      if (!zeroes)
+        {
+          return -ENOMEM;
+        }
+
+      res = fat_extent_map_append (&map, lookup->last_cluster, 1);
+      uint32_t unused = 0;
+      if (res == 0)
+        {
+          res = fat32_allocate_clusters (disk, &map, 1, &unused);
+        }
+
+      if (res == 0)
+        {
+          res = fat32_transfer (disk, &map, size_of_cluster_bytes,
+                                size_of_cluster_bytes, zeroes, 1);
+          if (res < 0)
+            {
+              fat32_truncate_clusters (disk, &map, 1);
+            }
+        }
+
+      fat_free_extent_map (&map);
+      kfree (zeroes);
+      if (res < 0)
+        {
+          return res;
+        }
+
+      res = fat32_flush_fat (disk);
+      if (res < 0)
+        {
+          return res;
+        }
+
+      lookup->free_index = lookup->slots;
+    }
+
+  struct fat_directory_item *item = &lookup->item;
+  memset (item, 0, sizeof (struct fat_directory_item));
+  memcpy (item->filename, name->words, LAMEOS_FAT_NAME_LENGTH);
+  item->attribute = FAT_FILE_ARCHIVE;
+  res = fat32_write_directory_item (disk, lookup->directory_cluster,
+                                    lookup->free_index, item);
+  if (res < 0)
+    {
+      return res;
+    }
+
+  lookup->index = lookup->free_index;
+  lookup->found = 1;
+  return 0;
+}
+
+static struct fat32_node *
+fat32_find_node (struct fat32_private *private, uint32_t directory_cluster,
+                 int index)
+{
+  for (struct fat32_node *node = private->nodes; node; node = node->next)
+    {
+      if (node->directory_cluster == directory_cluster && node->index == index)
+        {
+          return node;
+        }
+    }
+
+  return 0;
+}
+
+/**
+ * @brief The open file for a directory slot, so every descriptor on a file
+ * shares its size and cluster chain.
+ */
+static struct fat32_node *
+fat32_get_node (struct fat32_private *private, struct fat32_lookup *lookup)
+{
+  struct fat32_node *node
+      = fat32_find_node (private, lookup->directory_cluster, lookup->index);
+  if (node)
+    {
+      node->refs++;
+      return node;
+    }
+
+  node = kzalloc (sizeof (struct fat32_node));
+  if (!node)
+    {
+      return 0;
+    }
+
+  node->directory_cluster = lookup->directory_cluster;
+  node->index = lookup->index;
+  memcpy (&node->item, &lookup->item, sizeof (struct fat_directory_item));
+  node->refs = 1;
+  node->next = private->nodes;
+  private->nodes = node;
+  return node;
+}
+
+static void
+fat32_put_node (struct fat32_private *private, struct fat32_node *node)
+{
+  if (--node->refs > 0)
+    {
+      return;
+    }
+
+  struct fat32_node **link = &private->nodes;
+  while (*link && *link != node)
+    {
+      link = &(*link)->next;
+    }
+
+  if (*link)
+    {
+      *link = node->next;
+    }
+
+  fat_free_extent_map (&node->extents);
+  kfree (node);
+}
+
+static struct fat_extent_map *
+fat32_node_extents (struct disk *disk, struct fat32_node *node)
+{
+  if (!node->extents_valid)
+    {
+      if (fat32_build_extent_map (disk, fat32_get_first_cluster (&node->item),
+                                  &node->extents)
+          < 0)
+        {
+          return 0;
+        }
+
+      node->extents_valid = 1;
+    }
+
+  return &node->extents;
+}
+
+/**
+ * @brief Makes a file's chain big enough to hold size bytes.
+ */
+static int
+fat32_extend_file (struct disk *disk, struct fat32_node *node, uint32_t size)
+{
+  struct fat_extent_map *map = fat32_node_extents (disk, node);
+  if (!map)
+    {
+      return -EIO;
+    }
+
+  uint32_t size_of_cluster_bytes = fat32_cluster_bytes (disk);
+  uint32_t needed = (size / size_of_cluster_bytes)
+                    + (size % size_of_cluster_bytes ? 1 : 0);
+  uint32_t have = fat_extent_map_clusters (map);
+  if (needed <= have)
+    {
+      return 0;
+    }
+
+  uint32_t first = 0;
+  int res = fat32_allocate_clusters (disk, map, needed - have, &first);
+  if (res < 0)
+    {
+      return res;
+    }
+
+  if (have == 0)
+    {
+      fat32_set_first_cluster (&node->item, first);
+    }
+
+  return 0;
+}
+
+int
+fat32_resolve (struct disk *disk)
+{
+  int res = 0;
+  struct fat32_private *fat_private = kzalloc (sizeof (struct fat32_private));
+  if (!fat_private)
+    {
+      return -ENOMEM;
+    }
+
+  disk->fs_private = fat_private;
+  disk->filesystem = &fat32_fs;
+
+  char *sector = kzalloc (disk->sector_size);
+  if (!sector)
+    {
+      res = -ENOMEM;
+      goto out;
+    }
+
+  if (disk_read_block (disk, 0, 1, sector) < 0)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  memcpy (&fat_private->header, sector, sizeof (fat_private->header));
+  struct fat32_header *primary_header = &fat_private->header.primary_header;
+  struct fat32_header_extended *extended_header
+      = &fat_private->header.extended_header;
+
+  // FAT32 keeps both of these 0, a FAT16 volume has neither 0
+  if (primary_header->sectors_per_fat != 0
+      || primary_header->root_dir_entries != 0
+      || extended_header->sectors_per_fat == 0
+      || primary_header->sectors_per_cluster == 0
+      || primary_header->bytes_per_sector != disk->sector_size
+      || (extended_header->signature != LAMEOS_FAT32_SIGNATURE
+          && extended_header->signature != LAMEOS_FAT32_OLD_SIGNATURE))
+    {
+      res = -EFSNOTUS;
+      goto out;
+    }
+
+  uint32_t total_sectors = primary_header->number_of_sectors
+                               ? primary_header->number_of_sectors
+                               : primary_header->sectors_big;
+  fat_private->data_sector
+      = primary_header->reserved_sectors
+        + (primary_header->fat_copies * extended_header->sectors_per_fat);
+  if (total_sectors <= fat_private->data_sector)
+    {
+      res = -EFSNOTUS;
+      goto out;
+    }
+
+  fat_private->fat_entries = (extended_header->sectors_per_fat
+                              * (disk->sector_size
+                                 / LAMEOS_FAT32_FAT_ENTRY_SIZE));
+  fat_private->total_clusters
+      = ((total_sectors - fat_private->data_sector)
+         / primary_header->sectors_per_cluster)
+        + LAMEOS_FAT_FIRST_CLUSTER;
+  if (fat_private->total_clusters > fat_private->fat_entries)
+    {
+      fat_private->total_clusters = fat_private->fat_entries;
+    }
+
+  if (extended_header->root_cluster < LAMEOS_FAT_FIRST_CLUSTER
+      || extended_header->root_cluster >= fat_private->total_clusters)
+    {
+      res = -EFSNOTUS;
+      goto out;
+    }
+
+  fat_private->fat_sector = primary_header->reserved_sectors;
+  if (extended_header->flags & LAMEOS_FAT32_NO_MIRRORING)
+    {
+      fat_private->fat_sector
+          += (extended_header->flags & LAMEOS_FAT32_ACTIVE_FAT_MASK)
+             * extended_header->sectors_per_fat;
+    }
+
+  // Nothing of the FAT is read or allocated yet, only a pointer per chunk
+  fat_private->fat_chunk_entries = (LAMEOS_FAT32_FAT_CHUNK_SECTORS
+                                    * (disk->sector_size
+                                       / LAMEOS_FAT32_FAT_ENTRY_SIZE));
+  fat_private->fat_total_chunks
+      = (extended_header->sectors_per_fat + LAMEOS_FAT32_FAT_CHUNK_SECTORS - 1)
+        / LAMEOS_FAT32_FAT_CHUNK_SECTORS;
+  fat_private->fat_chunks = kzalloc (fat_private->fat_total_chunks
+                                     * sizeof (struct fat32_fat_chunk *));
+  if (!fat_private->fat_chunks)
+    {
+      res = -ENOMEM;
+      goto out;
+    }
+
+  fat_private->free_count = LAMEOS_FAT32_FSINFO_UNKNOWN;
+  fat_private->next_free = LAMEOS_FAT_FIRST_CLUSTER;
+  if (extended_header->fsinfo_sector
+      && extended_header->fsinfo_sector < primary_header->reserved_sectors
+      && disk_read_block (disk, extended_header->fsinfo_sector, 1, sector)
+             >= 0)
+    {
+      memcpy (&fat_private->fsinfo, sector, sizeof (struct fat32_fsinfo));
+      struct fat32_fsinfo *fsinfo = &fat_private->fsinfo;
+      if (fsinfo->lead_signature == LAMEOS_FAT32_FSINFO_LEAD_SIGNATURE
+          && fsinfo->struct_signature == LAMEOS_FAT32_FSINFO_STRUCT_SIGNATURE
+          && fsinfo->trail_signature == LAMEOS_FAT32_FSINFO_TRAIL_SIGNATURE)
+        {
+          fat_private->has_fsinfo = 1;
+
+          // Both are hints, anything out of range is ignored
+          if (fsinfo->free_count
+              <= fat_private->total_clusters - LAMEOS_FAT_FIRST_CLUSTER)
+            {
+              fat_private->free_count = fsinfo->free_count;
+            }
+
+          if (fsinfo->next_free >= LAMEOS_FAT_FIRST_CLUSTER
+              && fsinfo->next_free < fat_private->total_clusters)
+            {
+              fat_private->next_free = fsinfo->next_free;
+            }
+        }
+    }
+
+out:
+  if (sector)
+    {
+      kfree (sector);
+    }
+
+  if (res < 0)
+    {
+      fat32_free_fat (fat_private);
+      kfree (fat_private);
+      disk->fs_private = 0;
+    }
+  return res;
+}
+
+void *
+fat32_open (struct disk *disk, struct path_part *path, FILE_MODE mode)
+{
+  int res = 0;
+  struct fat32_private *private = disk->fs_private;
+  struct fat32_file_descriptor *descriptor = 0;
+  struct fat32_lookup lookup;
+  struct fat_packed_name name;
+  res = fat32_resolve_path (disk, path, &lookup);
+  if (res < 0)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  if (!lookup.found)
+    {
+      if (mode == FILE_MODE_READ)
+        {
+          res = -EIO;
+          goto out;
+        }
+
+      struct path_part *last = path;
+      while (last->next)
+        {
+          last = last->next;
+        }
+
+      fat_pack_name (last->part, &name);
+      res = fat32_create_item (disk, &name, &lookup);
+      if (res < 0)
+        {
+          goto out;
+        }
+    }
+  else if (mode != FILE_MODE_READ)
+    {
+      if (lookup.item.attribute & FAT_FILE_SUBDIRECTORY)
+        {
+          res = -EINVARG;
+          goto out;
+        }
+
+      if (lookup.item.attribute & FAT_FILE_READ_ONLY)
+        {
+          res = -ERDONLY;
+          goto out;
+        }
+    }
+
+  descriptor = kzalloc (sizeof (struct fat32_file_descriptor));
+  if (!descriptor)
+    {
+      res = -ENOMEM;
+      goto out;
+    }
+
+  descriptor->disk = disk;
+  descriptor->mode = mode;
+  descriptor->node = fat32_get_node (private, &lookup);
+  if (!descriptor->node)
+    {
+      res = -ENOMEM;
+      goto out;
+    }
+
+  if (mode == FILE_MODE_WRITE && descriptor->node->item.filesize)
+    {
+      res = fat32_truncate (disk, descriptor, 0);
+      if (res < 0)
+        {
+          goto out;
+        }
+    }
+
+  if (mode == FILE_MODE_APPEND)
+    {
+      descriptor->pos = descriptor->node->item.filesize;
+    }
+
+out:
+  if (res < 0)
+    {
+      if (descriptor)
+        {
+          if (descriptor->node)
+            {
+              fat32_put_node (private, descriptor->node);
+            }
+
+          kfree (descriptor);
+        }
+
+      return ERROR (res);
+    }
+
+  return descriptor;
+}
+
+int
+fat32_close (void *private)
+{
+  struct fat32_file_descriptor *desc = private;
+  struct disk *disk = desc->disk;
+  struct fat32_node *node = desc->node;
+  if (desc->dirty)
+    {
+      int res = fat32_write_directory_item (disk, node->directory_cluster,
+                                            node->index, &node->item);
+      if (res == 0)
+        {
+          res = fat_sync (disk, fat32_flush_fat);
+        }
+
+      if (res < 0)
+        {
+          return res;
+        }
+    }
+
+  fat32_put_node (disk->fs_private, node);
+  kfree (desc);
+  return 0;
+}
+
+int
+fat32_stat (struct disk *disk, void *private, struct file_stat *stat)
+{
+  struct fat32_file_descriptor *descriptor = private;
+  struct fat_directory_item *ritem = &descriptor->node->item;
+  stat->filesize = ritem->filesize;
+  stat->flags = 0x00;
+
+  if (ritem->attribute & FAT_FILE_READ_ONLY)
+    {
+      stat->flags |= FILE_STAT_READ_ONLY;
+    }
+
+  return 0;
+}
+
+int
+fat32_read (struct disk *disk, void *descriptor, uint32_t size, uint32_t nmemb,
+            char *out_ptr)
+{
+  int res = 0;
+  struct fat32_file_descriptor *desc = descriptor;
+  struct fat_extent_map *map = fat32_node_extents (disk, desc->node);
+  if (!map)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  uint32_t offset = desc->pos;
+  for (uint32_t i = 0; i < nmemb; i++)
+    {
+      res = fat32_transfer (disk, map, offset, size, out_ptr, 0);
+      if (ISERR (res))
+        {
+          goto out;
+        }
+
+      out_ptr += size;
+      offset += size;
+    }
+
+  desc->pos = offset;
+  res = nmemb;
+out:
+  return res;
+}
+
+int
+fat32_write (struct disk *disk, void *descriptor, uint32_t size,
+             uint32_t nmemb, const char *in_ptr)
+{
+  int res = 0;
+  struct fat32_file_descriptor *desc = descriptor;
+  struct fat32_node *node = desc->node;
+  if (desc->mode == FILE_MODE_READ)
+    {
+      res = -ERDONLY;
+      goto out;
+    }
+
+  uint32_t total = size * nmemb;
+  if (nmemb == 0 || total / nmemb != size)
+    {
+      res = -EINVARG;
+      goto out;
+    }
+
+  if (desc->mode == FILE_MODE_APPEND)
+    {
+      desc->pos = node->item.filesize;
+    }
+
+  uint32_t end = desc->pos + total;
+  if (end < desc->pos)
+    {
+      res = -EINVARG;
+      goto out;
+    }
+
+  res = fat32_extend_file (disk, node, end);
+  desc->dirty = 1;
+  if (res < 0)
+    {
+      goto out;
+    }
+
+  res = fat32_transfer (disk, &node->extents, desc->pos, total,
+                        (char *)in_ptr, 1);
+  if (res < 0)
+    {
+      goto out;
+    }
+
+  desc->pos = end;
+  if (end > node->item.filesize)
+    {
+      node->item.filesize = end;
+    }
+
+  res = nmemb;
+out:
+  return res;
+}
+
+int
+fat32_truncate (struct disk *disk, void *descriptor, uint32_t size)
+{
+  int res = 0;
+  struct fat32_file_descriptor *desc = descriptor;
+  struct fat32_node *node = desc->node;
+  char *zeroes = 0;
+  if (desc->mode == FILE_MODE_READ)
+    {
+      res = -ERDONLY;
+      goto out;
+    }
+
+  struct fat_extent_map *map = fat32_node_extents (disk, node);
+  if (!map)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  uint32_t size_of_cluster_bytes = fat32_cluster_bytes (disk);
+  uint32_t filesize = node->item.filesize;
+  desc->dirty = 1;
+  if (size < filesize)
+    {
+      uint32_t keep = (size / size_of_cluster_bytes)
+                      + (size % size_of_cluster_bytes ? 1 : 0);
+      res = fat32_truncate_clusters (disk, map, keep);
+      if (res < 0)
+        {
+          goto out;
+        }
+
+      if (keep == 0)
+        {
+          fat32_set_first_cluster (&node->item, 0);
+        }
+    }
+  else if (size > filesize)
+    {
+      res = fat32_extend_file (disk, node, size);
+      if (res < 0)
+        {
+          goto out;
+        }
+
+      // Growing the file leaves zeroes after the old end
+      zeroes = kzalloc (size_of_cluster_bytes);
+      if (!zeroes)
+        {
+          res = -ENOMEM;
+          goto out;
+        }
+
+      for (uint32_t pos = filesize; pos < size;)
+        {
+          uint32_t chunk = size - pos > size_of_cluster_bytes
+                               ? size_of_cluster_bytes
+                               : size - pos;
+          res = fat32_transfer (disk, map, pos, chunk, zeroes, 1);
+          if (res < 0)
+            {
+              goto out;
+            }
+
+          pos += chunk;
+        }
+    }
+
+  node->item.filesize = size;
+  if (desc->pos > size)
+    {
+      desc->pos = size;
+    }
+
+out:
+  if (zeroes)
+    {
+      kfree (zeroes);
+    }
+
+  return res;
+}
+
+int
+fat32_unlink (struct disk *disk, struct path_part *path)
+{
+  int res = 0;
+  struct fat32_lookup lookup;
+  struct fat_extent_map map = { 0 };
+  res = fat32_resolve_path (disk, path, &lookup);
+  if (res < 0 || !lookup.found)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  if (lookup.item.attribute & FAT_FILE_SUBDIRECTORY)
+    {
+      res = -EINVARG;
+      goto out;
+    }
+
+  if (lookup.item.attribute & FAT_FILE_READ_ONLY)
+    {
+      res = -ERDONLY;
+      goto out;
+    }
+
+  if (fat32_find_node (disk->fs_private, lookup.directory_cluster,
+                       lookup.index))
+    {
+      res = -EISTKN;
+      goto out;
+    }
+
+  res = fat32_build_extent_map (
+      disk, fat32_get_first_cluster (&lookup.item), &map);
+  if (res < 0)
+    {
+      goto out;
+    }
+
+  // Deleting the entry first means a failure can at worst lose the
+  // clusters, never leave the file sharing them with a later one
+  lookup.item.filename[0] = LAMEOS_FAT_DELETED;
+  res = fat32_write_directory_item (disk, lookup.directory_cluster,
+                                    lookup.index, &lookup.item);
+  if (res < 0)
+    {
+      goto out;
+    }
+
+  res = fat32_truncate_clusters (disk, &map, 0);
+  if (res < 0)
+    {
+      goto out;
+    }
+
+  res = fat32_flush_fat (disk);
+
+out:
+  fat_free_extent_map (&map);
+  return res;
+}
+
+int
+fat32_seek (void *private, uint32_t offset, FILE_SEEK_MODE seek_mode)
+{
+  int res = 0;
+  struct fat32_file_descriptor *desc = private;
+  struct fat_directory_item *ritem = &desc->node->item;
+  switch (seek_mode)
+    {
+    case SEEK_SET:
+      if (offset > ritem->filesize)
+        {
+          res = -EIO;
+          break;
+        }
+
+      desc->pos = offset;
+      break;
+
+    case SEEK_END:
+      res = -EUNIMP;
+      break;
+
+    case SEEK_CUR:
+      if (offset > ritem->filesize - desc->pos)
+        {
+          res = -EIO;
+          break;
+        }
+
+      desc->pos += offset;
+      break;
+
+    default:
+      res = -EINVARG;
+      break;
+    }
+
+  return res;
+}
+
+int
+fat32_statfs (struct disk *disk, struct fs_stat *stat)
+{
+  struct fat32_private *private = disk->fs_private;
+  if (private->free_count == LAMEOS_FAT32_FSINFO_UNKNOWN)
+    {
+      int res = fat32_count_free (disk);
+      if (res < 0)
+        {
+          return res;
+        }
+    }
+
+  stat->block_size = fat32_cluster_bytes (disk);
+  stat->total_blocks = private->total_clusters - LAMEOS_FAT_FIRST_CLUSTER;
+  stat->free_blocks = private->free_count;
+  return 0;
+}
@@ -0,0 +1,8 @@
+#ifndef FAT32_H
+#define FAT32_H
+#include "file.h"
+
+struct filesystem *fat32_init();
+
+
+#endif
@@ -2,6 +2,7 @@
 #include "config.h"
 #include "disk/disk.h"
 #include "fat/fat16.h"
+#include "fat/fat32.h"
 #include "kernel.h"
 #include "memory/heap/kheap.h"
 #include "memory/memory.h"
@@ -46,6 +47,7 @@ static void
 fs_static_load ()
 {
   fs_insert_filesystem (fat16_init ());
+  fs_insert_filesystem (fat32_init ());
 }
 
 void
@@ -217,6 +219,13 @@ fstat (int fd, struct file_stat *stat)
     }
 
   res = desc->filesystem->stat (desc->disk, desc->private, stat);
+  if (res < 0)
+    {
+      goto out;
+    }
+
+  stat->generation = disk_write_generation (desc->disk);
+
 out:
   return res;
 }
@@ -280,3 +289,128 @@ fread (void *ptr, uint32_t size, uint32_t nmemb, int fd)
 out:
   return res;
 }
+
+int
+fwrite (const void *ptr, uint32_t size, uint32_t nmemb, int fd)
+{
+  int res = 0;
+  if (size == 0 || nmemb == 0 || fd < 1)
+    {
+      res = -EINVARG;
+      goto out;
+    }
+
+  struct file_descriptor *desc = file_get_descriptor (fd);
+  if (!desc)
+    {
+      res = -EINVARG;
+      goto out;
+    }
+
+  if (!desc->filesystem->write)
+    {
+      res = -ERDONLY;
+      goto out;
+    }
+
+  res = desc->filesystem->write (desc->disk, desc->private, size, nmemb,
+                                 (const char *)ptr);
+out:
+  return res;
+}
+
+int
+ftruncate (int fd, uint32_t size)
+{
+  int res = 0;
+  struct file_descriptor *desc = file_get_descriptor (fd);
+  if (!desc)
+    {
+      res = -EINVARG;
+      goto out;
+    }
+
+  if (!desc->filesystem->truncate)
+    {
+      res = -ERDONLY;
+      goto out;
+    }
+
+  res = desc->filesystem->truncate (desc->disk, desc->private, size);
+out:
+  return res;
+}
+
+int
+funlink (const char *filename)
+{
+  int res = 0;
+  struct path_root *root_path = pathparser_parse (filename, NULL);
+  if (!root_path)
+    {
+      res = -EINVARG;
+      goto out;
+    }
+
+  if (!root_path->first)
+    {
+      res = -EINVARG;
+      goto out;
+    }
+
+  struct disk *disk = disk_get (root_path->drive_no);
+  if (!disk || !disk->filesystem)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  if (!disk->filesystem->unlink)
+    {
+      res = -ERDONLY;
+      goto out;
+    }
+
+  res = disk->filesystem->unlink (disk, root_path->first);
+out:
+  if (root_path)
+    {
+      pathparser_free (root_path);
+    }
+
+  return res;
+}
+
+int
+statfs (const char *path, struct fs_stat *stat)
+{
+  int res = 0;
+  struct path_root *root_path = pathparser_parse (path, NULL);
+  if (!root_path)
+    {
+      res = -EINVARG;
+      goto out;
+    }
+
+  struct disk *disk = disk_get (root_path->drive_no);
+  if (!disk || !disk->filesystem)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  if (!disk->filesystem->statfs)
+    {
+      res = -EUNIMP;
+      goto out;
+    }
+
+  res = disk->filesystem->statfs (disk, stat);
+out:
+  if (root_path)
+    {
+      pathparser_free (root_path);
+    }
+
+  return res;
+}
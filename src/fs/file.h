@@ -46,11 +46,34 @@ struct file_stat
 {
   FILE_STAT_FLAGS flags;
   uint32_t filesize;
+
+  // The write generation of the file's disk, unchanged while nothing on the
+  // disk has been written, so neither has the file
+  uint32_t generation;
 };
 
 typedef int (*FS_STAT_FUNCTION) (struct disk *disk, void *private,
                                  struct file_stat *stat);
 
+typedef int (*FS_WRITE_FUNCTION) (struct disk *disk, void *private,
+                                  uint32_t size, uint32_t nmemb,
+                                  const char *in);
+
+typedef int (*FS_TRUNCATE_FUNCTION) (struct disk *disk, void *private,
+                                     uint32_t size);
+
+typedef int (*FS_UNLINK_FUNCTION) (struct disk *disk, struct path_part *path);
+
+// Space on a filesystem, counted in its allocation units
+struct fs_stat
+{
+  uint32_t block_size;
+  uint32_t total_blocks;
+  uint32_t free_blocks;
+};
+
+typedef int (*FS_STATFS_FUNCTION) (struct disk *disk, struct fs_stat *stat);
+
 struct filesystem
 {
   // filesystem should return zero from resolve if the provided disk is using
@@ -62,6 +85,12 @@ struct filesystem
   FS_STAT_FUNCTION stat;
   FS_CLOSE_FUNCTION close;
 
+  // Left unset by read only filesystems
+  FS_WRITE_FUNCTION write;
+  FS_TRUNCATE_FUNCTION truncate;
+  FS_UNLINK_FUNCTION unlink;
+  FS_STATFS_FUNCTION statfs;
+
   char name[20];
 };
 
@@ -86,5 +115,9 @@ struct filesystem *fs_resolve (struct disk *disk);
 int fseek (int fd, int offset, FILE_SEEK_MODE whence);
 int fstat (int fd, struct file_stat *stat);
 int fclose (int fd);
+int fwrite (const void *ptr, uint32_t size, uint32_t nmemb, int fd);
+int ftruncate (int fd, uint32_t size);
+int funlink (const char *filename);
+int statfs (const char *path, struct fs_stat *stat);
 
 #endif
\ No newline at end of file
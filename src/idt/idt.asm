@@ -2,13 +2,19 @@ section .asm
 
 extern int21h_handler
 extern no_interrupt_handler
+extern page_fault_handler
+extern irq_handler
 
 global int21h
 global idt_load
 global no_interrupt
 global enable_interrupts
 global disable_interrupts
+global are_interrupts_enabled
+global wait_for_interrupt
 global isr80h_wrapper
+global page_fault
+global irq_stub_table
 extern isr80h_handler
 
 enable_interrupts:
@@ -19,6 +25,18 @@ disable_interrupts:
     cli
     ret
 
+are_interrupts_enabled:
+    pushfd
+    pop eax
+    shr eax, 9          ; IF is bit 9 of eflags
+    and eax, 1
+    ret
+
+wait_for_interrupt:
+    sti                 ; sti takes effect after the next instruction, so an
+    hlt                 ; interrupt can't slip in between the two
+    ret
+
 idt_load:
     push ebp         ; Save old ebp of caller (idt_init)
     mov ebp, esp     ; Set ebp to point to current stack frame
@@ -34,12 +52,53 @@ int21h:
     popad
     iret
 
+; One stub per PIC line for handlers registered at runtime, each passes its
+; IRQ number on to irq_handler
+%macro irq_stub 1
+irq%1:
+    pushad
+    push dword %1
+    call irq_handler
+    add esp, 4
+    popad
+    iret
+%endmacro
+
+irq_stub 0
+irq_stub 1
+irq_stub 2
+irq_stub 3
+irq_stub 4
+irq_stub 5
+irq_stub 6
+irq_stub 7
+irq_stub 8
+irq_stub 9
+irq_stub 10
+irq_stub 11
+irq_stub 12
+irq_stub 13
+irq_stub 14
+irq_stub 15
+
 no_interrupt:
     pushad
     call no_interrupt_handler
     popad
     iret
 
+page_fault:
+    ; The CPU pushed an error code after the return address
+    pushad
+    mov eax, cr2            ; faulting address
+    push eax
+    push dword [esp+36]     ; error code, above the 32 bytes of pushad + cr2
+    call page_fault_handler
+    add esp, 8
+    popad
+    add esp, 4              ; discard the error code before returning
+    iret
+
 isr80h_wrapper:
     ; INTERRUPT FRAME START
     ; ALREADY PUSHED TO US BY THE PROCESSOR UPON ENTRY TO THIS INTERRUPT
@@ -73,6 +132,10 @@ section .data
 ; Stores the return result from isr80h_handler
 tmp_res: dd 0
 
+irq_stub_table:
+    dd irq0, irq1, irq2, irq3, irq4, irq5, irq6, irq7
+    dd irq8, irq9, irq10, irq11, irq12, irq13, irq14, irq15
+
     
 
 
@@ -3,6 +3,7 @@
 #include "io/io.h"
 #include "kernel.h"
 #include "memory/memory.h"
+#include "task/process.h"
 #include "task/task.h"
 
 /**
@@ -23,6 +24,8 @@ struct idtr_desc idtr_descriptor;
 
 static ISR80H_COMMAND isr80h_commands[LAMEOS_MAX_ISR80H_COMMANDS];
 
+static IRQ_HANDLER irq_handlers[IDT_TOTAL_IRQS];
+
 
 /**
  * @brief Wrapper function for assembly routine idt_load.
@@ -39,6 +42,8 @@ extern void idt_load (struct idtr_desc *ptr);
 extern void int21h ();
 extern void no_interrupt ();
 extern void isr80h_wrapper();
+extern void page_fault ();
+extern void *irq_stub_table[IDT_TOTAL_IRQS];
 void
 int21h_handler ()
 {
@@ -46,6 +51,26 @@ int21h_handler ()
   outb (0x20, 0x20);
 }
 
+/**
+ * @brief Runs the handler registered for a PIC line and acknowledges it.
+ * @param irq The IRQ number, 0-15.
+ */
+void
+irq_handler (int irq)
+{
+  if (irq_handlers[irq])
+    {
+      irq_handlers[irq]();
+    }
+
+  // Lines 8-15 come through the slave PIC, it needs an EOI as well
+  if (irq >= 8)
+    {
+      outb (0xA0, 0x20);
+    }
+  outb (0x20, 0x20);
+}
+
 void
 no_interrupt_handler ()
 {
@@ -65,6 +90,30 @@ idt_zero ()
   print ("ERROR: divide by zero exception occurred.\n");
 }
 
+/**
+ * @brief Page Fault Handler, interrupt 14.
+ * Writes from userland to a copy-on-write page of a shared program image give
+ * the process its own copy of the page. Any other page fault is fatal.
+ * @param error_code The error code pushed by the CPU.
+ * @param fault_address The faulting linear address, read from CR2.
+ */
+void
+page_fault_handler (uint32_t error_code, void *fault_address)
+{
+  kernel_page ();
+  struct task *task = task_current ();
+  if ((error_code & PAGE_FAULT_ERROR_PRESENT)
+      && (error_code & PAGE_FAULT_ERROR_WRITE)
+      && (error_code & PAGE_FAULT_ERROR_USER) && task
+      && process_handle_cow_fault (task->process, fault_address) == 0)
+    {
+      task_page ();
+      return;
+    }
+
+  panic ("ERROR: unhandled page fault.\n");
+}
+
 /**
  * @brief Defines an IDT descriptor.
  * Defines a descriptor by setting the offset, selector, zero, type_attr, and
@@ -122,10 +171,22 @@ idt_init ()
   // set the interrupt 0 handler, divide by zero
   idt_set (0, idt_zero);
 
+  // set the interrupt 14 handler, page fault
+  idt_set (14, page_fault);
+
   // set the interrupt 0x21 handler, keyboard
   idt_set (0x21, int21h);
 
   idt_set(0x80, isr80h_wrapper);
+
+  // drivers may have registered IRQ handlers before the IDT was set up
+  for (int i = 0; i < IDT_TOTAL_IRQS; i++)
+    {
+      if (irq_handlers[i])
+        {
+          idt_set (IDT_IRQ_BASE + i, irq_stub_table[i]);
+        }
+    }
   //--------------------------------------
 
   // load the IDT
@@ -133,6 +194,23 @@ idt_init ()
 }
 
 
+/**
+ * @brief Routes a PIC line to a driver's handler. The EOI is sent for it.
+ * @param irq The IRQ number, 0-15, e.g. a PCI device's interrupt line.
+ * @param handler The function to call on each interrupt.
+ */
+void
+idt_register_irq_handler (int irq, IRQ_HANDLER handler)
+{
+  if (irq < 0 || irq >= IDT_TOTAL_IRQS)
+    {
+      panic ("The IRQ is out of bounds.\n");
+    }
+
+  irq_handlers[irq] = handler;
+  idt_set (IDT_IRQ_BASE + irq, irq_stub_table[irq]);
+}
+
 void isr80h_register_command(int command_id, ISR80H_COMMAND command)
 {
   if (command_id < 0 || command_id >= LAMEOS_MAX_ISR80H_COMMANDS)
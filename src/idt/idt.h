@@ -3,8 +3,20 @@
 #include <stdint.h>
 
 struct interrupt_frame;
+
+// Page fault error code bits, pushed by the CPU on interrupt 14
+#define PAGE_FAULT_ERROR_PRESENT 0b00000001
+#define PAGE_FAULT_ERROR_WRITE 0b00000010
+#define PAGE_FAULT_ERROR_USER 0b00000100
+
 typedef void*(*ISR80H_COMMAND)(struct interrupt_frame *frame);
 
+typedef void (*IRQ_HANDLER) ();
+
+// The PICs are remapped so IRQ 0-15 arrive on interrupts 0x20-0x2F
+#define IDT_IRQ_BASE 0x20
+#define IDT_TOTAL_IRQS 16
+
 
 
 /**
@@ -67,7 +79,10 @@ struct interrupt_frame
 void idt_init ();
 void enable_interrupts ();
 void disable_interrupts ();
+int are_interrupts_enabled ();
+void wait_for_interrupt ();
 void isr80h_register_command(int command_id, ISR80H_COMMAND command);
+void idt_register_irq_handler (int irq, IRQ_HANDLER handler);
 
 
 
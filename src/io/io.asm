@@ -4,6 +4,11 @@ global insb
 global insw
 global outb
 global outw
+global insdw
+global outdw
+global insw_rep
+global outsw_rep
+global read_tsc
 
 insb:
     push ebp           ; save old base pointer
@@ -49,6 +54,61 @@ outw:
     pop ebp            ; restore old base pointer, takes us back to caller
     ret                ; return to instruction immediately after call in caller
 
+insdw:
+    push ebp           ; save old base pointer
+    mov ebp, esp       ; set new base pointer to current stack pointer
+
+    mov edx, [ebp+8]   ; get port number
+    in eax, dx         ; read double word from port into eax
+
+    pop ebp            ; restore old base pointer, takes us back to caller
+    ret                ; return to instruction immediately after call in caller
+
+outdw:
+    push ebp           ; save old base pointer
+    mov ebp, esp       ; set new base pointer to current stack pointer
+
+    mov eax, [ebp+12]  ; store argument 2 in eax, the double word to write
+    mov edx, [ebp+8]   ; store argument 1 in edx, the port number
+    out dx, eax        ; write double word in eax to port
+
+    pop ebp            ; restore old base pointer, takes us back to caller
+    ret                ; return to instruction immediately after call in caller
+
+insw_rep:
+    push ebp           ; save old base pointer
+    mov ebp, esp       ; set new base pointer to current stack pointer
+    push edi           ; edi is callee-saved
+
+    mov edx, [ebp+8]   ; get port number
+    mov edi, [ebp+12]  ; get destination buffer
+    mov ecx, [ebp+16]  ; get count of words to read
+    cld                ; walk the buffer upwards
+    rep insw           ; read ecx words from port dx into es:edi
+
+    pop edi            ; restore edi
+    pop ebp            ; restore old base pointer, takes us back to caller
+    ret                ; return to instruction immediately after call in caller
+
+outsw_rep:
+    push ebp           ; save old base pointer
+    mov ebp, esp       ; set new base pointer to current stack pointer
+    push esi           ; esi is callee-saved
+
+    mov edx, [ebp+8]   ; get port number
+    mov esi, [ebp+12]  ; get source buffer
+    mov ecx, [ebp+16]  ; get count of words to write
+    cld                ; walk the buffer upwards
+    rep outsw          ; write ecx words from ds:esi to port dx
+
+    pop esi            ; restore esi
+    pop ebp            ; restore old base pointer, takes us back to caller
+    ret                ; return to instruction immediately after call in caller
+
+read_tsc:
+    rdtsc              ; cycle count in edx:eax, how cdecl returns 64 bits
+    ret                ; return to instruction immediately after call in caller
+
 
 
 
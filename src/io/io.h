@@ -38,4 +38,50 @@ void outb(unsigned short port, unsigned char val);
  */
 void outw(unsigned short port, unsigned short val);
 
+/**
+ * @brief C wrapper of the 32-bit `in` instruction
+ * Reads a double word in from a PIO port, e.g. PCI configuration space.
+ * @param port The PIO port to read from, range 0x0000 - 0xFFFF (0-65535).
+ * @return unsigned int, the double word read in from the port.
+ * @note This function is implemented in assembly. An int is 4 bytes.
+ */
+unsigned int insdw(unsigned short port);
+
+/**
+ * @brief C wrapper of the 32-bit `out` instruction
+ * Writes a double word out to a PIO port.
+ * @param port The PIO port to write to, range 0x0000 - 0xFFFF (0-65535).
+ * @param val The double word to write out to the port.
+ * @note This function is implemented in assembly. An int is 4 bytes.
+ */
+void outdw(unsigned short port, unsigned int val);
+
+/**
+ * @brief C wrapper of the `rep insw` instruction
+ * Reads a block of words in from a PIO port in a single string instruction.
+ * @param port The PIO port to read from, range 0x0000 - 0xFFFF (0-65535).
+ * @param buf The buffer to read into, must hold at least count words.
+ * @param count The number of words to read.
+ * @note This function is implemented in assembly. A short is 2 bytes.
+ */
+void insw_rep(unsigned short port, void *buf, unsigned int count);
+
+/**
+ * @brief C wrapper of the `rep outsw` instruction
+ * Writes a block of words out to a PIO port in a single string instruction.
+ * @param port The PIO port to write to, range 0x0000 - 0xFFFF (0-65535).
+ * @param buf The buffer to write from, must hold at least count words.
+ * @param count The number of words to write.
+ * @note This function is implemented in assembly. A short is 2 bytes.
+ */
+void outsw_rep(unsigned short port, const void *buf, unsigned int count);
+
+/**
+ * @brief C wrapper of the `rdtsc` instruction
+ * Reads the CPU's time stamp counter, the cycles since it was reset.
+ * @return unsigned long long, the 64-bit cycle count.
+ * @note This function is implemented in assembly.
+ */
+unsigned long long read_tsc();
+
 #endif
\ No newline at end of file
@@ -0,0 +1,32 @@
+#include "disk.h"
+#include "disk/disk.h"
+#include "kernel.h"
+#include "status.h"
+#include "task/task.h"
+
+/**
+ * @brief Copies a disk's struct disk_stats out to the caller.
+ * Takes the disk index, then a pointer to the caller's struct disk_stats.
+ */
+void *
+isr80h_command2_disk_stats (struct interrupt_frame *frame)
+{
+  int index = (int)task_get_stack_item (task_current (), 0);
+  void *user_space_stats = task_get_stack_item (task_current (), 1);
+
+  struct disk *idisk = disk_get (index);
+  if (!idisk)
+    {
+      return ERROR (-EINVARG);
+    }
+
+  struct disk_stats stats;
+  int res = disk_get_stats (idisk, &stats);
+  if (res < 0)
+    {
+      return ERROR (res);
+    }
+
+  return ERROR (copy_to_task (task_current (), user_space_stats, &stats,
+                              sizeof (stats)));
+}
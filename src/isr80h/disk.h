@@ -0,0 +1,8 @@
+#ifndef ISR80H_DISK_H
+#define ISR80H_DISK_H
+
+struct interrupt_frame;
+
+void *isr80h_command2_disk_stats (struct interrupt_frame *frame);
+
+#endif
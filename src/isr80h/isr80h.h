@@ -5,6 +5,7 @@ enum SystemCommands
 {
   SYSTEM_COMMAND0_SUM,
   SYSTEM_COMMAND1_PRINT,
+  SYSTEM_COMMAND2_DISK_STATS,
 };
 
 void isr80h_register_commands ();
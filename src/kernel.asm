@@ -27,10 +27,28 @@ _start:
     mov al, 0x20        ; Prepare al with PIC base interrupt vector, 0x20 (32) 
     out 0x21, al        ; Send base interrupt vector to the PIC data port, 0x21
 
+    mov al, 00000100b   ; ICW3, the slave PIC is cascaded on IRQ2
+    out 0x21, al
+
     mov al, 00000001b   ; Prepare to put the PIC in x86 protected mode
     out 0x21, al        ; Send command to put PIC in x86 protected mode
     ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 
+    ; Remap the Slave PIC, IRQs 8-15 (ATA disks are IRQ14 and IRQ15)
+    ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+    mov al, 00010001b   ; Prepare al with PIC initialization command
+    out 0xA0, al        ; Send initialization command to the slave PIC, ICW1
+
+    mov al, 0x28        ; Prepare al with slave base interrupt vector, 0x28 (40)
+    out 0xA1, al        ; Send base interrupt vector to the slave data port
+
+    mov al, 00000010b   ; ICW3, the slave's cascade identity is 2
+    out 0xA1, al
+
+    mov al, 00000001b   ; Prepare to put the slave PIC in x86 protected mode
+    out 0xA1, al        ; Send command to put slave PIC in x86 protected mode
+    ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
     call kernel_main    ; Call the kernel's main function
 
     jmp $               ; After kernel_main returns, hang
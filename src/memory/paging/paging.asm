@@ -17,7 +17,8 @@ enable_paging:
   push ebp
   mov ebp, esp
   mov eax, cr0
-  or eax, 0x80000000
+  ; PG, and WP so ring 0 writes honour read-only and copy-on-write pages
+  or eax, 0x80010000
   mov cr0, eax
   pop ebp
   ret
\ No newline at end of file
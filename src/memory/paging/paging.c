@@ -23,7 +23,8 @@ static uint32_t *current_directory = 0;
  * offset address.
  *    - It updates the offset for the next page table.
  *    - It stores the address of the page table in the current directory entry,
- * marking it as writeable.
+ * marking it as writeable and user accessible, so the page table entries
+ * alone decide who may access a page.
  *
  * 3. Lastly, it allocates memory for the 4GB chunk structure, stores the
  * address of the page directory in it, and returns this structure.
@@ -49,7 +50,8 @@ paging_new_4gb (uint8_t flags)
           entry[b] = (offset + (b * PAGING_PAGE_SIZE)) | flags;
         }
       offset += (PAGING_TOTAL_ENTRIES_PER_TABLE * PAGING_PAGE_SIZE);
-      directory[i] = (uint32_t)entry | flags | PAGING_IS_WRITEABLE;
+      directory[i] = (uint32_t)entry | flags | PAGING_IS_WRITEABLE
+                     | PAGING_ACCESS_FROM_ALL;
     }
 
   struct paging_4gb_chunk *chunk_4gb
@@ -131,6 +133,14 @@ paging_align_address (void *ptr)
   return ptr;
 }
 
+void *
+paging_align_to_lower_page (void *addr)
+{
+  uint32_t _addr = (uint32_t)addr;
+  _addr -= (_addr % PAGING_PAGE_SIZE);
+  return (void *)_addr;
+}
+
 int
 paging_map (struct paging_4gb_chunk *directory, void *virt, void *phys,
             int flags)
@@ -4,6 +4,9 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Available-to-software bit, marks a read-only page that is shared until
+// the first write to it.
+#define PAGING_COPY_ON_WRITE 0b1000000000
 #define PAGING_CACHE_DISABLED 0b00010000
 #define PAGING_WRITE_THROUGH 0b00001000
 #define PAGING_ACCESS_FROM_ALL 0b00000100
@@ -43,6 +46,8 @@ int paging_map (struct paging_4gb_chunk *directory, void *virt, void *phys,
 
 void *paging_align_address (void *ptr);
 
+void *paging_align_to_lower_page (void *addr);
+
 uint32_t paging_get (uint32_t *directory, void *virt);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,184 @@
+#include "pci.h"
+#include "io/io.h"
+#include "memory/memory.h"
+#include "status.h"
+
+#define PCI_TOTAL_BUSES 256
+#define PCI_TOTAL_SLOTS 32
+#define PCI_TOTAL_FUNCTIONS 8
+
+// Set in the header type of a device that implements functions 1-7
+#define PCI_HEADER_MULTI_FUNCTION 0x80
+
+static uint32_t
+pci_config_address (uint8_t bus, uint8_t slot, uint8_t function,
+                    uint8_t offset)
+{
+  return 0x80000000 | (bus << 16) | (slot << 11) | (function << 8)
+         | (offset & 0xFC);
+}
+
+static uint32_t
+pci_read (uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset)
+{
+  outdw (PCI_CONFIG_ADDRESS, pci_config_address (bus, slot, function, offset));
+  return insdw (PCI_CONFIG_DATA) >> ((offset & 0x03) * 8);
+}
+
+/**
+ * @brief Reads configuration space of a device.
+ * @param offset Byte offset into configuration space. Unaligned offsets
+ * return the register shifted down so the addressed byte is in the low bits.
+ */
+uint32_t
+pci_config_read (struct pci_device *device, uint8_t offset)
+{
+  return pci_read (device->bus, device->slot, device->function, offset);
+}
+
+void
+pci_config_write (struct pci_device *device, uint8_t offset, uint32_t value)
+{
+  outdw (PCI_CONFIG_ADDRESS,
+         pci_config_address (device->bus, device->slot, device->function,
+                             offset));
+  outdw (PCI_CONFIG_DATA, value);
+}
+
+static void
+pci_load_device (uint8_t bus, uint8_t slot, uint8_t function,
+                 struct pci_device *device)
+{
+  memset (device, 0, sizeof (struct pci_device));
+  device->bus = bus;
+  device->slot = slot;
+  device->function = function;
+  device->vendor_id = pci_read (bus, slot, function, PCI_VENDOR_ID) & 0xFFFF;
+  device->device_id = pci_read (bus, slot, function, PCI_DEVICE_ID) & 0xFFFF;
+  device->class_code = pci_read (bus, slot, function, PCI_CLASS) & 0xFF;
+  device->subclass = pci_read (bus, slot, function, PCI_SUBCLASS) & 0xFF;
+  device->prog_if = pci_read (bus, slot, function, PCI_PROG_IF) & 0xFF;
+  device->interrupt_line
+      = pci_read (bus, slot, function, PCI_INTERRUPT_LINE) & 0xFF;
+  for (int i = 0; i < PCI_TOTAL_BARS; i++)
+    {
+      device->bars[i] = pci_read (bus, slot, function, PCI_BAR0 + (i * 4));
+    }
+}
+
+typedef int (*PCI_MATCH_FUNCTION) (struct pci_device *device, uint32_t a,
+                                   uint32_t b);
+
+/**
+ * @brief Walks every function on every bus, returning the index'th match.
+ * @return int LAMEOS_OK if found, -EIO otherwise.
+ */
+static int
+pci_find (PCI_MATCH_FUNCTION match, uint32_t a, uint32_t b, int index,
+          struct pci_device *device_out)
+{
+  for (int bus = 0; bus < PCI_TOTAL_BUSES; bus++)
+    {
+      for (int slot = 0; slot < PCI_TOTAL_SLOTS; slot++)
+        {
+          if ((pci_read (bus, slot, 0, PCI_VENDOR_ID) & 0xFFFF) == 0xFFFF)
+            {
+              continue;
+            }
+
+          int functions = 1;
+          if (pci_read (bus, slot, 0, PCI_HEADER_TYPE)
+              & PCI_HEADER_MULTI_FUNCTION)
+            {
+              functions = PCI_TOTAL_FUNCTIONS;
+            }
+
+          for (int function = 0; function < functions; function++)
+            {
+              if ((pci_read (bus, slot, function, PCI_VENDOR_ID) & 0xFFFF)
+                  == 0xFFFF)
+                {
+                  continue;
+                }
+
+              pci_load_device (bus, slot, function, device_out);
+              if (match (device_out, a, b) && index-- == 0)
+                {
+                  return LAMEOS_OK;
+                }
+            }
+        }
+    }
+
+  return -EIO;
+}
+
+static int
+pci_match_class (struct pci_device *device, uint32_t class_code,
+                 uint32_t subclass)
+{
+  return device->class_code == class_code && device->subclass == subclass;
+}
+
+static int
+pci_match_id (struct pci_device *device, uint32_t vendor_id,
+              uint32_t device_id)
+{
+  return device->vendor_id == vendor_id && device->device_id == device_id;
+}
+
+int
+pci_find_class (uint8_t class_code, uint8_t subclass, int index,
+                struct pci_device *device_out)
+{
+  return pci_find (pci_match_class, class_code, subclass, index, device_out);
+}
+
+int
+pci_find_id (uint16_t vendor_id, uint16_t device_id, int index,
+             struct pci_device *device_out)
+{
+  return pci_find (pci_match_id, vendor_id, device_id, index, device_out);
+}
+
+/**
+ * @brief Lets the device decode its ports and memory and master the bus,
+ * required before it can DMA.
+ */
+void
+pci_enable_bus_master (struct pci_device *device)
+{
+  uint32_t command = pci_config_read (device, PCI_COMMAND);
+  command |= PCI_COMMAND_IO_SPACE | PCI_COMMAND_MEMORY_SPACE
+             | PCI_COMMAND_BUS_MASTER;
+  pci_config_write (device, PCI_COMMAND, command);
+}
+
+/**
+ * @brief The I/O port base decoded by a BAR, 0 if it's a memory BAR.
+ */
+uint32_t
+pci_bar_io_base (struct pci_device *device, int bar)
+{
+  if (!(device->bars[bar] & PCI_BAR_IO))
+    {
+      return 0;
+    }
+
+  return device->bars[bar] & 0xFFFFFFFC;
+}
+
+/**
+ * @brief The physical address decoded by a 32-bit memory BAR, 0 if it's an
+ * I/O BAR.
+ */
+uint32_t
+pci_bar_mem_base (struct pci_device *device, int bar)
+{
+  if (device->bars[bar] & PCI_BAR_IO)
+    {
+      return 0;
+    }
+
+  return device->bars[bar] & 0xFFFFFFF0;
+}
@@ -0,0 +1,61 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+// Configuration space offsets
+#define PCI_VENDOR_ID 0x00
+#define PCI_DEVICE_ID 0x02
+#define PCI_COMMAND 0x04
+#define PCI_PROG_IF 0x09
+#define PCI_SUBCLASS 0x0A
+#define PCI_CLASS 0x0B
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_BAR0 0x10
+#define PCI_INTERRUPT_LINE 0x3C
+
+// Command register bits
+#define PCI_COMMAND_IO_SPACE 0x0001
+#define PCI_COMMAND_MEMORY_SPACE 0x0002
+#define PCI_COMMAND_BUS_MASTER 0x0004
+
+#define PCI_CLASS_MASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+#define PCI_SUBCLASS_SATA 0x06
+
+// Set in a BAR that decodes I/O ports rather than memory
+#define PCI_BAR_IO 0x01
+
+#define PCI_TOTAL_BARS 6
+
+struct pci_device
+{
+  uint8_t bus;
+  uint8_t slot;
+  uint8_t function;
+
+  uint16_t vendor_id;
+  uint16_t device_id;
+  uint8_t class_code;
+  uint8_t subclass;
+  uint8_t prog_if;
+  uint8_t interrupt_line;
+
+  uint32_t bars[PCI_TOTAL_BARS];
+};
+
+uint32_t pci_config_read (struct pci_device *device, uint8_t offset);
+void pci_config_write (struct pci_device *device, uint8_t offset,
+                       uint32_t value);
+int pci_find_class (uint8_t class_code, uint8_t subclass, int index,
+                    struct pci_device *device_out);
+int pci_find_id (uint16_t vendor_id, uint16_t device_id, int index,
+                 struct pci_device *device_out);
+void pci_enable_bus_master (struct pci_device *device);
+uint32_t pci_bar_io_base (struct pci_device *device, int bar);
+uint32_t pci_bar_mem_base (struct pci_device *device, int bar);
+
+#endif
@@ -45,4 +45,7 @@
 
 #define EISTKN 8
 
+// No free clusters left on the disk
+#define ENOSPC 9
+
 #endif
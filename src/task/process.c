@@ -14,6 +14,10 @@ struct process *current_process = 0;
 
 static struct process *processes[LAMEOS_MAX_PROCESSES] = {};
 
+// Program images shared between processes, keyed by path, size and the
+// generation of the file when it was read
+static struct process_image *process_images[LAMEOS_MAX_PROCESSES] = {};
+
 static void
 process_init (struct process *process)
 {
@@ -37,6 +41,109 @@ process_get (int process_id)
   return processes[process_id];
 }
 
+static struct process_image *
+process_image_find (const char *filename, struct file_stat *stat)
+{
+  for (int i = 0; i < LAMEOS_MAX_PROCESSES; i++)
+    {
+      struct process_image *image = process_images[i];
+      if (image && image->size == stat->filesize
+          && image->generation == stat->generation
+          && strncmp (image->filename, filename, sizeof (image->filename))
+                 == 0)
+        {
+          return image;
+        }
+    }
+
+  return 0;
+}
+
+static int
+process_image_get_free_slot ()
+{
+  for (int i = 0; i < LAMEOS_MAX_PROCESSES; i++)
+    {
+      if (process_images[i] == 0)
+        return i;
+    }
+
+  return -EISTKN;
+}
+
+static int
+process_image_new (int fd, const char *filename, struct file_stat *stat,
+                   struct process_image **image_out)
+{
+  int res = 0;
+  uint32_t size = stat->filesize;
+  struct process_image *image = 0;
+  int slot = process_image_get_free_slot ();
+  if (slot < 0)
+    {
+      res = slot;
+      goto out;
+    }
+
+  image = kzalloc (sizeof (struct process_image));
+  if (!image)
+    {
+      res = -ENOMEM;
+      goto out;
+    }
+
+  image->ptr = kzalloc (size);
+  if (!image->ptr)
+    {
+      res = -ENOMEM;
+      goto out;
+    }
+
+  if (fread (image->ptr, size, 1, fd) != 1)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  strncpy (image->filename, filename, sizeof (image->filename));
+  image->size = size;
+  image->generation = stat->generation;
+  process_images[slot] = image;
+  *image_out = image;
+
+out:
+  if (res < 0 && image)
+    {
+      if (image->ptr)
+        {
+          kfree (image->ptr);
+        }
+      kfree (image);
+    }
+  return res;
+}
+
+static void
+process_image_release (struct process_image *image)
+{
+  image->refcount--;
+  if (image->refcount > 0)
+    {
+      return;
+    }
+
+  for (int i = 0; i < LAMEOS_MAX_PROCESSES; i++)
+    {
+      if (process_images[i] == image)
+        {
+          process_images[i] = 0;
+        }
+    }
+
+  kfree (image->ptr);
+  kfree (image);
+}
+
 static int
 process_load_binary (const char *filename, struct process *process)
 {
@@ -56,21 +163,22 @@ process_load_binary (const char *filename, struct process *process)
       goto out;
     }
 
-  void *program_data_ptr = kzalloc (stat.filesize);
-  if (!program_data_ptr)
+  // Another process running the same file already has the image in memory,
+  // unless the file was written since
+  struct process_image *image = process_image_find (filename, &stat);
+  if (!image)
     {
-      res = -ENOMEM;
-      goto out;
-    }
-
-  if (fread (program_data_ptr, stat.filesize, 1, fd) != 1)
-    {
-      res = -EIO;
-      goto out;
+      res = process_image_new (fd, filename, &stat, &image);
+      if (res < 0)
+        {
+          goto out;
+        }
     }
 
-  process->ptr = program_data_ptr;
-  process->size = stat.filesize;
+  image->refcount++;
+  process->image = image;
+  process->ptr = image->ptr;
+  process->size = image->size;
 
 out:
   fclose (fd);
@@ -85,14 +193,131 @@ process_load_data (const char *filename, struct process *process)
   return res;
 }
 
+static int
+process_allocation_add (struct process *process, void *ptr)
+{
+  for (int i = 0; i < LAMEOS_MAX_PROGRAM_ALLOCATIONS; i++)
+    {
+      if (process->allocations[i] == 0)
+        {
+          process->allocations[i] = ptr;
+          return 0;
+        }
+    }
+
+  return -ENOMEM;
+}
+
 int
 process_map_binary (struct process *process)
 {
   int res = 0;
+  // The image is shared, so it's mapped read-only. A write gives the process
+  // its own copy of the page, see process_handle_cow_fault().
   paging_map_to (
       process->task->page_directory, (void *)LAMEOS_PROGRAM_VIRTUAL_ADDRESS,
       process->ptr, paging_align_address (process->ptr + process->size),
-      (PAGING_IS_PRESENT | PAGING_ACCESS_FROM_ALL | PAGING_IS_WRITEABLE));
+      (PAGING_IS_PRESENT | PAGING_ACCESS_FROM_ALL | PAGING_COPY_ON_WRITE));
+  return res;
+}
+
+int
+process_handle_cow_fault (struct process *process, void *virt)
+{
+  int res = 0;
+  void *page = paging_align_to_lower_page (virt);
+  struct paging_4gb_chunk *directory = process->task->page_directory;
+  uint32_t entry = paging_get (directory->directory_entry, page);
+  if (!(entry & PAGING_IS_PRESENT) || !(entry & PAGING_COPY_ON_WRITE))
+    {
+      res = -EINVARG;
+      goto out;
+    }
+
+  void *shared_page = (void *)(entry & 0xfffff000);
+  void *private_page = kmalloc (PAGING_PAGE_SIZE);
+  if (!private_page)
+    {
+      res = -ENOMEM;
+      goto out;
+    }
+
+  res = process_allocation_add (process, private_page);
+  if (res < 0)
+    {
+      kfree (private_page);
+      goto out;
+    }
+
+  memcpy (private_page, shared_page, PAGING_PAGE_SIZE);
+  res = paging_map (directory, page, private_page,
+                    PAGING_IS_PRESENT | PAGING_ACCESS_FROM_ALL
+                        | PAGING_IS_WRITEABLE);
+
+out:
+  return res;
+}
+
+static int
+process_user_range_contains (uint32_t start, uint32_t end, uint32_t addr,
+                             uint32_t size)
+{
+  return addr >= start && addr < end && size <= end - addr;
+}
+
+/**
+ * @brief Checks that size bytes at a userland address lie in the process's
+ * program image or stack and that it may write them, so the kernel can
+ * write there on its behalf. Copy-on-write pages in the range get their
+ * private copy first, the shared image is never written.
+ */
+int
+process_prepare_user_write (struct process *process, void *virt,
+                            uint32_t size)
+{
+  int res = 0;
+  uint32_t addr = (uint32_t)virt;
+  uint32_t program_end
+      = (uint32_t)paging_align_address (
+            (void *)(LAMEOS_PROGRAM_VIRTUAL_ADDRESS + process->size));
+  if (size == 0
+      || (!process_user_range_contains (LAMEOS_PROGRAM_VIRTUAL_ADDRESS,
+                                        program_end, addr, size)
+          && !process_user_range_contains (
+              LAMEOS_PROGRAM_VIRTUAL_STACK_ADDRESS_END,
+              LAMEOS_PROGRAM_VIRTUAL_STACK_ADDRESS_START, addr, size)))
+    {
+      res = -EINVARG;
+      goto out;
+    }
+
+  uint32_t *directory = process->task->page_directory->directory_entry;
+  for (uint32_t page = (uint32_t)paging_align_to_lower_page (virt);
+       page < addr + size; page += PAGING_PAGE_SIZE)
+    {
+      uint32_t entry = paging_get (directory, (void *)page);
+      if (!(entry & PAGING_IS_PRESENT) || !(entry & PAGING_ACCESS_FROM_ALL))
+        {
+          res = -EINVARG;
+          goto out;
+        }
+
+      if (entry & PAGING_COPY_ON_WRITE)
+        {
+          res = process_handle_cow_fault (process, (void *)page);
+          if (res < 0)
+            {
+              goto out;
+            }
+        }
+      else if (!(entry & PAGING_IS_WRITEABLE))
+        {
+          res = -EINVARG;
+          goto out;
+        }
+    }
+
+out:
   return res;
 }
 
@@ -151,7 +376,7 @@ process_load_for_slot (const char *filename, struct process **process,
 {
   int res = 0;
   struct task *task = 0;
-  struct process *_process;
+  struct process *_process = 0;
   void *program_stack_ptr = 0;
 
   if (process_get (process_slot) != 0)
@@ -214,6 +439,11 @@ out:
           task_free (_process->task);
         }
 
+      if (_process && _process->image)
+        {
+          process_image_release (_process->image);
+        }
+
       // Free the process data
     }
   return res;
@@ -4,6 +4,25 @@
 #include "task.h"
 #include <stdint.h>
 
+// A program image loaded from disk, shared between every process that runs
+// the same file. Its pages are mapped copy-on-write into each process.
+struct process_image
+{
+  char filename[LAMEOS_MAX_PATH];
+
+  // The size of the file the image was loaded from
+  uint32_t size;
+
+  // The file's struct file_stat generation when the image was loaded
+  uint32_t generation;
+
+  // The physical pointer to the image memory
+  void *ptr;
+
+  // The total processes currently mapping this image
+  int refcount;
+};
+
 struct process
 {
   // The process id
@@ -17,6 +36,9 @@ struct process
   // Whenever the process mallocs, add the physical address to this array
   void *allocations[LAMEOS_MAX_PROGRAM_ALLOCATIONS];
 
+  // The shared program image this process was loaded from
+  struct process_image *image;
+
   // The physical pointer to the process memory
   void *ptr;
 
@@ -30,6 +52,9 @@ struct process
 int process_load_for_slot (const char *filename, struct process **process,
                            int process_slot);
 int process_load (const char *filename, struct process **process);
+int process_handle_cow_fault (struct process *process, void *virt);
+int process_prepare_user_write (struct process *process, void *virt,
+                                uint32_t size);
 
 
 
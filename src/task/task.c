@@ -174,6 +174,55 @@ out:
   return res;
 }
 
+/**
+ * @brief Copies size bytes from kernel memory out to the task's virtual
+ * address, the reverse of copy_string_from_task. The address must be one
+ * the task itself may write.
+ */
+int
+copy_to_task (struct task *task, void *virtual, const void *phys, int size)
+{
+  if (size <= 0 || size >= PAGING_PAGE_SIZE)
+    {
+      return -EINVARG;
+    }
+
+  int res = process_prepare_user_write (task->process, virtual, size);
+  if (res < 0)
+    {
+      goto out;
+    }
+
+  char *tmp = kzalloc (size);
+  if (!tmp)
+    {
+      res = -ENOMEM;
+      goto out;
+    }
+
+  memcpy (tmp, (void *)phys, size);
+
+  uint32_t *task_directory = task->page_directory->directory_entry;
+  uint32_t old_entry = paging_get (task_directory, tmp);
+  paging_map (task->page_directory, tmp, tmp,
+              PAGING_IS_WRITEABLE | PAGING_IS_PRESENT
+                  | PAGING_ACCESS_FROM_ALL);
+  paging_switch (task->page_directory);
+  memcpy (virtual, tmp, size);
+  kernel_page ();
+
+  res = paging_set (task_directory, tmp, old_entry);
+  if (res < 0)
+    {
+      res = -EIO;
+    }
+
+  kfree (tmp);
+
+out:
+  return res;
+}
+
 void
 task_current_save_state (struct interrupt_frame *frame)
 {
@@ -218,9 +267,11 @@ task_init (struct task *task, struct process *process)
 {
   memset (task, 0, sizeof (struct task));
 
-  // Map the entire 4GB address space to itself
+  // Map the entire 4GB address space to itself. CR0.WP is set, so the kernel
+  // needs it writeable to take interrupts on this directory, and it's kept
+  // out of reach of userland.
   task->page_directory
-      = paging_new_4gb (PAGING_IS_PRESENT | PAGING_ACCESS_FROM_ALL);
+      = paging_new_4gb (PAGING_IS_PRESENT | PAGING_IS_WRITEABLE);
 
   if (!task->page_directory)
     {
@@ -56,6 +56,8 @@ int task_page ();
 void task_current_save_state (struct interrupt_frame *frame);
 int copy_string_from_task (struct task *task, void *virtual, void *phys,
                            int max);
+int copy_to_task (struct task *task, void *virtual, const void *phys,
+                  int size);
 int task_page_task (struct task *task);
 
 